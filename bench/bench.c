@@ -0,0 +1,70 @@
+// Parsing throughput, through the public API only: each workload is written in 4 KB chunks (as read from a PTY),
+// and the events are read after each chunk, as a host would do every frame.
+
+#define _POSIX_C_SOURCE 200809L
+#include "libvirtterm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DATA_SZ (8 * 1024 * 1024)
+#define ROWS    50
+#define COLUMNS 160
+
+typedef size_t (*Generator)(char* buf, size_t i);
+
+static size_t plain_text(char* buf, size_t i)    // ls -l, cat: lines scrolling up
+{
+    return sprintf(buf, "-rw-r--r-- 1 user user %8zu Jan  1 00:00 file_number_%zu.txt\r\n", i * 7919 % 100000, i);
+}
+
+static size_t full_screen(char* buf, size_t i)   // htop, vim: cursor positioning and colors everywhere
+{
+    return sprintf(buf, "\e[%zu;%zuH\e[1;3%zu;4%zumCPU%zu [||||||||     %zu%%]\e[0m ",
+                   i % ROWS + 1, i * 17 % (COLUMNS - 30) + 1, i % 8, i / 8 % 8, i % 64, i % 100);
+}
+
+static size_t attributes(char* buf, size_t i)    // colored compiler output, ls --color
+{
+    return sprintf(buf, "\e[0m\e[%dm\e[3%zum%s\e[0m: \e[1mwarning\e[22m: unused variable\r\n",
+                   i % 2 ? 1 : 22, i % 8, i % 3 ? "src/file.c" : "include/header.h");
+}
+
+static double run(Generator generate)
+{
+    char* data = malloc(DATA_SZ + 256);
+    size_t sz = 0;
+    for (size_t i = 0; sz < DATA_SZ; ++i)
+        sz += generate(&data[sz], i);
+
+    VTConfig config = VT_DEFAULT_CONFIG;
+    config.scrollback_lines = 1000;
+    VT* vt = vt_new(ROWS, COLUMNS, &config, NULL);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < sz; i += 4096) {
+        vt_write(vt, &data[i], sz - i < 4096 ? sz - i : 4096);
+        while (vt_next_event(vt, NULL));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    vt_free(vt);
+    free(data);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return sz / seconds / (1024 * 1024);
+}
+
+int main(void)
+{
+    struct { const char* name; Generator generate; } workloads[] = {
+        { "plain text", plain_text },
+        { "full screen", full_screen },
+        { "attributes", attributes },
+    };
+
+    for (size_t i = 0; i < sizeof workloads / sizeof workloads[0]; ++i)
+        printf("%-12s %8.1f MB/s\n", workloads[i].name, run(workloads[i].generate));
+}
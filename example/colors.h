@@ -4,28 +4,12 @@
 #include <SDL3/SDL.h>
 #include "../libvirtterm.h"
 
-// Enum for the 16 standard terminal colors
+// The palette is kept by the terminal, as applications can change it (OSC 4)
 
-static const SDL_Color terminal_colors[] = {
-    // Normal colors
-    {0x00, 0x00, 0x00, 0xFF}, // TERM_BLACK
-    {0x80, 0x00, 0x00, 0xFF}, // TERM_RED
-    {0x00, 0x80, 0x00, 0xFF}, // TERM_GREEN
-    {0x80, 0x80, 0x00, 0xFF}, // TERM_YELLOW
-    {0x00, 0x00, 0xa0, 0xFF}, // TERM_BLUE
-    {0x80, 0x00, 0x80, 0xFF}, // TERM_MAGENTA
-    {0x00, 0x80, 0x80, 0xFF}, // TERM_CYAN
-    {0xC0, 0xC0, 0xC0, 0xFF}, // TERM_WHITE
-
-    // Bright colors
-    {0x80, 0x80, 0x80, 0xFF}, // TERM_BRIGHT_BLACK (gray)
-    {0xFF, 0x00, 0x00, 0xFF}, // TERM_BRIGHT_RED
-    {0x00, 0xFF, 0x00, 0xFF}, // TERM_BRIGHT_GREEN
-    {0xFF, 0xFF, 0x00, 0xFF}, // TERM_BRIGHT_YELLOW
-    {0x50, 0x50, 0xFF, 0xFF}, // TERM_BRIGHT_BLUE
-    {0xFF, 0x00, 0xFF, 0xFF}, // TERM_BRIGHT_MAGENTA
-    {0x00, 0xFF, 0xFF, 0xFF}, // TERM_BRIGHT_CYAN
-    {0xFF, 0xFF, 0xFF, 0xFF}  // TERM_BRIGHT_WHITE
-};
+static inline SDL_Color terminal_color(VT* vt, int index)
+{
+    uint32_t rgb = vt_color_rgb(vt, index);
+    return (SDL_Color) { (rgb >> 16) & 0xFF, (rgb >> 8) & 0xFF, rgb & 0xFF, 0xFF };
+}
 
 #endif //COLORS_H
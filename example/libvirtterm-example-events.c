@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <SDL3/SDL_assert.h>
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_main.h>
@@ -135,7 +136,7 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[])
     config.acs_chars[0x1c] = 0xf0;  // not equals
     config.acs_chars[0x1d] = 0x9c;  // pound sterling
     config.acs_chars[0x1e] = 0xfa;  // center dot
-    vt = vt_new((h - BORDER*2) / FONT_H / ZOOM, (w - BORDER*2) / FONT_W / ZOOM, &config);
+    vt = vt_new((h - BORDER*2) / FONT_H / ZOOM, (w - BORDER*2) / FONT_W / ZOOM, &config, NULL);
 
     //
     // initialize VTPTY
@@ -174,7 +175,22 @@ static uint16_t translate_key(SDL_Keycode key)
         case SDLK_BACKSPACE:              return VT_BACKSPACE;
         case SDLK_TAB:                    return VT_TAB;
         case SDLK_DELETE:                 return VT_DELETE;
-        case SDLK_KP_ENTER:               return '\r';
+        case SDLK_KP_0:                   return VT_KP_0;
+        case SDLK_KP_1:                   return VT_KP_1;
+        case SDLK_KP_2:                   return VT_KP_2;
+        case SDLK_KP_3:                   return VT_KP_3;
+        case SDLK_KP_4:                   return VT_KP_4;
+        case SDLK_KP_5:                   return VT_KP_5;
+        case SDLK_KP_6:                   return VT_KP_6;
+        case SDLK_KP_7:                   return VT_KP_7;
+        case SDLK_KP_8:                   return VT_KP_8;
+        case SDLK_KP_9:                   return VT_KP_9;
+        case SDLK_KP_PERIOD:              return VT_KP_DECIMAL;
+        case SDLK_KP_DIVIDE:              return VT_KP_DIVIDE;
+        case SDLK_KP_MULTIPLY:            return VT_KP_MULTIPLY;
+        case SDLK_KP_MINUS:               return VT_KP_MINUS;
+        case SDLK_KP_PLUS:                return VT_KP_PLUS;
+        case SDLK_KP_ENTER:               return VT_KP_ENTER;
         default:
             return key < 0xff ? key : 0;
     }
@@ -204,12 +220,14 @@ SDL_AppResult mouse_event(SDL_Event* event)
 
     mstate.column = (x - BORDER) / FONT_W / ZOOM;
     mstate.row = (y - BORDER) / FONT_H / ZOOM;
+    mstate.x = (x - BORDER) / ZOOM;
+    mstate.y = (y - BORDER) / ZOOM;
 
     mstate.button[VTM_LEFT] = (bflags & SDL_BUTTON_LMASK) ? true : false;
     mstate.button[VTM_MIDDLE] = (bflags & SDL_BUTTON_MMASK) ? true : false;
     mstate.button[VTM_RIGHT] = (bflags & SDL_BUTTON_RMASK) ? true : false;
-    mstate.button[VTM_SCROLL_DOWN] = event->type == SDL_EVENT_MOUSE_WHEEL && event->wheel.integer_y < 0;
-    mstate.button[VTM_SCROLL_UP] = event->type == SDL_EVENT_MOUSE_WHEEL && event->wheel.integer_y > 0;
+    mstate.button[VTM_SCROLL_DOWN] = false;
+    mstate.button[VTM_SCROLL_UP] = false;
 
     SDL_Keymod kmod = SDL_GetModState();
     mstate.mod = 0;
@@ -217,6 +235,8 @@ SDL_AppResult mouse_event(SDL_Event* event)
     if (kmod & SDL_KMOD_ALT) mstate.mod |= VTM_ALT;
     if (kmod & SDL_KMOD_CTRL) mstate.mod |= VTM_CTRL;
 
+    if (event->type == SDL_EVENT_MOUSE_WHEEL)   // trackpads scroll by fractions of a line
+        return vtpty_do(vtpty_update_mouse_wheel(vtpty, mstate, event->wheel.y));
     return vtpty_do(vtpty_update_mouse_state(vtpty, mstate));
 }
 
@@ -229,7 +249,10 @@ SDL_AppResult SDL_AppEvent(void *appstate, SDL_Event *event)
         case SDL_EVENT_KEY_DOWN: {
             SDL_Keycode keycode = SDL_GetKeyFromScancode(event->key.scancode, event->key.mod, false);
             uint16_t key = translate_key(keycode);
-            return vtpty_do(vtpty_keypress(vtpty, key, event->key.mod & SDL_KMOD_SHIFT, event->key.mod & SDL_KMOD_CTRL));
+            int mod = ((event->key.mod & SDL_KMOD_SHIFT) ? VTK_SHIFT : 0)
+                    | ((event->key.mod & SDL_KMOD_ALT) ? VTK_ALT : 0)
+                    | ((event->key.mod & SDL_KMOD_CTRL) ? VTK_CTRL : 0);
+            return vtpty_do(vtpty_keypress_mod(vtpty, key, mod));
         }
         case SDL_EVENT_WINDOW_RESIZED: {
             int w = event->window.data1;
@@ -242,6 +265,9 @@ SDL_AppResult SDL_AppEvent(void *appstate, SDL_Event *event)
         case SDL_EVENT_MOUSE_BUTTON_DOWN:
         case SDL_EVENT_MOUSE_WHEEL:
             return mouse_event(event);
+        case SDL_EVENT_WINDOW_FOCUS_GAINED:
+        case SDL_EVENT_WINDOW_FOCUS_LOST:
+            return vtpty_do(vtpty_update_focus(vtpty, event->type == SDL_EVENT_WINDOW_FOCUS_GAINED));
         case SDL_EVENT_QUIT:
             return SDL_APP_SUCCESS;
     }
@@ -257,13 +283,13 @@ static void draw_char(size_t row, size_t column)
     SDL_FRect dest = { column * FONT_W * ZOOM + BORDER, row * FONT_H * ZOOM + BORDER, FONT_W * ZOOM, FONT_H * ZOOM };
 
     // draw bg
-    SDL_Color bg = terminal_colors[chr.attrib.bg_color];
+    SDL_Color bg = terminal_color(vt, chr.attrib.bg_color);
     SDL_SetRenderDrawColor(ren, bg.r, bg.g, bg.b, SDL_ALPHA_OPAQUE);
     SDL_RenderFillRect(ren, &dest);
 
     // draw character
     if (chr.ch != 0) {
-        SDL_Color fg = terminal_colors[chr.attrib.fg_color];
+        SDL_Color fg = terminal_color(vt, chr.attrib.fg_color);
         if (chr.attrib.dim) { fg.r *= 0.6; fg.g *= 0.6; fg.b *= 0.6; }
         SDL_SetTextureColorMod(font, fg.r, fg.g, fg.b);
         SDL_RenderTexture(ren, font, &origin, &dest);
@@ -301,6 +327,14 @@ SDL_AppResult SDL_AppIterate(void *appstate)
             if (e.text_received.type == VTT_WINDOW_TITLE_UPDATED)
                 SDL_SetWindowTitle(window, e.text_received.text);
             free((void *) e.text_received.text);
+        } else if (e.type == VT_EVENT_SCROLLED) {
+            // move the rows we already have - the rows uncovered come next as a CELLS_UPDATED event
+            INT height = e.scroll.row_end - e.scroll.row_start + 1;
+            INT n = e.scroll.rows > 0 ? e.scroll.rows : -e.scroll.rows;
+            if (e.scroll.rows > 0)
+                memmove(cells[e.scroll.row_start], cells[e.scroll.row_start + n], (height - n) * sizeof cells[0]);
+            else
+                memmove(cells[e.scroll.row_start + n], cells[e.scroll.row_start], (height - n) * sizeof cells[0]);
         } else if (e.type == VT_EVENT_CELLS_UPDATED) {
             for (INT row = e.cells.row_start; row <= e.cells.row_end; ++row)
                 for (INT column = e.cells.column_start; column <= e.cells.column_end; ++column)
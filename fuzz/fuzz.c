@@ -0,0 +1,114 @@
+// Fuzzer: feeds arbitrary bytes to a terminal, resizing it and reading everything back along the way. Built with
+// clang and -DVT_LIBFUZZER it's a libFuzzer target; otherwise it runs the files given as arguments, or random
+// inputs biased towards escape sequences (VT_FUZZ_SEED and VT_FUZZ_RUNS set the seed and the number of inputs).
+
+#include "../libvirtterm.c"
+
+#include <stdlib.h>
+
+static void draw_run(INT row, INT column, CHAR const* chars, size_t n, VTAttrib attrib, void* data)
+{
+    (void) row; (void) column; (void) attrib;
+    for (size_t i = 0; i < n; ++i)
+        *(uint64_t *) data += chars[i];
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t sz)
+{
+    if (sz < 2)
+        return 0;
+
+    VTConfig config = VT_DEFAULT_CONFIG;
+    config.scrollback_lines = 20;
+    config.max_string_size = 4096;
+    config.trace_records = 64;
+    VT* vt = vt_new(data[0] % 40 + 1, data[1] % 100 + 1, &config, NULL);
+    if (!vt)
+        return 0;
+
+    // 0xff starts a command: resize, reset or select - any other byte is written to the terminal
+    uint64_t sum = 0;
+    for (size_t i = 2; i < sz; ) {
+        if (data[i] == 0xff && i + 3 < sz) {
+            switch (data[i + 1] % 3) {
+                case 0: vt_resize(vt, data[i + 2] % 40 + 1, data[i + 3] % 100 + 1); break;
+                case 1: vt_reset(vt); break;
+                case 2: vt_selection_start(vt, VT_SELECT_WORD, (int8_t) data[i + 2], data[i + 3] % vt_columns(vt)); break;
+            }
+            i += 4;
+            continue;
+        }
+
+        size_t n = 1;
+        while (i + n < sz && data[i + n] != 0xff)
+            ++n;
+        vt_write(vt, (const char *) &data[i], n);
+        i += n;
+
+        VTEvent e;
+        while (vt_next_event(vt, &e))
+            if (e.type == VT_EVENT_TEXT_RECEIVED)
+                free((void *) e.text_received.text);
+        char reply[256];
+        while (vt_read_reply(vt, reply, sizeof reply) > 0);
+        for (INT row = 0; row < vt_rows(vt); ++row) {
+            vt_row_runs(vt, row, draw_run, &sum);
+            sum += vt_row_hash(vt, row);
+        }
+    }
+
+    vt_free(vt);
+    return (int) (sum & 0);
+}
+
+#ifndef VT_LIBFUZZER
+
+static uint64_t rng;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void run_file(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    static uint8_t buf[1024 * 1024];
+    size_t sz = fread(buf, 1, sizeof buf, f);
+    fclose(f);
+    LLVMFuzzerTestOneInput(buf, sz);
+}
+
+int main(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i)
+        run_file(argv[i]);
+    if (argc > 1)
+        return 0;
+
+    static const char alphabet[] = "\e\e\e\e[[[[;;;;??0123456789:$ \"'!>=<#%()*+-/"
+                                   "@ABCDEFGHIJKLMPSTXZ`abcdeghlmnpqrstuvwxyz{|}~\a\b\t\n\r\x0e\x0f\x7f\x9b\xff";
+    const char* seed = getenv("VT_FUZZ_SEED");
+    const char* runs = getenv("VT_FUZZ_RUNS");
+    rng = seed ? strtoull(seed, NULL, 10) | 1 : 1;
+    long n_runs = runs ? atol(runs) : 20000;
+
+    uint8_t buf[512];
+    for (long run = 0; run < n_runs; ++run) {
+        size_t sz = next_random() % sizeof buf;
+        for (size_t i = 0; i < sz; ++i)
+            buf[i] = (next_random() % 4) ? (uint8_t) alphabet[next_random() % (sizeof alphabet - 1)] : (uint8_t) next_random();
+        LLVMFuzzerTestOneInput(buf, sz);
+    }
+    printf("%ld inputs, no errors\n", n_runs);
+    return 0;
+}
+
+#endif
@@ -1,6 +1,10 @@
+#define _XOPEN_SOURCE 700
 #include "libvirtterm.h"
 
 #include <ctype.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -18,55 +22,618 @@
     _a > _b ? _a : _b; })
 #pragma endregion
 
+//
+// KERNELS
+//
+
+#pragma region Kernels
+
+// The loops that run over every byte written or every cell of the screen. Each has a scalar reference version, and
+// vectorized versions chosen at runtime (when the VT is created) for the CPU the library runs on: SSE2 on x86-64 (always
+// present), AVX2 when the CPU has it, and NEON on ARM64. All the versions give exactly the same results.
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# if defined(__GNUC__)
+#  define VT_AVX2 __attribute__((target("avx2")))
+# endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# include <arm_neon.h>
+# define VT_NEON
+#endif
+
+typedef struct VTKernels {
+    const char* name;
+    size_t (*text_run)(const uint8_t* data, size_t sz);                  // bytes before the first control character
+    void   (*fill_cells)(VTCell* cells, VTCell value, size_t n);
+    size_t (*find_attrib)(VTCell const* cells, size_t n, VTAttrib bits); // first cell with any of the bits, or n
+} VTKernels;
+
+static uint16_t attrib_bits(VTAttrib a)
+{
+    uint16_t bits;
+    memcpy(&bits, &a, sizeof bits);
+    return bits & 0x7fff;           // the last bit is padding
+}
+
+// scalar
+
+static size_t text_run_scalar(const uint8_t* data, size_t sz)
+{
+    size_t i = 0;
+    while (i < sz && data[i] >= 0x20)
+        ++i;
+    return i;
+}
+
+static void fill_cells_scalar(VTCell* cells, VTCell value, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        cells[i] = value;
+}
+
+static size_t find_attrib_scalar(VTCell const* cells, size_t n, VTAttrib bits)
+{
+    uint16_t mask = attrib_bits(bits);
+    for (size_t i = 0; i < n; ++i)
+        if (attrib_bits(cells[i].attrib) & mask)
+            return i;
+    return n;
+}
+
+static const VTKernels kernels_scalar = { "scalar", text_run_scalar, fill_cells_scalar, find_attrib_scalar };
+
+// Cells are 5 bytes, so a pattern of 16 cells (80 bytes) is 5 vectors of 16 bytes, and 32 cells are 5 vectors of 32.
+
+static void cell_pattern(uint8_t* pattern, size_t cells, VTCell value)
+{
+    for (size_t i = 0; i < cells; ++i)
+        memcpy(&pattern[i * sizeof(VTCell)], &value, sizeof(VTCell));
+}
+
+static void attrib_pattern(uint8_t* pattern, size_t cells, VTAttrib bits)    // the attribute bits in every cell
+{
+    VTCell mask;
+    memset(&mask, 0, sizeof mask);
+    uint16_t b = attrib_bits(bits);
+    memcpy(&mask.attrib, &b, sizeof b);
+    cell_pattern(pattern, cells, mask);
+}
+
+// SSE2
+
+#ifdef __SSE2__
+
+static size_t text_run_sse2(const uint8_t* data, size_t sz)
+{
+    const __m128i last_control = _mm_set1_epi8(0x1f);
+    size_t i = 0;
+    for (; i + 16 <= sz; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) &data[i]);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, last_control), v));   // v <= 0x1f
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + text_run_scalar(&data[i], sz - i);
+}
+
+static void fill_cells_sse2(VTCell* cells, VTCell value, size_t n)
+{
+    uint8_t pattern[16 * sizeof(VTCell)];
+    cell_pattern(pattern, 16, value);
+    __m128i p[5];
+    for (int j = 0; j < 5; ++j)
+        p[j] = _mm_loadu_si128((const __m128i *) &pattern[j * 16]);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        for (int j = 0; j < 5; ++j)
+            _mm_storeu_si128((__m128i *) ((uint8_t *) &cells[i] + j * 16), p[j]);
+    fill_cells_scalar(&cells[i], value, n - i);
+}
+
+static size_t find_attrib_sse2(VTCell const* cells, size_t n, VTAttrib bits)
+{
+    uint8_t pattern[16 * sizeof(VTCell)];
+    attrib_pattern(pattern, 16, bits);
+    __m128i p[5];
+    for (int j = 0; j < 5; ++j)
+        p[j] = _mm_loadu_si128((const __m128i *) &pattern[j * 16]);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i any = _mm_setzero_si128();
+        for (int j = 0; j < 5; ++j)
+            any = _mm_or_si128(any, _mm_and_si128(_mm_loadu_si128((const __m128i *) ((const uint8_t *) &cells[i] + j * 16)), p[j]));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff)
+            break;      // it's in these 16 cells
+    }
+    return i + find_attrib_scalar(&cells[i], n - i, bits);
+}
+
+static const VTKernels kernels_sse2 = { "sse2", text_run_sse2, fill_cells_sse2, find_attrib_sse2 };
+
+#endif
+
+// AVX2
+
+#ifdef VT_AVX2
+
+VT_AVX2 static size_t text_run_avx2(const uint8_t* data, size_t sz)
+{
+    const __m256i last_control = _mm256_set1_epi8(0x1f);
+    size_t i = 0;
+    for (; i + 32 <= sz; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) &data[i]);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, last_control), v));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + text_run_scalar(&data[i], sz - i);
+}
+
+VT_AVX2 static void fill_cells_avx2(VTCell* cells, VTCell value, size_t n)
+{
+    uint8_t pattern[32 * sizeof(VTCell)];
+    cell_pattern(pattern, 32, value);
+    __m256i p[5];
+    for (int j = 0; j < 5; ++j)
+        p[j] = _mm256_loadu_si256((const __m256i *) &pattern[j * 32]);
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+        for (int j = 0; j < 5; ++j)
+            _mm256_storeu_si256((__m256i *) ((uint8_t *) &cells[i] + j * 32), p[j]);
+    fill_cells_scalar(&cells[i], value, n - i);
+}
+
+VT_AVX2 static size_t find_attrib_avx2(VTCell const* cells, size_t n, VTAttrib bits)
+{
+    uint8_t pattern[32 * sizeof(VTCell)];
+    attrib_pattern(pattern, 32, bits);
+    __m256i p[5];
+    for (int j = 0; j < 5; ++j)
+        p[j] = _mm256_loadu_si256((const __m256i *) &pattern[j * 32]);
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i any = _mm256_setzero_si256();
+        for (int j = 0; j < 5; ++j)
+            any = _mm256_or_si256(any, _mm256_and_si256(_mm256_loadu_si256((const __m256i *) ((const uint8_t *) &cells[i] + j * 32)), p[j]));
+        if (!_mm256_testz_si256(any, any))
+            break;
+    }
+    return i + find_attrib_scalar(&cells[i], n - i, bits);
+}
+
+static const VTKernels kernels_avx2 = { "avx2", text_run_avx2, fill_cells_avx2, find_attrib_avx2 };
+
+#endif
+
+// NEON
+
+#ifdef VT_NEON
+
+static size_t text_run_neon(const uint8_t* data, size_t sz)
+{
+    size_t i = 0;
+    for (; i + 16 <= sz; i += 16)
+        if (vmaxvq_u8(vcleq_u8(vld1q_u8(&data[i]), vdupq_n_u8(0x1f))))
+            break;      // it's in these 16 bytes
+    return i + text_run_scalar(&data[i], sz - i);
+}
+
+static void fill_cells_neon(VTCell* cells, VTCell value, size_t n)
+{
+    uint8_t pattern[16 * sizeof(VTCell)];
+    cell_pattern(pattern, 16, value);
+    uint8x16_t p[5];
+    for (int j = 0; j < 5; ++j)
+        p[j] = vld1q_u8(&pattern[j * 16]);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        for (int j = 0; j < 5; ++j)
+            vst1q_u8((uint8_t *) &cells[i] + j * 16, p[j]);
+    fill_cells_scalar(&cells[i], value, n - i);
+}
+
+static size_t find_attrib_neon(VTCell const* cells, size_t n, VTAttrib bits)
+{
+    uint8_t pattern[16 * sizeof(VTCell)];
+    attrib_pattern(pattern, 16, bits);
+    uint8x16_t p[5];
+    for (int j = 0; j < 5; ++j)
+        p[j] = vld1q_u8(&pattern[j * 16]);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t any = vdupq_n_u8(0);
+        for (int j = 0; j < 5; ++j)
+            any = vorrq_u8(any, vandq_u8(vld1q_u8((const uint8_t *) &cells[i] + j * 16), p[j]));
+        if (vmaxvq_u8(any))
+            break;
+    }
+    return i + find_attrib_scalar(&cells[i], n - i, bits);
+}
+
+static const VTKernels kernels_neon = { "neon", text_run_neon, fill_cells_neon, find_attrib_neon };
+
+#endif
+
+static VTKernels const* const vt_all_kernels[] = {     // from the slowest to the fastest
+    &kernels_scalar,
+#ifdef __SSE2__
+    &kernels_sse2,
+#endif
+#ifdef VT_AVX2
+    &kernels_avx2,
+#endif
+#ifdef VT_NEON
+    &kernels_neon,
+#endif
+};
+
+static bool vt_kernels_usable(VTKernels const* kernels)
+{
+#ifdef VT_AVX2
+    if (kernels == &kernels_avx2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    (void) kernels;
+    return true;
+}
+
+// VT_KERNELS=scalar (or sse2, avx2, neon) in the environment forces a version, to compare them on real programs
+static VTKernels const* vt_select_kernels(void)
+{
+    const char* forced = getenv("VT_KERNELS");
+    VTKernels const* best = &kernels_scalar;
+    for (size_t i = 0; i < sizeof vt_all_kernels / sizeof vt_all_kernels[0]; ++i) {
+        if (!vt_kernels_usable(vt_all_kernels[i]))
+            continue;
+        if (forced && strcmp(forced, vt_all_kernels[i]->name) == 0)
+            return vt_all_kernels[i];
+        best = vt_all_kernels[i];
+    }
+    return best;
+}
+
+#pragma endregion
+
 #define ACS_MIN 0x2b
 
-typedef enum { VTM_NO, VTM_CLICKS, VTM_DRAG, VTM_ALL } VTMouseTracking;
+#define VERSION_NUMBER 200   // reported in DA2
+
+typedef enum { VTM_NO, VTM_X10, VTM_CLICKS, VTM_DRAG, VTM_ALL } VTMouseTracking;   // X10: presses only
+typedef enum { VTME_X10, VTME_UTF8, VTME_SGR, VTME_URXVT, VTME_SGR_PIXELS } VTMouseEncoding;
+
+#define ALTERNATE_SCREEN_IDLE_MS 30000   // the alternate screen is freed after being unused for this long
+
+typedef enum { STR_NONE, STR_OSC, STR_DCS, STR_APC, STR_PM, STR_SOS } StringType;   // control strings
+
+typedef struct Hyperlink {
+    char*              uri;                  // NULL if the entry is free
+    char*              id;                   // `id=` parameter, NULL if none
+    uint32_t           refs;                 // cells on the screens and in the scrollback ring, plus the open link
+    uint32_t           hash;
+    uint16_t           next;                 // next entry in the hash bucket, or in the free list
+} Hyperlink;
+
+typedef struct VTScreen {
+    VTCell*            matrix;
+    bool*              wrapped;
+} VTScreen;
 
 typedef struct VT {
     // terminal configuration
     INT                rows;
     INT                columns;
     VTConfig           config;
+    VTAllocator        allocator;
 
     // terminal state
-    VTCell*            matrix;
-    VTCell*            matrix_copy;
+    VTCell*            matrix;               // screen being displayed (primary or alternate)
+    bool*              wrapped;              // row continues on the next one (automatic margin)
+    uint64_t*          row_hashes;           // of the screen being displayed
+    bool*              row_hash_valid;       // cleared when the row is written
+    VTScreen           inactive_screen;      // screen not being displayed (the alternate one is allocated lazily)
+    bool               alternate_screen;
+    uint64_t           alternate_screen_left;   // ms, see vt_now_ms
     VTCursor           cursor;
     VTCursor           cursor_saved;
     VTAttrib           current_attrib;
     INT                scroll_area_top;
     INT                scroll_area_bottom;
+    INT                scroll_area_left;     // left/right margins, the whole width unless DECLRMM is set
+    INT                scroll_area_right;
+    bool               lr_margin_mode;       // DECLRMM
+    bool               margin_wrap_pending;  // last character was written on the right margin
+    uint64_t*          tab_stops;            // bitset, one bit per column
     bool               acs_mode;
     bool               insert_mode;
     bool               cursor_app_mode;
-    VTTextReceivedType receiving_text;
+    bool               keypad_app_mode;
+    uint8_t            kitty_flags[8];       // stack of kitty keyboard protocol flags
+    uint8_t            kitty_flags_sz;
+    bool               bracketed_paste;
     CHAR               last_char;
-    char*              last_text_received;
+    int32_t            colors[VT_COLOR_MAX]; // 0xRRGGBB, -1 for dynamic colors not set
+
+    // hyperlinks: interned URIs, referenced by the cells (entry 0 is not used)
+    Hyperlink*         links;
+    size_t             links_capacity;       // power of two, also the number of buckets
+    uint16_t*          links_buckets;
+    size_t             links_count;          // live entries
+    size_t             links_used;           // entries ever used (the others are in the free list)
+    uint16_t           links_free;
+    uint16_t           current_link;         // link applied to the characters being written
+
+    // scrollback
+    VTCell*             scrollback;
+    bool*               scrollback_wrapped;
+    INT                 scrollback_columns;
+    size_t              scrollback_first;
+    size_t              scrollback_count;
+    size_t              scrollback_total;
+    VTScrollbackBackend scrollback_backend;
+    VTCell*             scrollback_row;       // a scrollback row read by the selection and hyperlink functions
+    INT                 scrollback_row_columns;
+
+    // selection
+    bool               selection_active;
+    VTSelectionMode    selection_mode;
+    long               selection_anchor_row;
+    INT                selection_anchor_column;
+    long               selection_head_row;
+    INT                selection_head_column;
+    long               selection_start_row;        // normalized, with word/line expansion applied
+    INT                selection_start_column;
+    long               selection_end_row;
+    INT                selection_end_column;
 
     // mouse
     VTMouseTracking    mouse_tracking;
-    bool               sgr_mouse_mode;
+    VTMouseEncoding    mouse_encoding;
     VTMouseState       last_mouse_state;
+    double             wheel_remainder;      // high-resolution wheel movement not reported yet, in lines
+    bool               focus_reporting;
 
     // timed operations
     bool               blink_on;
     bool               cursor_blink_on;
-    clock_t            last_blink;
-    clock_t            last_cursor_blink;
+    uint64_t           last_blink;
+    uint64_t           last_cursor_blink;
+    bool               cursor_blink_reset;   // restart the cursor blink timer on the next timed operations
 
     // escape sequence parsing
-    char               esc_buffer[32];
+    char               esc_buffer[64];
+
+    // control strings (OSC, DCS, APC...)
+    StringType         string_type;
+    char*              string;               // payload, grows geometrically up to config.max_string_size
+    size_t             string_sz;
+    size_t             string_capacity;
+    bool               string_overflow;      // payload is too large and will be dropped
+    bool               string_esc;           // ESC received, a '\\' will end the string
+
+    // replies to the application
+    char*              reply;
+    size_t             reply_sz;
+    size_t             reply_capacity;
 
     // events
     VTEvent*           event_queue_start;
     VTEvent*           event_queue_end;
+    VTEvent*           event_free_list;      // consumed events, reused by new ones
+    struct VTEventBlock* event_blocks;       // storage of all the events above
+    VTEvent*           last_scroll_event;    // scroll events in the queue all come before cell updates
+    bool               cursor_moved;         // cursor moved event not added to the queue yet
+
+    // tracing
+    struct VTTrace*    trace;                // NULL if disabled
+
+    VTKernels const*   kernels;              // vectorized loops for this CPU
 } VT;
 
 static void vt_add_char(VT* vt, CHAR c);
 static void vt_add_event(VT* vt, VTEvent* event);
+static void vt_rows_changed(VT* vt, INT row_start, INT row_end);
 static void vt_add_event_update_whole_screen(VT* vt);
 static void vt_free_event_queue(VT*);
+static struct VTTrace* vt_new_trace(VT* vt, size_t records);
+static void vt_parse(VT* vt, const char* str, size_t str_sz);
+static void vt_selection_scrolled(VT* vt);
+static void vt_reset_colors(VT* vt);
+static void vt_retain_links(VT* vt, VTCell const* cells, size_t n);
+static void vt_release_links(VT* vt, VTCell* cells, size_t n);
+static void vt_unref_links(VT* vt, VTCell const* cells, size_t n);
+static void vt_close_hyperlink(VT* vt);
+static uint64_t* vt_new_tab_stops(VT* vt, INT columns, uint64_t const* previous, INT previous_columns);
+static void default_tab_stops(uint64_t* tab_stops, INT columns, INT from_column);
+static void vt_free_hyperlinks(VT* vt);
+static void vt_open_hyperlink(VT* vt, const char* params, const char* uri);
+static void vt_start_string(VT* vt, StringType type);
+static size_t vt_add_string_bytes(VT* vt, const char* data, size_t sz);
+static uint64_t vt_now_ms(void);
+
+
+//
+// MEMORY
+//
+
+#pragma region Memory
+
+#define ARENA_ALIGNMENT _Alignof(max_align_t)
+#define ARENA_ALIGN(sz) (((sz) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+typedef struct VTArena {
+    uint8_t* memory;
+    size_t   capacity;
+    size_t   top;                // end of the highest block, from the start of memory
+    size_t   used;               // bytes in live blocks, headers included
+    size_t   peak;               // highest `top` reached
+    size_t   allocations;        // live allocations
+    size_t   free_list;          // first free block below `top` (sorted by address), or ARENA_NONE
+} VTArena;
+
+typedef struct ArenaBlock {      // header before every block, which starts where its header does
+    size_t end;                  // offset of the end of the block
+    size_t next_free;            // free blocks only: the next one in the free list, or ARENA_NONE
+} ArenaBlock;
+
+#define ARENA_HEADER ARENA_ALIGN(sizeof(ArenaBlock))
+#define ARENA_NONE   SIZE_MAX
+
+#define ARENA_BLOCK(arena, offset) ((ArenaBlock *) &(arena)->memory[offset])
+
+VTArena* vt_arena_new(void* memory, size_t sz)
+{
+    uintptr_t start = ARENA_ALIGN((uintptr_t) memory);
+    if (start + ARENA_ALIGN(sizeof(VTArena)) > (uintptr_t) memory + sz)
+        return NULL;
+
+    VTArena* arena = (VTArena *) start;
+    arena->memory = (uint8_t *) (start + ARENA_ALIGN(sizeof(VTArena)));
+    arena->capacity = (uintptr_t) memory + sz - (uintptr_t) arena->memory;
+    arena->top = 0;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->allocations = 0;
+    arena->free_list = ARENA_NONE;
+    return arena;
+}
+
+// Blocks are taken from the free list first (first fit, splitting what's left over), and from the top otherwise.
+// Resizing allocates the new buffers before freeing the old ones, so without reusing the holes the arena would only
+// ever grow.
+static void* vt_arena_alloc(void* data, size_t sz)
+{
+    VTArena* arena = data;
+    size_t needed = ARENA_HEADER + ARENA_ALIGN(sz);
+
+    for (size_t* link = &arena->free_list; *link != ARENA_NONE; link = &ARENA_BLOCK(arena, *link)->next_free) {
+        size_t start = *link;
+        ArenaBlock* block = ARENA_BLOCK(arena, start);
+        if (block->end - start < needed)
+            continue;
+        if (block->end - start >= needed + ARENA_HEADER + ARENA_ALIGNMENT) {   // split: the rest stays free
+            *ARENA_BLOCK(arena, start + needed) = (ArenaBlock) { .end = block->end, .next_free = block->next_free };
+            *link = start + needed;
+            block->end = start + needed;
+        } else {
+            *link = block->next_free;
+        }
+        arena->used += block->end - start;
+        ++arena->allocations;
+        return &arena->memory[start + ARENA_HEADER];
+    }
+
+    size_t start = arena->top;
+    if (needed > arena->capacity - start)
+        return NULL;
+
+    arena->top += needed;
+    *ARENA_BLOCK(arena, start) = (ArenaBlock) { .end = arena->top, .next_free = ARENA_NONE };
+    arena->used += needed;
+    arena->peak = MAX(arena->peak, arena->top);
+    ++arena->allocations;
+    return &arena->memory[start + ARENA_HEADER];
+}
+
+static void vt_arena_free(void* data, void* ptr)
+{
+    VTArena* arena = data;
+    if (!ptr)
+        return;
+
+    size_t start = (size_t) ((uint8_t *) ptr - ARENA_HEADER - arena->memory);
+    ArenaBlock* block = ARENA_BLOCK(arena, start);
+    arena->used -= block->end - start;
+    if (--arena->allocations == 0) {
+        arena->top = 0;
+        arena->free_list = ARENA_NONE;
+        return;
+    }
+
+    // insert in the free list, merging with the free blocks right after and before it
+    size_t* link = &arena->free_list;       // then, the link to the block
+    size_t* prev_link = NULL;               // the link to the free block before it
+    while (*link != ARENA_NONE && *link < start) {
+        prev_link = link;
+        link = &ARENA_BLOCK(arena, *link)->next_free;
+    }
+    block->next_free = *link;
+    if (*link == block->end) {
+        block->next_free = ARENA_BLOCK(arena, *link)->next_free;
+        block->end = ARENA_BLOCK(arena, *link)->end;
+    }
+    *link = start;
+    if (prev_link && ARENA_BLOCK(arena, *prev_link)->end == start) {
+        link = prev_link;
+        start = *link;
+        ARENA_BLOCK(arena, start)->end = block->end;
+        ARENA_BLOCK(arena, start)->next_free = block->next_free;
+        block = ARENA_BLOCK(arena, start);
+    }
+
+    // a free block at the top (always the last one in the list) goes back to it
+    if (block->end == arena->top) {
+        arena->top = start;
+        *link = ARENA_NONE;
+    }
+}
+
+VTAllocator vt_arena_allocator(VTArena* arena)
+{
+    return (VTAllocator) { .data = arena, .alloc = vt_arena_alloc, .free = vt_arena_free };
+}
 
+size_t vt_arena_used(VTArena* arena)
+{
+    return arena->used;
+}
+
+size_t vt_arena_peak(VTArena* arena)
+{
+    return arena->peak;
+}
+
+static void* vt_default_alloc(void* data, size_t sz)
+{
+    (void) data;
+    return malloc(sz);
+}
+
+static void vt_default_free(void* data, void* ptr)
+{
+    (void) data;
+    free(ptr);
+}
+
+static void* vt_alloc(VT* vt, size_t sz)
+{
+    void* ptr = vt->allocator.alloc(vt->allocator.data, sz);
+    if (!ptr && vt->config.debug >= VT_DEBUG_ERRORS_ONLY)
+        fprintf(stderr, "libvirtterm: out of memory allocating %zu bytes\n", sz);
+    return ptr;
+}
+
+static void* vt_calloc(VT* vt, size_t n, size_t sz)
+{
+    void* ptr = vt_alloc(vt, n * sz);
+    if (ptr)
+        memset(ptr, 0, n * sz);
+    return ptr;
+}
+
+static void vt_dealloc(VT* vt, void* ptr)
+{
+    if (ptr)
+        vt->allocator.free(vt->allocator.data, ptr);
+}
+
+#pragma endregion
 
 //
 // INITIALIZATION
@@ -74,9 +641,14 @@ static void vt_free_event_queue(VT*);
 
 #pragma region Initialization
 
-VT* vt_new(INT rows, INT columns, VTConfig const* config)
+VT* vt_new(INT rows, INT columns, VTConfig const* config, VTAllocator const* allocator)
 {
-    VT* vt = calloc(1, sizeof(VT));
+    VTAllocator a = allocator ? *allocator : (VTAllocator) { .alloc = vt_default_alloc, .free = vt_default_free };
+    VT* vt = a.alloc(a.data, sizeof(VT));
+    if (!vt)
+        return NULL;
+    memset(vt, 0, sizeof(VT));
+    vt->allocator = a;
     vt->rows = rows;
     vt->columns = columns;
     vt->cursor = (VTCursor) { .column = 0, .row = 0, .visible = true, .blinking = false };
@@ -85,26 +657,76 @@ VT* vt_new(INT rows, INT columns, VTConfig const* config)
     vt->current_attrib = DEFAULT_ATTR;
     vt->scroll_area_top = 0;
     vt->scroll_area_bottom = vt->rows - 1;
+    vt->scroll_area_left = 0;
+    vt->scroll_area_right = vt->columns - 1;
+    vt->lr_margin_mode = false;
+    vt->margin_wrap_pending = false;
     vt->event_queue_start = NULL;
     vt->event_queue_end = NULL;
+    vt->event_free_list = NULL;
+    vt->event_blocks = NULL;
+    vt->last_scroll_event = NULL;
+    vt->cursor_moved = false;
+    vt->trace = vt_new_trace(vt, config->trace_records);   // tracing is optional, the VT works without it
+    vt->kernels = vt_select_kernels();
     vt->acs_mode = false;
     vt->insert_mode = false;
     vt->cursor_app_mode = false;
-    vt->receiving_text = VTT_NOT_RECEIVING;
-    vt->last_text_received = NULL;
+    vt->keypad_app_mode = false;
+    vt->kitty_flags_sz = 0;
+    vt->bracketed_paste = false;
+    vt->string_type = STR_NONE;
+    vt->string = NULL;
+    vt->string_sz = 0;
+    vt->string_capacity = 0;
+    vt->string_overflow = false;
+    vt->string_esc = false;
+    vt->reply = NULL;
+    vt->reply_sz = 0;
+    vt->reply_capacity = 0;
+    vt_reset_colors(vt);
+    vt->links = NULL;
+    vt->links_capacity = 0;
+    vt->links_buckets = NULL;
+    vt->links_count = 0;
+    vt->links_used = 0;
+    vt->links_free = 0;
+    vt->current_link = 0;
+    vt->scrollback = NULL;
+    vt->scrollback_wrapped = NULL;
+    vt->scrollback_columns = 0;
+    vt->scrollback_first = 0;
+    vt->scrollback_count = 0;
+    vt->scrollback_total = 0;
+    vt->scrollback_row = NULL;
+    vt->scrollback_row_columns = 0;
+    vt->scrollback_backend = (VTScrollbackBackend) {};
+    vt->selection_active = false;
     vt->mouse_tracking = VTM_NO;
-    vt->sgr_mouse_mode = false;
+    vt->mouse_encoding = VTME_X10;
     vt->last_mouse_state = (VTMouseState) { .column = -1, .row = -1, .button = {0,0,0,0,0}, .mod = 0 };
+    vt->wheel_remainder = 0;
+    vt->focus_reporting = false;
     vt->blink_on = false;
     vt->cursor_blink_on = false;
-    vt->last_blink = 0;
-    vt->last_cursor_blink = 0;
+    vt->last_blink = vt->last_cursor_blink = vt_now_ms();
+    vt->cursor_blink_reset = false;
     memset(vt->esc_buffer, 0, sizeof vt->esc_buffer);
 
-    vt->matrix = malloc(rows * columns * sizeof(VTCell));
-    vt->matrix_copy = malloc(rows * columns * sizeof(VTCell));
+    vt->alternate_screen = false;
+    vt->alternate_screen_left = 0;
+    vt->inactive_screen = (VTScreen) {};
+    vt->matrix = vt_alloc(vt, rows * columns * sizeof(VTCell));
+    vt->wrapped = vt_calloc(vt, rows, sizeof(bool));
+    vt->row_hashes = vt_calloc(vt, rows, sizeof(uint64_t));
+    vt->row_hash_valid = vt_calloc(vt, rows, sizeof(bool));
+    vt->tab_stops = vt_new_tab_stops(vt, columns, NULL, 0);
+    if (!vt->matrix || !vt->wrapped || !vt->row_hashes || !vt->row_hash_valid || !vt->tab_stops) {
+        vt_free(vt);
+        return NULL;
+    }
     for (INT i = 0; i < rows * columns; ++i)
-        vt->matrix[i] = vt->matrix_copy[i] = (VTCell) { .ch = ' ', .attrib = DEFAULT_ATTR };
+        vt->matrix[i] = (VTCell) { .ch = ' ', .attrib = DEFAULT_ATTR };
 
     vt_add_event_update_whole_screen(vt);
 
@@ -115,11 +737,82 @@ void vt_free(VT* vt)
 {
     if (vt) {
         vt_free_event_queue(vt);
-        free(vt->last_text_received);
-        free(vt->matrix);
-        free(vt->matrix_copy);
+        vt_dealloc(vt, vt->string);
+        vt_dealloc(vt, vt->reply);
+        vt_free_hyperlinks(vt);
+        vt_dealloc(vt, vt->scrollback);
+        vt_dealloc(vt, vt->scrollback_wrapped);
+        vt_dealloc(vt, vt->scrollback_row);
+        vt_dealloc(vt, vt->inactive_screen.wrapped);
+        vt_dealloc(vt, vt->inactive_screen.matrix);
+        vt_dealloc(vt, vt->wrapped);
+        vt_dealloc(vt, vt->matrix);
+        vt_dealloc(vt, vt->row_hashes);
+        vt_dealloc(vt, vt->row_hash_valid);
+        vt_dealloc(vt, vt->tab_stops);
+        vt_dealloc(vt, vt->trace);
+        VTAllocator a = vt->allocator;
+        a.free(a.data, vt);
+    }
+}
+
+static void vt_free_inactive_screen(VT* vt)
+{
+    if (vt->inactive_screen.matrix)
+        vt_release_links(vt, vt->inactive_screen.matrix, vt->rows * vt->columns);
+    vt_dealloc(vt, vt->inactive_screen.matrix);
+    vt_dealloc(vt, vt->inactive_screen.wrapped);
+    vt->inactive_screen = (VTScreen) {};
+}
+
+static bool vt_alloc_inactive_screen(VT* vt)   // allocates a blank screen
+{
+    VTCell* matrix = vt_alloc(vt, vt->rows * vt->columns * sizeof(VTCell));
+    bool* wrapped = vt_calloc(vt, vt->rows, sizeof(bool));
+    if (!matrix || !wrapped) {
+        vt_dealloc(vt, matrix);
+        vt_dealloc(vt, wrapped);
+        return false;
     }
-    free(vt);
+    for (INT i = 0; i < vt->rows * vt->columns; ++i)
+        matrix[i] = (VTCell) { .ch = ' ', .attrib = DEFAULT_ATTR };
+    vt->inactive_screen = (VTScreen) { .matrix = matrix, .wrapped = wrapped };
+    return true;
+}
+
+static void vt_clear_screen_buffer(VT* vt, VTScreen* screen)
+{
+    vt_release_links(vt, screen->matrix, vt->rows * vt->columns);
+    for (INT i = 0; i < vt->rows * vt->columns; ++i)
+        screen->matrix[i] = (VTCell) { .ch = ' ', .attrib = DEFAULT_ATTR };
+    memset(screen->wrapped, 0, vt->rows * sizeof(bool));
+    if (screen->matrix == vt->matrix)
+        vt_rows_changed(vt, 0, vt->rows - 1);
+}
+
+// false if the alternate screen can't be allocated (the primary one is still displayed)
+static bool vt_switch_screen(VT* vt, bool alternate)
+{
+    if (vt->alternate_screen == alternate)
+        return true;
+
+    if (!vt->inactive_screen.matrix) {   // only the alternate screen is ever missing
+        if (!vt_alloc_inactive_screen(vt))
+            return false;
+    }
+
+    VTScreen displayed = { .matrix = vt->matrix, .wrapped = vt->wrapped };
+    vt->matrix = vt->inactive_screen.matrix;
+    vt->wrapped = vt->inactive_screen.wrapped;
+    vt->inactive_screen = displayed;
+    vt_rows_changed(vt, 0, vt->rows - 1);
+
+    vt->alternate_screen = alternate;
+    if (!alternate)
+        vt->alternate_screen_left = vt_now_ms();
+    vt_selection_clear(vt);
+    vt_add_event_update_whole_screen(vt);
+    return true;
 }
 
 void vt_reset(VT* vt)
@@ -129,18 +822,31 @@ void vt_reset(VT* vt)
     vt->current_attrib = DEFAULT_ATTR;
     vt->scroll_area_top = 0;
     vt->scroll_area_bottom = vt->rows - 1;
+    vt->scroll_area_left = 0;
+    vt->scroll_area_right = vt->columns - 1;
+    vt->lr_margin_mode = false;
+    vt->margin_wrap_pending = false;
+    default_tab_stops(vt->tab_stops, vt->columns, 0);
     vt->acs_mode = false;
     vt->insert_mode = false;
     vt->cursor_app_mode = false;
-    vt->receiving_text = VTT_NOT_RECEIVING;
-    free(vt->last_text_received);
-    vt->last_text_received = NULL;
+    vt->keypad_app_mode = false;
+    vt->kitty_flags_sz = 0;
+    vt->bracketed_paste = false;
+    vt->string_type = STR_NONE;
+    vt->string_sz = 0;
+    vt->string_esc = false;
+    vt_reset_colors(vt);
     vt->mouse_tracking = VTM_NO;
-    vt->sgr_mouse_mode = false;
+    vt->mouse_encoding = VTME_X10;
     vt->last_mouse_state = (VTMouseState) { .column = -1, .row = -1, .button = {0,0,0,0,0}, .mod = 0 };
-    for (int i = 0; i < vt->rows * vt->columns; ++i)
-        vt->matrix[i] = (VTCell) { .ch = ' ', .attrib = DEFAULT_ATTR };
-    memcpy(vt->matrix_copy, vt->matrix, vt->columns * vt->rows * sizeof(VTCell));
+    vt->wheel_remainder = 0;
+    vt->focus_reporting = false;
+    vt_switch_screen(vt, false);
+    vt_free_inactive_screen(vt);
+    vt_close_hyperlink(vt);
+    vt_clear_screen_buffer(vt, &(VTScreen) { .matrix = vt->matrix, .wrapped = vt->wrapped });
+    vt_selection_clear(vt);
     vt_add_event_update_whole_screen(vt);
 }
 
@@ -156,31 +862,60 @@ void vt_resize(VT* vt, INT rows, INT columns)
     else
         init_row_old = vt->rows - rows;
 
-    VTCell* old_matrix[] = { vt->matrix, vt->matrix_copy };
+    VTCell* old_matrix = vt->matrix;
     */
-    VTCell* new_matrix[2];
-    for (size_t i = 0; i < 2; ++i) {
-        new_matrix[i] = malloc(sizeof(VTCell) * rows * columns);
-        // clear new matrix
-        for (INT j = 0; j < rows * columns; ++j)
-            new_matrix[i][j] = (VTCell) { .ch = ' ', .attrib = DEFAULT_ATTR };
-        /*
-        // copy characters from old to new, taking resize into account
-        for (INT new_row = rows - 1, old_row = vt->rows - 1; new_row >= 0 && old_row >= 0; --old_row, --new_row)
-            for (INT column = 0; column < MIN(columns, vt->columns); ++column)
-                new_matrix[i][new_row * columns + column] = old_matrix[i][old_row * vt->columns + column];
-        */
+    VTCell* new_matrix = vt_alloc(vt, sizeof(VTCell) * rows * columns);
+    bool* new_wrapped = vt_calloc(vt, rows, sizeof(bool));
+    uint64_t* new_tab_stops = vt_new_tab_stops(vt, columns, vt->tab_stops, vt->columns);
+    uint64_t* new_row_hashes = vt_calloc(vt, rows, sizeof(uint64_t));
+    bool* new_row_hash_valid = vt_calloc(vt, rows, sizeof(bool));
+    if (!new_matrix || !new_wrapped || !new_tab_stops || !new_row_hashes || !new_row_hash_valid) {
+        vt_dealloc(vt, new_matrix);
+        vt_dealloc(vt, new_wrapped);
+        vt_dealloc(vt, new_tab_stops);
+        vt_dealloc(vt, new_row_hashes);
+        vt_dealloc(vt, new_row_hash_valid);
+        return;
     }
+    // clear new matrix
+    for (INT j = 0; j < rows * columns; ++j)
+        new_matrix[j] = (VTCell) { .ch = ' ', .attrib = DEFAULT_ATTR };
+    /*
+    // copy characters from old to new, taking resize into account
+    for (INT new_row = rows - 1, old_row = vt->rows - 1; new_row >= 0 && old_row >= 0; --old_row, --new_row)
+        for (INT column = 0; column < MIN(columns, vt->columns); ++column)
+            new_matrix[new_row * columns + column] = old_matrix[old_row * vt->columns + column];
+    */
 
     vt->cursor.column = 0;
     vt->cursor.row = 0;
-    free(vt->matrix);
-    free(vt->matrix_copy);
-    vt->matrix = new_matrix[0];
-    vt->matrix_copy = new_matrix[1];
+    vt_release_links(vt, vt->matrix, vt->rows * vt->columns);
+    vt_dealloc(vt, vt->matrix);
+    vt->matrix = new_matrix;
+    vt_dealloc(vt, vt->wrapped);
+    vt->wrapped = new_wrapped;
+    vt_dealloc(vt, vt->tab_stops);
+    vt->tab_stops = new_tab_stops;
+    vt_dealloc(vt, vt->row_hashes);
+    vt->row_hashes = new_row_hashes;
+    vt_dealloc(vt, vt->row_hash_valid);
+    vt->row_hash_valid = new_row_hash_valid;
+    vt_selection_clear(vt);
+
+    // the primary screen must always exist, the alternate one is allocated again when needed
+    bool primary_inactive = vt->alternate_screen;
+    vt_free_inactive_screen(vt);
 
     vt->rows = rows;
     vt->columns = columns;
+    vt->scroll_area_left = 0;
+    vt->scroll_area_right = columns - 1;
+    vt->margin_wrap_pending = false;
+
+    if (primary_inactive) {
+        if (!vt_alloc_inactive_screen(vt))
+            vt->alternate_screen = false;   // no room for the primary screen: the displayed one becomes it
+    }
 
     vt_add_event_update_whole_screen(vt);
 }
@@ -193,28 +928,45 @@ void vt_resize(VT* vt, INT rows, INT columns)
 
 #pragma region Timed Operations
 
+// Wall time, in milliseconds: reading the clock costs a system call on some platforms, so it's only done when the events
+// are read, and never while parsing.
+static uint64_t vt_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static void vt_timed_operations(VT* vt)
 {
-    clock_t now = clock();
+    uint64_t now = vt_now_ms();
+    if (vt->cursor_blink_reset) {
+        vt->cursor_blink_reset = false;
+        vt->last_cursor_blink = now;
+    }
 
-    size_t diff_blink = ((double) (now - vt->last_blink)) * 1000.0 / CLOCKS_PER_SEC;
-    size_t diff_cursor_blink = ((double) (now - vt->last_cursor_blink)) * 1000.0 / CLOCKS_PER_SEC;
+    uint64_t diff_blink = now - vt->last_blink;
+    uint64_t diff_cursor_blink = now - vt->last_cursor_blink;
 
     if (diff_blink > vt->config.blink_ms) {
         vt->blink_on = !vt->blink_on;
         vt->last_blink = now;
-        for (size_t i = 0; i < vt->rows * vt->columns; ++i) {
-            if (vt->matrix[i].attrib.blink) {
-                INT row = i / vt->columns;
-                INT column = i % vt->columns;
-                vt_add_event(vt, &(VTEvent) {
-                    .type = VT_EVENT_CELLS_UPDATED,
-                    .cells = { .column_start = column, .column_end = column, .row_start = row, .row_end = row }
-                });
-            }
+        size_t n = vt->rows * vt->columns;
+        for (size_t i = vt->kernels->find_attrib(vt->matrix, n, (VTAttrib) { .blink = true }); i < n;
+                i += 1 + vt->kernels->find_attrib(&vt->matrix[i + 1], n - i - 1, (VTAttrib) { .blink = true })) {
+            INT row = i / vt->columns;
+            INT column = i % vt->columns;
+            vt_add_event(vt, &(VTEvent) {
+                .type = VT_EVENT_CELLS_UPDATED,
+                .cells = { .column_start = column, .column_end = column, .row_start = row, .row_end = row }
+            });
         }
     }
 
+    if (!vt->alternate_screen && vt->inactive_screen.matrix
+            && now - vt->alternate_screen_left > ALTERNATE_SCREEN_IDLE_MS)
+        vt_free_inactive_screen(vt);
+
     if (diff_cursor_blink > vt->config.blink_ms) {
         vt->cursor_blink_on = !vt->cursor_blink_on;
         vt->last_cursor_blink = now;
@@ -228,89 +980,444 @@ static void vt_timed_operations(VT* vt)
 static void vt_reset_cursor_blink(VT* vt)
 {
     vt->cursor_blink_on = true;
-    vt->last_cursor_blink = clock();
+    vt->cursor_blink_reset = true;
 }
 
 #pragma endregion
 
 //
-// EVENTS
+// TRACING
 //
 
-#pragma region Events
+#pragma region Tracing
 
-static void vt_add_event(VT* vt, VTEvent* event)
+#ifndef VT_NO_TRACE
+
+// Single writer (the thread using the VT), any number of readers, no locks. Each record is packed in one atomic word,
+// so it's never read half-written. The writer announces the record it's about to write in `written` before storing it,
+// and publishes it in `head` only once its action is known: at the next byte, or at the end of vt_write(). Readers copy
+// what's below `head`, then drop whatever the writer could have overwritten meanwhile according to `written`.
+typedef struct VTTrace {
+    _Atomic size_t   head;          // records complete
+    _Atomic size_t   written;       // records stored or being stored (head, or head + 1)
+    size_t           mask;
+    uint32_t         time_us;       // of the current vt_write()
+    _Atomic uint64_t records[];     // see trace_pack()
+} VTTrace;
+
+static uint64_t trace_pack(uint32_t time_us, uint8_t byte, VTTraceState state, VTTraceAction action)
 {
-    VTEvent* new_event = malloc(sizeof(VTEvent));
-    memcpy(new_event, event, sizeof(VTEvent));
+    return (uint64_t) time_us | (uint64_t) byte << 32 | (uint64_t) state << 40 | (uint64_t) action << 48;
+}
 
-    new_event->_next = NULL;
-    if (vt->event_queue_start == NULL)
-        vt->event_queue_start = new_event;
-    if (vt->event_queue_end)
-        vt->event_queue_end->_next = new_event;
-    vt->event_queue_end = new_event;
+static VTTraceRecord trace_unpack(uint64_t r)
+{
+    return (VTTraceRecord) {
+        .time_us = (uint32_t) r, .byte = (uint8_t) (r >> 32), .state = (uint8_t) (r >> 40), .action = (uint8_t) (r >> 48),
+    };
 }
 
-bool vt_next_event(VT* vt, VTEvent* e)
+static VTTrace* vt_new_trace(VT* vt, size_t records)
 {
-    vt_timed_operations(vt);
+    if (records == 0)
+        return NULL;
+    size_t capacity = 1;
+    while (capacity < records)
+        capacity *= 2;
+    VTTrace* trace = vt_alloc(vt, sizeof(VTTrace) + capacity * sizeof(uint64_t));
+    if (trace) {
+        atomic_init(&trace->head, 0);
+        atomic_init(&trace->written, 0);
+        trace->mask = capacity - 1;
+        trace->time_us = 0;
+        for (size_t i = 0; i < capacity; ++i)
+            atomic_init(&trace->records[i], 0);
+    }
+    return trace;
+}
 
-    if (vt->event_queue_start == NULL)
-        return false;
+static void vt_trace_start(VTTrace* trace)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    trace->time_us = (uint32_t) (ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
 
-    VTEvent* event_to_remove = vt->event_queue_start;
-    if (e)
-        memcpy(e, event_to_remove, sizeof(VTEvent));
-    vt->event_queue_start = event_to_remove->_next;
+static void vt_trace_bytes(VTTrace* trace, const char* data, size_t sz, VTTraceState state)
+{
+    size_t written = atomic_load_explicit(&trace->written, memory_order_relaxed);
+    for (size_t i = 0; i < sz; ++i, ++written) {
+        atomic_store_explicit(&trace->head, written, memory_order_release);         // the previous record is complete
+        atomic_store_explicit(&trace->written, written + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        atomic_store_explicit(&trace->records[written & trace->mask],
+                              trace_pack(trace->time_us, data[i], state, VT_TRACE_BYTE), memory_order_relaxed);
+    }
+}
 
-    if (vt->event_queue_start == NULL)
-        vt->event_queue_end = NULL;
+// sets the action of the last record, which isn't published yet
+static void vt_trace_action(VTTrace* trace, VTTraceAction action)
+{
+    size_t written = atomic_load_explicit(&trace->written, memory_order_relaxed);
+    if (written == atomic_load_explicit(&trace->head, memory_order_relaxed))
+        return;
+    _Atomic uint64_t* record = &trace->records[(written - 1) & trace->mask];
+    uint64_t r = atomic_load_explicit(record, memory_order_relaxed);
+    atomic_store_explicit(record, (r & ~((uint64_t) 0xff << 48)) | (uint64_t) action << 48, memory_order_relaxed);
+}
+
+static void vt_trace_end(VTTrace* trace)
+{
+    atomic_store_explicit(&trace->head, atomic_load_explicit(&trace->written, memory_order_relaxed),
+                          memory_order_release);
+}
 
-    free(event_to_remove);
+#define TRACE_START(vt)                   { if ((vt)->trace) vt_trace_start((vt)->trace); }
+#define TRACE_END(vt)                     { if ((vt)->trace) vt_trace_end((vt)->trace); }
+#define TRACE_BYTES(vt, data, sz, state)  { if ((vt)->trace) vt_trace_bytes((vt)->trace, data, sz, state); }
+#define TRACE_ACTION(vt, action)          { if ((vt)->trace) vt_trace_action((vt)->trace, action); }
 
-    return true;
+#else
+
+static struct VTTrace* vt_new_trace(VT*, size_t) { return NULL; }
+
+#define TRACE_START(vt)
+#define TRACE_END(vt)
+#define TRACE_BYTES(vt, data, sz, state)
+#define TRACE_ACTION(vt, action)
+
+#endif
+
+size_t vt_trace(VT* vt, VTTraceRecord* records, size_t max_records)
+{
+#ifndef VT_NO_TRACE
+    VTTrace* trace = vt->trace;
+    if (!trace)
+        return 0;
+
+    size_t capacity = trace->mask + 1;
+    size_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+    size_t n = MIN(MIN(head, capacity), max_records);
+    for (size_t i = 0; i < n; ++i)
+        records[i] = trace_unpack(atomic_load_explicit(&trace->records[(head - n + i) & trace->mask], memory_order_relaxed));
+
+    // the oldest records copied might have been overwritten meanwhile (the one being written included)
+    atomic_thread_fence(memory_order_acquire);
+    size_t written = atomic_load_explicit(&trace->written, memory_order_relaxed);
+    size_t first_valid = written > capacity ? written - capacity : 0;
+    size_t overwritten = first_valid > head - n ? first_valid - (head - n) : 0;
+    if (overwritten >= n)
+        return 0;
+    memmove(records, &records[overwritten], (n - overwritten) * sizeof(VTTraceRecord));
+    return n - overwritten;
+#else
+    (void) vt; (void) records; (void) max_records;
+    return 0;
+#endif
 }
 
-static void vt_free_event_queue(VT* vt)
+// One line per vt_write(), starting with its time. Text is written as is, other bytes escaped; the escape sequences
+// that failed are marked.
+void vt_trace_dump(VT* vt, VTTextWriter writer, void* data)
 {
-    while (vt_next_event(vt, NULL));
+    VTTraceRecord records[4096];
+    size_t n = vt_trace(vt, records, sizeof records / sizeof records[0]);
+
+    char buf[32];
+    for (size_t i = 0; i < n; ++i) {
+        VTTraceRecord const* r = &records[i];
+        if (i == 0 || r->time_us != records[i - 1].time_us)
+            writer(buf, snprintf(buf, sizeof buf, "%s[%10u] ", i == 0 ? "" : "\n", r->time_us), data);
+
+        int len;
+        if (r->byte == '\e')
+            len = snprintf(buf, sizeof buf, "\\e");
+        else if (r->byte >= 32 && r->byte < 127 && r->byte != '\\')
+            len = snprintf(buf, sizeof buf, "%c", r->byte);
+        else
+            len = snprintf(buf, sizeof buf, "\\x%02X", r->byte);
+        if (r->action == VT_TRACE_UNRECOGNIZED)
+            len += snprintf(&buf[len], sizeof buf - len, " <unrecognized> ");
+        else if (r->action == VT_TRACE_INVALID)
+            len += snprintf(&buf[len], sizeof buf - len, " <invalid> ");
+        writer(buf, len, data);
+    }
+    if (n > 0)
+        writer("\n", 1, data);
 }
 
-static void vt_beep(VT* vt)
+static void write_to_file(const char* text, size_t sz, void* data)
 {
-    vt_add_event(vt, &(VTEvent) { .type = VT_EVENT_BELL });
+    fwrite(text, 1, sz, (FILE *) data);
 }
 
-static void vt_add_event_update_whole_screen(VT* vt)
+// called on anomalies, so the bytes that led to them can be looked at
+static void vt_debug_dump_trace(VT* vt)
 {
-    vt_add_event(vt, &(VTEvent) { .type = VT_EVENT_CELLS_UPDATED, .cells = {
-        .column_start = 0, .row_start = 0, .column_end = vt->columns - 1, .row_end = vt->rows - 1,
-    }});
+    if (vt->config.debug >= VT_DEBUG_ALL_ESCAPE_SEQUENCES && vt->trace) {
+        fprintf(stderr, "libvirtterm: last bytes parsed:\n");
+        TRACE_END(vt)       // publishes the byte that caused it (its action is set)
+        vt_trace_dump(vt, write_to_file, stderr);
+    }
 }
 
 #pragma endregion
 
 //
-// UPDATES TO TERMINAL MATRIX
+// EVENTS
 //
 
-#pragma region Updates to Terminal Matrix
+#pragma region Events
 
-static void vt_set_ch(VT* vt, INT row, INT column, CHAR c)
+// Events are allocated in blocks owned by the VT, and never given back until the VT is freed: after the first few
+// frames no allocation happens at all, so terminals parsing on different threads don't contend on the allocator.
+#define EVENT_BLOCK_SZ 16
+
+typedef struct VTEventBlock {
+    struct VTEventBlock* next;
+    VTEvent              events[EVENT_BLOCK_SZ];
+} VTEventBlock;
+
+static VTEvent* vt_new_event(VT* vt)
 {
-    row = MAX(MIN(row, vt->rows - 1), 0);
-    column = MAX(MIN(column, vt->columns - 1), 0);
+    if (!vt->event_free_list) {
+        VTEventBlock* block = vt_alloc(vt, sizeof(VTEventBlock));
+        if (!block)
+            return NULL;
+        block->next = vt->event_blocks;
+        vt->event_blocks = block;
+        for (INT i = 0; i < EVENT_BLOCK_SZ; ++i)
+            block->events[i]._next = (i + 1 < EVENT_BLOCK_SZ) ? &block->events[i + 1] : NULL;
+        vt->event_free_list = &block->events[0];
+    }
 
-    if (row * vt->columns + column >= vt->rows * vt->columns && vt->config.debug >= VT_DEBUG_ERRORS_ONLY) {
+    VTEvent* event = vt->event_free_list;
+    vt->event_free_list = event->_next;
+    return event;
+}
+
+static void vt_enqueue_event(VT* vt, VTEvent const* event)
+{
+    VTEvent* new_event = vt_new_event(vt);
+    if (!new_event)
+        return;
+    memcpy(new_event, event, sizeof(VTEvent));
+
+    new_event->_next = NULL;
+    if (vt->event_queue_start == NULL)
+        vt->event_queue_start = new_event;
+    if (vt->event_queue_end)
+        vt->event_queue_end->_next = new_event;
+    vt->event_queue_end = new_event;
+}
+
+// Cursor moves are only queued when the events are read, so all the cursor movements in between (TUIs move the
+// cursor before almost every cell) result in a single event. The event carries no position, so its place in the
+// queue doesn't matter.
+static void vt_flush_cursor_moved(VT* vt)
+{
+    if (vt->cursor_moved) {
+        vt->cursor_moved = false;
+        vt_enqueue_event(vt, &(VTEvent) { .type = VT_EVENT_CURSOR_MOVED });
+    }
+}
+
+static void vt_add_event(VT* vt, VTEvent* event)
+{
+    if (event->type == VT_EVENT_CURSOR_MOVED) {
+        vt->cursor_moved = true;
+        return;
+    }
+    vt_enqueue_event(vt, event);
+}
+
+bool vt_next_event(VT* vt, VTEvent* e)
+{
+    vt_flush_cursor_moved(vt);
+    if (vt->event_queue_start == NULL)
+        vt_timed_operations(vt);     // once per drain of the queue
+
+    if (vt->event_queue_start == NULL)
+        return false;
+
+    VTEvent* event_to_remove = vt->event_queue_start;
+    if (e)
+        memcpy(e, event_to_remove, sizeof(VTEvent));
+    vt->event_queue_start = event_to_remove->_next;
+
+    if (vt->event_queue_start == NULL)
+        vt->event_queue_end = NULL;
+    if (event_to_remove == vt->last_scroll_event)
+        vt->last_scroll_event = NULL;
+
+    event_to_remove->_next = vt->event_free_list;
+    vt->event_free_list = event_to_remove;
+
+    return true;
+}
+
+static void vt_free_event_queue(VT* vt)
+{
+    vt->event_queue_start = vt->event_queue_end = NULL;     // the events all live in the blocks (no timed operations
+    vt->last_scroll_event = NULL;                           // here: the VT may be only partly built)
+    vt->cursor_moved = false;
+    vt->event_free_list = NULL;
+    while (vt->event_blocks) {
+        VTEventBlock* next = vt->event_blocks->next;
+        vt_dealloc(vt, vt->event_blocks);
+        vt->event_blocks = next;
+    }
+}
+
+static void vt_beep(VT* vt)
+{
+    vt_add_event(vt, &(VTEvent) { .type = VT_EVENT_BELL });
+}
+
+static void vt_add_event_update_whole_screen(VT* vt)
+{
+    vt_add_event(vt, &(VTEvent) { .type = VT_EVENT_CELLS_UPDATED, .cells = {
+        .column_start = 0, .row_start = 0, .column_end = vt->columns - 1, .row_end = vt->rows - 1,
+    }});
+}
+
+// Scroll events go right after the last scroll event in the queue, ahead of the pending cell updates. As these
+// refer to rows before the scroll, they are moved along with it and merged into a single update.
+static void vt_add_scroll_event(VT* vt, INT top_row, INT bottom_row, INT rows)
+{
+    INT height = bottom_row - top_row + 1;
+
+    // consecutive scrolls of the same region are merged
+    VTEvent* last = vt->last_scroll_event;
+    bool merged = false;
+    if (last && last->scroll.row_start == top_row && last->scroll.row_end == bottom_row && (last->scroll.rows > 0) == (rows > 0)) {
+        last->scroll.rows = rows > 0 ? MIN(last->scroll.rows + rows, height) : MAX(last->scroll.rows + rows, -height);
+        merged = true;
+    }
+
+    // move the pending cell updates, and merge them
+    bool dirty = false;
+    INT r0 = INT16_MAX, r1 = -1, c0 = INT16_MAX, c1 = -1;
+    VTEvent** link = last ? &last->_next : &vt->event_queue_start;
+    VTEvent* previous = last;
+    while (*link) {
+        VTEvent* ev = *link;
+        if (ev->type != VT_EVENT_CELLS_UPDATED) {
+            previous = ev;
+            link = &ev->_next;
+            continue;
+        }
+
+        INT start = ev->cells.row_start, end = ev->cells.row_end;
+        if (end >= top_row && start <= bottom_row) {   // rows inside the region move - keep the original rows too
+            INT moved_start = MAX(start, top_row) - rows, moved_end = MIN(end, bottom_row) - rows;
+            start = MIN(start, MAX(moved_start, top_row));
+            end = MAX(end, MIN(moved_end, bottom_row));
+        }
+        r0 = MIN(r0, start); r1 = MAX(r1, end);
+        c0 = MIN(c0, ev->cells.column_start); c1 = MAX(c1, ev->cells.column_end);
+        dirty = true;
+
+        *link = ev->_next;                             // remove, it's added back merged at the end
+        if (vt->event_queue_end == ev)
+            vt->event_queue_end = previous;
+        ev->_next = vt->event_free_list;
+        vt->event_free_list = ev;
+    }
+
+    if (!merged) {
+        VTEvent* ev = vt_new_event(vt);
+        if (!ev)
+            return;
+        *ev = (VTEvent) { .type = VT_EVENT_SCROLLED, .scroll = { .row_start = top_row, .row_end = bottom_row, .rows = rows } };
+
+        VTEvent** at = last ? &last->_next : &vt->event_queue_start;
+        ev->_next = *at;
+        *at = ev;
+        if (ev->_next == NULL)
+            vt->event_queue_end = ev;
+        vt->last_scroll_event = ev;
+    }
+
+    if (dirty)
+        vt_add_event(vt, &(VTEvent) { .type = VT_EVENT_CELLS_UPDATED, .cells = { .row_start = r0, .row_end = r1, .column_start = c0, .column_end = c1 } });
+}
+
+#define REPLY_MAX (64 * 1024)   // replies not read by the application are dropped past this
+
+static void vt_reply(VT* vt, const char* fmt, ...)
+{
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= (int) sizeof buf || vt->reply_sz + n > REPLY_MAX)
+        return;
+
+    if (vt->reply_sz + n > vt->reply_capacity) {
+        size_t capacity = vt->reply_capacity ? vt->reply_capacity * 2 : 256;
+        while (capacity < vt->reply_sz + n)
+            capacity *= 2;
+        char* reply = vt_alloc(vt, capacity);
+        if (!reply)
+            return;
+        if (vt->reply)
+            memcpy(reply, vt->reply, vt->reply_sz);
+        vt_dealloc(vt, vt->reply);
+        vt->reply = reply;
+        vt->reply_capacity = capacity;
+    }
+    memcpy(&vt->reply[vt->reply_sz], buf, n);
+    vt->reply_sz += n;
+}
+
+size_t vt_read_reply(VT* vt, char* buf, size_t max_sz)
+{
+    size_t n = MIN(max_sz, vt->reply_sz);
+    if (n == 0)
+        return 0;
+    memcpy(buf, vt->reply, n);
+    memmove(vt->reply, &vt->reply[n], vt->reply_sz - n);
+    vt->reply_sz -= n;
+    return n;
+}
+
+#pragma endregion
+
+//
+// UPDATES TO TERMINAL MATRIX
+//
+
+#pragma region Updates to Terminal Matrix
+
+static void vt_rows_changed(VT* vt, INT row_start, INT row_end)
+{
+    row_start = MAX(row_start, 0);
+    row_end = MIN(row_end, vt->rows - 1);
+    if (row_start <= row_end)
+        memset(&vt->row_hash_valid[row_start], 0, (row_end - row_start + 1) * sizeof(bool));
+}
+
+static void vt_set_ch(VT* vt, INT row, INT column, CHAR c)
+{
+    row = MAX(MIN(row, vt->rows - 1), 0);
+    column = MAX(MIN(column, vt->columns - 1), 0);
+
+    if (row * vt->columns + column >= vt->rows * vt->columns && vt->config.debug >= VT_DEBUG_ERRORS_ONLY) {
         fprintf(stderr, "vt_set_ch: trying write data outside of screen bounds");
         return;
     }
 
-    vt->matrix[row * vt->columns + column] = (VTCell) {
+    VTCell* cell = &vt->matrix[row * vt->columns + column];
+    vt_release_links(vt, cell, 1);
+    vt->row_hash_valid[row] = false;
+    *cell = (VTCell) {
         .ch = c,
         .attrib = vt->current_attrib,
+        .link = vt->current_link,
     };
+    vt_retain_links(vt, cell, 1);
 }
 
 static void vt_memset_ch(VT* vt, INT row_start, INT row_end, INT column_start, INT column_end, CHAR c)
@@ -320,19 +1427,14 @@ static void vt_memset_ch(VT* vt, INT row_start, INT row_end, INT column_start, I
     column_start = MIN(MAX(column_start, 0), vt->columns - 1);
     column_end = MIN(MAX(column_end, 0), vt->columns - 1);
 
-    if ((row_start > row_end || row_start == row_end) && column_start > column_end)
-        return;
-
     INT start = row_start * vt->columns + column_start;
     INT end = row_end * vt->columns + column_end;
+    if (start > end)
+        return;
 
-    for (INT i = start; i <= end; ++i) {
-        if (i >= vt->rows * vt->columns && vt->config.debug >= VT_DEBUG_ERRORS_ONLY) {
-            fprintf(stderr, "vt_memset_ch: trying write data outside of screen bounds");
-            return;
-        }
-        vt->matrix[i] = (VTCell) { .ch = c, .attrib = vt->current_attrib };
-    }
+    vt_release_links(vt, &vt->matrix[start], end - start + 1);
+    vt_rows_changed(vt, row_start, row_end);
+    vt->kernels->fill_cells(&vt->matrix[start], (VTCell) { .ch = c, .attrib = vt->current_attrib }, end - start + 1);
 }
 
 static void vt_memmove(VT* vt, INT row_start, INT row_end, INT column_start, INT column_end, INT n_rows, INT n_columns)
@@ -361,9 +1463,54 @@ static void vt_memmove(VT* vt, INT row_start, INT row_end, INT column_start, INT
         return;
     }
 
+    vt_rows_changed(vt, dest / vt->columns, (dest + size - 1) / vt->columns);
+    // the ranges may overlap: the cells copied are retained before the ones overwritten are released, and nothing is
+    // written to the cells until the move
+    vt_retain_links(vt, &vt->matrix[start], size);   // cells copied
+    vt_unref_links(vt, &vt->matrix[dest], size);     // cells overwritten
     memmove(&vt->matrix[dest], &vt->matrix[start], size * sizeof(VTCell));
 }
 
+// Rectangles are inclusive. Full-width rectangles are contiguous in the matrix, otherwise they are handled as one
+// segment per row.
+
+static void vt_fill_rect(VT* vt, INT top, INT bottom, INT left, INT right, CHAR c)
+{
+    top = MAX(top, 0);
+    bottom = MIN(bottom, vt->rows - 1);
+    left = MAX(left, 0);
+    right = MIN(right, vt->columns - 1);
+    if (top > bottom || left > right)
+        return;
+
+    if (left == 0 && right == vt->columns - 1)
+        vt_memset_ch(vt, top, bottom, left, right, c);
+    else
+        for (INT row = top; row <= bottom; ++row)
+            vt_memset_ch(vt, row, row, left, right, c);
+}
+
+static void vt_move_rect(VT* vt, INT top, INT bottom, INT left, INT right, INT n_rows, INT n_columns)
+{
+    // clip the source, and then the destination, to the screen
+    top = MAX(MAX(top, 0), -n_rows);
+    bottom = MIN(MIN(bottom, vt->rows - 1), vt->rows - 1 - n_rows);
+    left = MAX(MAX(left, 0), -n_columns);
+    right = MIN(MIN(right, vt->columns - 1), vt->columns - 1 - n_columns);
+    if (top > bottom || left > right || (n_rows == 0 && n_columns == 0))
+        return;
+
+    if (left == 0 && right == vt->columns - 1) {
+        vt_memmove(vt, top, bottom, left, right, n_rows, 0);
+    } else if (n_rows > 0) {   // rows are copied in the order that doesn't overwrite the source
+        for (INT row = bottom; row >= top; --row)
+            vt_memmove(vt, row, row, left, right, n_rows, n_columns);
+    } else {
+        for (INT row = top; row <= bottom; ++row)
+            vt_memmove(vt, row, row, left, right, n_rows, n_columns);
+    }
+}
+
 #pragma endregion
 
 //
@@ -374,6 +1521,7 @@ static void vt_memmove(VT* vt, INT row_start, INT row_end, INT column_start, INT
 
 static void reframe_cursor(VT* vt)
 {
+    vt->margin_wrap_pending = false;
     vt->cursor.row = MIN(MAX(vt->cursor.row, 0), vt->rows);
     vt->cursor.column = MIN(MAX(vt->cursor.column, 0), vt->columns);
 }
@@ -396,18 +1544,217 @@ static void vt_move_cursor_to(VT* vt, INT row, INT column)
 
 static void vt_cursor_to_bol(VT* vt)
 {
-    vt->cursor.column = 0;
+    vt->cursor.column = vt->cursor.column >= vt->scroll_area_left ? vt->scroll_area_left : 0;
     reframe_cursor(vt);
     vt_add_event(vt, &(VTEvent) { .type = VT_EVENT_CURSOR_MOVED });
 }
 
-static void vt_cursor_tab(VT* vt)
+#pragma endregion
+
+//
+// TAB STOPS
+//
+
+#pragma region Tab stops
+
+#define TAB_WORDS(columns) (((columns) + 63) / 64)
+
+static void default_tab_stops(uint64_t* tab_stops, INT columns, INT from_column)   // every 8 columns
+{
+    for (INT column = from_column; column < columns; ++column) {
+        if (column % 8 == 0 && column != 0)
+            tab_stops[column / 64] |= (uint64_t) 1 << (column % 64);
+        else
+            tab_stops[column / 64] &= ~((uint64_t) 1 << (column % 64));
+    }
+}
+
+// the stops set in the columns that still exist are kept, new columns get the default stops
+static uint64_t* vt_new_tab_stops(VT* vt, INT columns, uint64_t const* previous, INT previous_columns)
+{
+    uint64_t* tab_stops = vt_calloc(vt, TAB_WORDS(columns), sizeof(uint64_t));
+    if (!tab_stops)
+        return NULL;
+    INT kept = previous ? MIN(columns, previous_columns) : 0;
+    if (kept > 0) {
+        memcpy(tab_stops, previous, TAB_WORDS(kept) * sizeof(uint64_t));
+        if (kept % 64)
+            tab_stops[kept / 64] &= ((uint64_t) 1 << (kept % 64)) - 1;
+    }
+    default_tab_stops(tab_stops, columns, kept);
+    return tab_stops;
+}
+
+static void vt_set_tab_stop(VT* vt, INT column, bool set)
+{
+    if (column < 0 || column >= vt->columns)
+        return;
+    if (set)
+        vt->tab_stops[column / 64] |= (uint64_t) 1 << (column % 64);
+    else
+        vt->tab_stops[column / 64] &= ~((uint64_t) 1 << (column % 64));
+}
+
+static void vt_clear_tab_stops(VT* vt)
 {
-    vt->cursor.column = ((vt->cursor.column / 8) + 1) * 8;
+    memset(vt->tab_stops, 0, TAB_WORDS(vt->columns) * sizeof(uint64_t));
+}
+
+static INT vt_next_tab_stop(VT* vt, INT column)   // columns if there's none
+{
+    for (INT c = column + 1; c < vt->columns; c = (c / 64 + 1) * 64) {
+        uint64_t word = vt->tab_stops[c / 64] & (~(uint64_t) 0 << (c % 64));
+        if (word)
+            return MIN((c / 64) * 64 + __builtin_ctzll(word), vt->columns);
+    }
+    return vt->columns;
+}
+
+static INT vt_previous_tab_stop(VT* vt, INT column)   // -1 if there's none
+{
+    for (INT c = column - 1; c >= 0; c = (c / 64) * 64 - 1) {
+        uint64_t word = vt->tab_stops[c / 64] & (~(uint64_t) 0 >> (63 - c % 64));
+        if (word)
+            return (c / 64) * 64 + 63 - __builtin_clzll(word);
+    }
+    return -1;
+}
+
+static void vt_cursor_tab(VT* vt, INT n)   // n > 0: forward (HT, CHT), n < 0: backwards (CBT)
+{
+    INT column = MIN(vt->cursor.column, vt->columns - 1);
+    for (; n > 0 && column < vt->columns - 1; --n)
+        column = MIN(vt_next_tab_stop(vt, column), vt->columns - 1);
+    for (; n < 0 && column > 0; ++n)
+        column = MAX(vt_previous_tab_stop(vt, column), 0);
+    vt->cursor.column = column;
     reframe_cursor(vt);
     vt_add_event(vt, &(VTEvent) { .type = VT_EVENT_CURSOR_MOVED });
 }
 
+#undef TAB_WORDS
+
+#pragma endregion
+
+//
+// SCROLLBACK
+//
+
+#pragma region Scrollback
+
+static void vt_scrollback_widen(VT* vt)
+{
+    if (!vt->scrollback_wrapped && !(vt->scrollback_wrapped = vt_calloc(vt, vt->config.scrollback_lines, sizeof(bool))))
+        return;
+    VTCell* new_scrollback = vt_alloc(vt, vt->config.scrollback_lines * vt->columns * sizeof(VTCell));
+    if (!new_scrollback)
+        return;
+    for (size_t i = 0; i < vt->config.scrollback_lines; ++i) {
+        VTCell* row = &new_scrollback[i * vt->columns];
+        INT j = 0;
+        if (vt->scrollback)
+            for (; j < vt->scrollback_columns; ++j)
+                row[j] = vt->scrollback[i * vt->scrollback_columns + j];
+        for (; j < vt->columns; ++j)
+            row[j] = (VTCell) { .ch = ' ', .attrib = DEFAULT_ATTR };
+    }
+    vt_dealloc(vt, vt->scrollback);
+    vt->scrollback = new_scrollback;
+    vt->scrollback_columns = vt->columns;
+}
+
+static void vt_scrollback_push(VT* vt, INT row)
+{
+    VTCell* cells = &vt->matrix[row * vt->columns];
+    ++vt->scrollback_total;
+    vt_selection_scrolled(vt);
+
+    if (vt->config.scrollback_lines == 0) {
+        vt_release_links(vt, cells, vt->columns);   // the row is leaving the screen
+        if (vt->scrollback_backend.push)
+            vt->scrollback_backend.push(vt->scrollback_backend.data, cells, vt->columns, vt->wrapped[row]);
+        return;
+    }
+
+    if (vt->columns > vt->scrollback_columns) {
+        vt_scrollback_widen(vt);
+        if (vt->columns > vt->scrollback_columns)   // out of memory
+            return;
+    }
+
+    size_t line;
+    if (vt->scrollback_count == vt->config.scrollback_lines) {   // full - oldest line goes to the backend
+        line = vt->scrollback_first;
+        vt_release_links(vt, &vt->scrollback[line * vt->scrollback_columns], vt->scrollback_columns);
+        if (vt->scrollback_backend.push)
+            vt->scrollback_backend.push(vt->scrollback_backend.data, &vt->scrollback[line * vt->scrollback_columns], vt->scrollback_columns,
+                                        vt->scrollback_wrapped[line]);
+        vt->scrollback_first = (vt->scrollback_first + 1) % vt->config.scrollback_lines;
+    } else {
+        line = (vt->scrollback_first + vt->scrollback_count++) % vt->config.scrollback_lines;
+    }
+
+    VTCell* dest = &vt->scrollback[line * vt->scrollback_columns];
+    memcpy(dest, cells, vt->columns * sizeof(VTCell));
+    vt_retain_links(vt, dest, vt->columns);
+    for (INT j = vt->columns; j < vt->scrollback_columns; ++j)
+        dest[j] = (VTCell) { .ch = ' ', .attrib = DEFAULT_ATTR };
+    vt->scrollback_wrapped[line] = vt->wrapped[row];
+}
+
+void vt_set_scrollback_backend(VT* vt, VTScrollbackBackend const* backend)
+{
+    vt->scrollback_backend = backend ? *backend : (VTScrollbackBackend) {};
+}
+
+size_t vt_scrollback_lines(VT* vt)
+{
+    size_t lines = vt->scrollback_count;
+    if (vt->scrollback_backend.lines)
+        lines += vt->scrollback_backend.lines(vt->scrollback_backend.data);
+    return lines;
+}
+
+size_t vt_scrollback_total(VT* vt)
+{
+    return vt->scrollback_total;
+}
+
+INT vt_scrollback_row(VT* vt, size_t line, VTCell* cells, INT max_columns, bool* wrapped)
+{
+    bool dummy;
+    if (!wrapped)
+        wrapped = &dummy;
+
+    if (line < vt->scrollback_count) {
+        size_t idx = (vt->scrollback_first + vt->scrollback_count - 1 - line) % vt->config.scrollback_lines;
+        INT n = MIN(max_columns, vt->scrollback_columns);
+        memcpy(cells, &vt->scrollback[idx * vt->scrollback_columns], n * sizeof(VTCell));
+        *wrapped = vt->scrollback_wrapped[idx];
+        return n;
+    }
+
+    line -= vt->scrollback_count;
+    if (!vt->scrollback_backend.read)
+        return 0;
+    size_t backend_lines = vt->scrollback_backend.lines(vt->scrollback_backend.data);
+    if (line >= backend_lines)
+        return 0;
+    return vt->scrollback_backend.read(vt->scrollback_backend.data, backend_lines - 1 - line, cells, max_columns, wrapped);
+}
+
+void vt_clear_scrollback(VT* vt)
+{
+    for (size_t i = 0; i < vt->scrollback_count; ++i) {
+        size_t line = (vt->scrollback_first + i) % vt->config.scrollback_lines;
+        vt_release_links(vt, &vt->scrollback[line * vt->scrollback_columns], vt->scrollback_columns);
+    }
+    vt->scrollback_first = 0;
+    vt->scrollback_count = 0;
+    if (vt->scrollback_backend.clear)
+        vt->scrollback_backend.clear(vt->scrollback_backend.data);
+}
+
 #pragma endregion
 
 //
@@ -418,48 +1765,98 @@ static void vt_cursor_tab(VT* vt)
 
 static void vt_scroll_vertical(VT* vt, INT top_row, INT bottom_row, INT rows_forward)
 {
-    if (rows_forward == 0)
+    top_row = MAX(top_row, 0);
+    bottom_row = MIN(bottom_row, vt->rows - 1);
+    if (rows_forward == 0 || top_row > bottom_row)
         return;
 
+    // with left/right margins, only the part of the rows between them moves
+    INT left = vt->scroll_area_left, right = vt->scroll_area_right;
+    bool full_width = left == 0 && right == vt->columns - 1;
+
+    INT n = MIN(rows_forward > 0 ? rows_forward : -rows_forward, bottom_row - top_row + 1);
+    INT exposed_start, exposed_end;
     if (rows_forward > 0) {
-        vt_memmove(vt, top_row + rows_forward, bottom_row, 0, vt->columns - 1, -rows_forward, 0);
-        vt_memset_ch(vt, bottom_row - rows_forward + 1, bottom_row, 0, vt->columns - 1, ' ');
+        if (top_row == 0 && full_width && !vt->alternate_screen)   // only the primary screen has a scrollback
+            for (INT row = 0; row < n; ++row)
+                vt_scrollback_push(vt, row);
+        vt_move_rect(vt, top_row + n, bottom_row, left, right, -n, 0);
+        vt_fill_rect(vt, bottom_row - n + 1, bottom_row, left, right, ' ');
+        if (full_width) {
+            memmove(&vt->wrapped[top_row], &vt->wrapped[top_row + n], (bottom_row - top_row + 1 - n) * sizeof(bool));
+            memset(&vt->wrapped[bottom_row - n + 1], 0, n * sizeof(bool));
+        }
+        exposed_start = bottom_row - n + 1;
+        exposed_end = bottom_row;
     } else {
-        vt_memmove(vt, top_row, bottom_row + rows_forward, 0, vt->columns - 1, -rows_forward, 0);
-        vt_memset_ch(vt, top_row, top_row - rows_forward - 1, 0, vt->columns - 1, ' ');
+        vt_move_rect(vt, top_row, bottom_row - n, left, right, n, 0);
+        vt_fill_rect(vt, top_row, top_row + n - 1, left, right, ' ');
+        if (full_width) {
+            memmove(&vt->wrapped[top_row + n], &vt->wrapped[top_row], (bottom_row - top_row + 1 - n) * sizeof(bool));
+            memset(&vt->wrapped[top_row], 0, n * sizeof(bool));
+        }
+        exposed_start = top_row;
+        exposed_end = top_row + n - 1;
     }
 
-    // report events
+    if (!full_width) {   // scroll events move whole rows
+        vt_add_event(vt, &(VTEvent) {
+            .type = VT_EVENT_CELLS_UPDATED,
+            .cells = { .row_start = top_row, .row_end = bottom_row, .column_start = left, .column_end = right },
+        });
+        return;
+    }
+
+    // report events: the rows that moved don't need to be redrawn, only the uncovered ones
+    vt_add_scroll_event(vt, top_row, bottom_row, rows_forward > 0 ? n : -n);
     vt_add_event(vt, &(VTEvent) {
         .type = VT_EVENT_CELLS_UPDATED,
-        .cells = { .row_start = top_row, .row_end = bottom_row, .column_start = 0, .column_end = vt->columns },
+        .cells = { .row_start = exposed_start, .row_end = exposed_end, .column_start = 0, .column_end = vt->columns - 1 },
     });
 }
 
-static void vt_scroll_horizontal(VT* vt, INT row, INT column, INT columns_forward)
+// moves the cells between `column` and the right margin, in the rows given
+static void vt_scroll_horizontal_rows(VT* vt, INT top_row, INT bottom_row, INT column, INT columns_forward)
 {
-    if (columns_forward == 0)
+    INT right = (column >= vt->scroll_area_left && column <= vt->scroll_area_right) ? vt->scroll_area_right : vt->columns - 1;
+    if (columns_forward == 0 || column < 0 || column > right)
         return;
 
+    INT n = MIN(columns_forward > 0 ? columns_forward : -columns_forward, right - column + 1);
     if (columns_forward > 0) {
-        vt_memmove(vt, row, row, column, vt->columns - 1 - columns_forward, 0, columns_forward);
-        vt_memset_ch(vt, row, row, column, column + columns_forward - 1, ' ');
-    } else if (columns_forward < 0) {
-        vt_memmove(vt, row, row, column - columns_forward, vt->columns - 1, 0, columns_forward);
-        vt_memset_ch(vt, row, row, vt->columns + columns_forward, vt->columns - 1, ' ');
+        vt_move_rect(vt, top_row, bottom_row, column, right - n, 0, n);
+        vt_fill_rect(vt, top_row, bottom_row, column, column + n - 1, ' ');
+    } else {
+        vt_move_rect(vt, top_row, bottom_row, column + n, right, 0, -n);
+        vt_fill_rect(vt, top_row, bottom_row, right - n + 1, right, ' ');
     }
 
     // report events
     vt_add_event(vt, &(VTEvent) {
         .type = VT_EVENT_CELLS_UPDATED,
-        .cells = { .row_start = row, .row_end = row, .column_start = column, .column_end = vt->columns - 1 },
+        .cells = { .row_start = top_row, .row_end = bottom_row, .column_start = column, .column_end = right },
     });
 }
 
+static void vt_scroll_horizontal(VT* vt, INT row, INT column, INT columns_forward)
+{
+    vt_scroll_horizontal_rows(vt, row, row, column, columns_forward);
+}
+
+static bool vt_cursor_in_margins(VT* vt)
+{
+    return vt->cursor.row >= vt->scroll_area_top && vt->cursor.row <= vt->scroll_area_bottom
+        && vt->cursor.column >= vt->scroll_area_left && vt->cursor.column <= vt->scroll_area_right;
+}
+
 static void vt_scroll_based_on_cursor(VT* vt)
 {
-    if (vt->cursor.column >= vt->columns) {
-        vt->cursor.column = 0;
+    if (vt->cursor.column >= vt->columns || vt->margin_wrap_pending) {
+        bool full_width = vt->scroll_area_left == 0 && vt->scroll_area_right == vt->columns - 1;
+        if (vt->cursor.row < vt->rows && full_width)
+            vt->wrapped[vt->cursor.row] = true;
+        vt->cursor.column = vt->lr_margin_mode ? vt->scroll_area_left : 0;
+        vt->margin_wrap_pending = false;
         ++vt->cursor.row;
     }
 
@@ -481,6 +1878,74 @@ static void vt_set_scoll_area(VT* vt, INT top, INT bottom)
     vt_move_cursor_to(vt, 0, 0);
 }
 
+static void vt_set_lr_margins(VT* vt, INT left, INT right)   // DECSLRM
+{
+    if (left == 0 && right == 0) {
+        left = 0;
+        right = vt->columns - 1;
+    }
+    left = MAX(left, 0);
+    right = MIN(right, vt->columns - 1);
+    if (left >= right)
+        return;
+    vt->scroll_area_left = left;
+    vt->scroll_area_right = right;
+    vt_move_cursor_to(vt, 0, 0);
+}
+
+#pragma endregion
+
+//
+// RECTANGULAR AREAS
+//
+
+#pragma region Rectangular areas
+
+#define N_OR(n, d) ((n) == 0 ? (d) : (n))
+
+// DEC rectangle parameters are 1-based, and 0 means the default (the screen edges)
+static void vt_rect_args(VT* vt, INT const* args, INT* top, INT* left, INT* bottom, INT* right)
+{
+    *top = N_OR(args[0], 1) - 1;
+    *left = N_OR(args[1], 1) - 1;
+    *bottom = MIN(N_OR(args[2], vt->rows), vt->rows) - 1;
+    *right = MIN(N_OR(args[3], vt->columns), vt->columns) - 1;
+}
+
+static void vt_rect_updated(VT* vt, INT top, INT left, INT bottom, INT right)
+{
+    top = MAX(top, 0);
+    left = MAX(left, 0);
+    bottom = MIN(bottom, vt->rows - 1);
+    right = MIN(right, vt->columns - 1);
+    if (top <= bottom && left <= right)
+        vt_add_event(vt, &(VTEvent) {
+            .type = VT_EVENT_CELLS_UPDATED,
+            .cells = { .row_start = top, .row_end = bottom, .column_start = left, .column_end = right },
+        });
+}
+
+static void vt_copy_rect(VT* vt, INT const* args)   // DECCRA: top, left, bottom, right, page, dest top, dest left, page
+{
+    INT top, left, bottom, right;
+    vt_rect_args(vt, args, &top, &left, &bottom, &right);
+    INT dest_top = N_OR(args[5], 1) - 1, dest_left = N_OR(args[6], 1) - 1;
+    if (top > bottom || left > right)
+        return;
+    vt_move_rect(vt, top, bottom, left, right, dest_top - top, dest_left - left);
+    vt_rect_updated(vt, dest_top, dest_left, dest_top + bottom - top, dest_left + right - left);
+}
+
+static void vt_fill_rect_args(VT* vt, CHAR c, INT const* args)   // DECFRA (with the character) and DECERA
+{
+    INT top, left, bottom, right;
+    vt_rect_args(vt, args, &top, &left, &bottom, &right);
+    vt_fill_rect(vt, top, bottom, left, right, c);
+    vt_rect_updated(vt, top, left, bottom, right);
+}
+
+#undef N_OR
+
 #pragma endregion
 
 //
@@ -494,13 +1959,6 @@ static void vt_start_escape_seq(VT* vt, char c)
     vt->esc_buffer[0] = c;
 }
 
-static void vt_start_receiving_text(VT* vt, VTTextReceivedType r)
-{
-    free(vt->last_text_received);
-    vt->last_text_received = NULL;
-    vt->receiving_text = r;
-}
-
 static void update_current_attrib(VT* vt, int arg)
 {
     switch (arg) {
@@ -572,26 +2030,44 @@ static void update_current_attrib(VT* vt, int arg)
     }
 }
 
-static void escape_seq_clear_cells(VT* vt, char mode, int parameter)
+static void vt_erase_chars(VT* vt, INT n)   // from the cursor, which doesn't move
 {
-    if (mode == 'J') {
+    INT row = MIN(vt->cursor.row, vt->rows - 1);
+    INT column = MIN(vt->cursor.column, vt->columns - 1);
+    INT last = MIN(column + n - 1, vt->columns - 1);
+    vt_memset_ch(vt, row, row, column, last, ' ');
+    vt_add_event(vt, &(VTEvent) {
+        .type = VT_EVENT_CELLS_UPDATED,
+        .cells = { .row_start = row, .row_end = row, .column_start = column, .column_end = last }
+    });
+}
+
+static void escape_seq_clear_cells(VT* vt, char mode, int parameter)
+{
+    if (mode == 'J') {
         switch (parameter) {
             case 0:  // cursor to end of screen
                 vt_memset_ch(vt, vt->cursor.row, vt->rows - 1, vt->cursor.column, vt->columns - 1, ' ');
+                if (vt->cursor.row < vt->rows)
+                    memset(&vt->wrapped[vt->cursor.row], 0, (vt->rows - vt->cursor.row) * sizeof(bool));
                 break;
             case 1:  // start of screen to cursor
                 vt_memset_ch(vt, 0, vt->cursor.row, 0, vt->cursor.column, ' ');
                 break;
             case 2:  // all screen
                 vt_memset_ch(vt, 0, vt->rows - 1, 0, vt->columns - 1, ' ');
+                memset(vt->wrapped, 0, vt->rows * sizeof(bool));
                 break;
-            case 3:
+            case 3:  // scrollback
+                vt_clear_scrollback(vt);
                 break;
             default:
                 if (vt->config.debug >= VT_DEBUG_ERRORS_ONLY)
                     fprintf(stderr, "Unsupported parameter for ESC[#J");
         }
     } else if (mode == 'K') {
+        if (parameter != 1 && vt->cursor.row < vt->rows)
+            vt->wrapped[vt->cursor.row] = false;
         switch (parameter) {
             case 0:  // cursor to end of line
                 vt_memset_ch(vt, vt->cursor.row, vt->cursor.row, vt->cursor.column, vt->columns - 1, ' ');
@@ -609,6 +2085,14 @@ static void escape_seq_clear_cells(VT* vt, char mode, int parameter)
     vt_add_event_update_whole_screen(vt);  // TODO - make it more efficient
 }
 
+static void vt_set_mouse_encoding(VT* vt, VTMouseEncoding encoding, bool enable)
+{
+    if (enable)
+        vt->mouse_encoding = encoding;
+    else if (vt->mouse_encoding == encoding)
+        vt->mouse_encoding = VTME_X10;
+}
+
 static void xterm_escape_seq(VT* vt, char mode, INT arg)
 {
     (void) mode;
@@ -627,7 +2111,13 @@ static void xterm_escape_seq(VT* vt, char mode, INT arg)
         case 25:
             vt->cursor.visible = enable;
             break;
-        case 69:  // ignore for now - margins
+        case 69:  // left/right margins (DECLRMM)
+            vt->lr_margin_mode = enable;
+            vt->scroll_area_left = 0;
+            vt->scroll_area_right = vt->columns - 1;
+            break;
+        case 9:     // X10 mouse: button presses only
+            if (enable) vt->mouse_tracking = VTM_X10; else vt->mouse_tracking = VTM_NO;
             break;
         case 1000:
             if (enable) vt->mouse_tracking = VTM_CLICKS; else vt->mouse_tracking = VTM_NO;
@@ -638,19 +2128,51 @@ static void xterm_escape_seq(VT* vt, char mode, INT arg)
         case 1003:
             if (enable) vt->mouse_tracking = VTM_ALL; else vt->mouse_tracking = VTM_NO;
             break;
+        case 1004:  // focus in/out reports
+            vt->focus_reporting = enable;
+            break;
+        case 1005:  // mouse report encodings - the last one enabled is used
+            vt_set_mouse_encoding(vt, VTME_UTF8, enable);
+            break;
         case 1006:
-            vt->mouse_tracking = enable;
+            vt_set_mouse_encoding(vt, VTME_SGR, enable);
+            break;
+        case 1015:
+            vt_set_mouse_encoding(vt, VTME_URXVT, enable);
+            break;
+        case 1016:
+            vt_set_mouse_encoding(vt, VTME_SGR_PIXELS, enable);
             break;
-        case 1049:  // alternate screen buffer
+        case 47:    // alternate screen buffer
+            vt_switch_screen(vt, enable);
+            break;
+        case 1047:  // alternate screen buffer, cleared when leaving
+            if (!enable && vt->alternate_screen)
+                vt_clear_screen_buffer(vt, &(VTScreen) { .matrix = vt->matrix, .wrapped = vt->wrapped });
+            vt_switch_screen(vt, enable);
+            break;
+        case 1048:  // save/restore cursor
+            if (enable)
+                vt->cursor_saved = vt->cursor;
+            else
+                vt->cursor = vt->cursor_saved;
+            break;
+        case 1049:  // save cursor and switch to a cleared alternate screen buffer
             if (enable) {
-                memcpy(vt->matrix_copy, vt->matrix, vt->columns * vt->rows * sizeof(VTCell));
+                bool switched = !vt->alternate_screen;
+                if (!vt_switch_screen(vt, true))
+                    break;      // out of memory: stay on the primary screen, untouched
                 vt->cursor_saved = vt->cursor;
+                vt_clear_screen_buffer(vt, &(VTScreen) { .matrix = vt->matrix, .wrapped = vt->wrapped });
+                if (!switched)      // switching already reports the whole screen
+                    vt_add_event_update_whole_screen(vt);
             } else {
-                memcpy(vt->matrix, vt->matrix_copy, vt->columns * vt->rows * sizeof(VTCell));
+                vt_switch_screen(vt, false);
                 vt->cursor = vt->cursor_saved;
             }
             break;
-        case 2004:  // ignore for now - Bracketed Paste Mode
+        case 2004:  // bracketed paste mode
+            vt->bracketed_paste = enable;
             break;
         default:
             if (vt->config.debug >= VT_DEBUG_ERRORS_ONLY)
@@ -658,7 +2180,85 @@ static void xterm_escape_seq(VT* vt, char mode, INT arg)
     }
 }
 
-static bool match_escape_seq(VT* vt, const char* data, const char* pattern, INT args[8], int* argn)
+// DECRQM: 0 = mode not recognized, 1 = set, 2 = reset
+static int vt_mode_value(VT* vt, bool private_mode, INT mode)
+{
+    bool set;
+    if (!private_mode) {
+        switch (mode) {
+            case 4: set = vt->insert_mode; break;
+            default: return 0;
+        }
+    } else {
+        switch (mode) {
+            case 1:    set = vt->cursor_app_mode; break;
+            case 12:   set = vt->cursor.blinking; break;
+            case 25:   set = vt->cursor.visible; break;
+            case 69:   set = vt->lr_margin_mode; break;
+            case 47:
+            case 1047:
+            case 1049: set = vt->alternate_screen; break;
+            case 9:    set = vt->mouse_tracking == VTM_X10; break;
+            case 1000: set = vt->mouse_tracking == VTM_CLICKS; break;
+            case 1002: set = vt->mouse_tracking == VTM_DRAG; break;
+            case 1003: set = vt->mouse_tracking == VTM_ALL; break;
+            case 1004: set = vt->focus_reporting; break;
+            case 1005: set = vt->mouse_encoding == VTME_UTF8; break;
+            case 1006: set = vt->mouse_encoding == VTME_SGR; break;
+            case 1015: set = vt->mouse_encoding == VTME_URXVT; break;
+            case 1016: set = vt->mouse_encoding == VTME_SGR_PIXELS; break;
+            case 2004: set = vt->bracketed_paste; break;
+            default:   return 0;
+        }
+    }
+    return set ? 1 : 2;
+}
+
+static void vt_device_status_report(VT* vt, bool private_mode, INT arg)
+{
+    switch (arg) {
+        case 5:   // status
+            vt_reply(vt, "\e[0n");
+            break;
+        case 6:   // cursor position
+            if (private_mode)
+                vt_reply(vt, "\e[?%d;%d;1R", vt->cursor.row + 1, vt->cursor.column + 1);
+            else
+                vt_reply(vt, "\e[%d;%dR", vt->cursor.row + 1, vt->cursor.column + 1);
+            break;
+        default:
+            if (vt->config.debug >= VT_DEBUG_ERRORS_ONLY)
+                fprintf(stderr, "Unsupported device status report: %d\n", arg);
+    }
+}
+
+static void vt_push_kitty_flags(VT* vt, INT flags)
+{
+    if (vt->kitty_flags_sz == sizeof vt->kitty_flags) {   // full - oldest entry is dropped
+        memmove(vt->kitty_flags, &vt->kitty_flags[1], sizeof vt->kitty_flags - 1);
+        --vt->kitty_flags_sz;
+    }
+    vt->kitty_flags[vt->kitty_flags_sz++] = flags;
+}
+
+static void vt_pop_kitty_flags(VT* vt, INT n)
+{
+    vt->kitty_flags_sz -= MIN(n, vt->kitty_flags_sz);
+}
+
+static void vt_set_kitty_flags(VT* vt, INT flags, INT mode)
+{
+    if (vt->kitty_flags_sz == 0)
+        vt_push_kitty_flags(vt, 0);
+    uint8_t* current = &vt->kitty_flags[vt->kitty_flags_sz - 1];
+    switch (mode) {
+        case 1: *current = flags; break;
+        case 2: *current |= flags; break;
+        case 3: *current &= ~flags; break;
+    }
+}
+
+static bool match_escape_seq(const char* data, const char* pattern, INT args[8], int* argn)
 {
     int i = 0;
 
@@ -684,14 +2284,40 @@ static bool match_escape_seq(VT* vt, const char* data, const char* pattern, INT
         }
     }
 
-    if (i == (int) strlen(data)) {                                  // did we match the whole input?
-        if (vt->config.debug >= VT_DEBUG_ALL_ESCAPE_SEQUENCES) {
-            printf("\e[0;35m\\e%s\e[0m", &data[1]);
-            fflush(stdout);
+    return i == (int) strlen(data);                                 // did we match the whole input?
+}
+
+// parses "\e[" followed by up to 8 numeric parameters and a final byte; missing parameters are 0
+static bool parse_csi_params(const char* data, INT args[8], int* argn)
+{
+    *argn = 0;
+    memset(args, 0, sizeof args[0] * 8);
+    const char* p = &data[2];
+    for (;;) {
+        INT value = 0;
+        while (*p >= '0' && *p <= '9')
+            value = value * 10 + (*p++ - '0');
+        if (*argn == 8)
+            return false;
+        args[(*argn)++] = value;
+        if (*p != ';')
+            break;
+        ++p;
+    }
+    return p[0] != '\0' && p[1] == '\0';   // only the final byte is left
+}
+
+static void vt_apply_sgr(VT* vt, INT const* args, int argn)
+{
+    for (int i = 0; i < argn; ++i) {
+        if (args[i] == 38 || args[i] == 48) {   // 256 colors and true color are not supported: skip their parameters
+            if (i + 1 < argn && args[i + 1] == 5)
+                i += 2;
+            else if (i + 1 < argn && args[i + 1] == 2)
+                i += 4;
+            continue;
         }
-        return true;
-    } else {
-        return false;
+        update_current_attrib(vt, args[i]);
     }
 }
 
@@ -699,10 +2325,13 @@ static bool parse_escape_seq(VT* vt)
 {
 #define T return true;
 #define N(n) ((n) == 0 ? 1 : (n))
-#define MATCH(pattern) match_escape_seq(vt, vt->esc_buffer, pattern, args, &argn)
+#define MATCH(pattern) match_escape_seq(vt->esc_buffer, pattern, args, &argn)
 
-    if (strcmp(vt->esc_buffer, "\e]0;") == 0) { vt_start_receiving_text(vt, VTT_WINDOW_TITLE_UPDATED); T }
-    if (strcmp(vt->esc_buffer, "\e]7;") == 0) { vt_start_receiving_text(vt, VTT_DIRECTORY_HINT_UPDATED); T }
+    if (strcmp(vt->esc_buffer, "\e]") == 0) { vt_start_string(vt, STR_OSC); T }
+    if (strcmp(vt->esc_buffer, "\eP") == 0) { vt_start_string(vt, STR_DCS); T }
+    if (strcmp(vt->esc_buffer, "\e_") == 0) { vt_start_string(vt, STR_APC); T }
+    if (strcmp(vt->esc_buffer, "\e^") == 0) { vt_start_string(vt, STR_PM); T }
+    if (strcmp(vt->esc_buffer, "\eX") == 0) { vt_start_string(vt, STR_SOS); T }
 
     size_t sz = strlen(vt->esc_buffer);
     char last_char = vt->esc_buffer[sz - 1];
@@ -712,58 +2341,89 @@ static bool parse_escape_seq(VT* vt)
     INT args[8];
     int argn;
 
+    // fast path for the sequences TUIs send before almost every cell: SGR and CUP, with numeric parameters only
+    if (vt->esc_buffer[1] == '[' && (last_char == 'm' || last_char == 'H') && parse_csi_params(vt->esc_buffer, args, &argn)) {
+        if (last_char == 'm')
+            vt_apply_sgr(vt, args, argn);
+        else
+            vt_move_cursor_to(vt, args[0] - 1, args[1] - 1);
+        T
+    }
+
     if (MATCH("\e[?%%h"))       { xterm_escape_seq(vt, 'h', args[0]); if (args[1] != 0) xterm_escape_seq(vt, 'h', args[1]); T }
     if (MATCH("\e[?%%l"))       { xterm_escape_seq(vt, 'l', args[0]); if (args[1] != 0) xterm_escape_seq(vt, 'l', args[1]); T }
-    if (MATCH("\e[%%%t"))       { T }    // do nothing for now (Xterm extension)
-    if (MATCH("\e="))           { T }    // do nothing - not used anymore - keypad related
-    if (MATCH("\e>"))           { T }    // do nothing - not used anymore - keypad related
+    if (MATCH("\e[%%%t"))       { if (args[0] == 18) vt_reply(vt, "\e[8;%d;%dt", vt->rows, vt->columns); T }   // other window operations are ignored
+    if (MATCH("\e[%n"))         { vt_device_status_report(vt, false, args[0]); T }
+    if (MATCH("\e[?%n"))        { vt_device_status_report(vt, true, args[0]); T }
+    if (MATCH("\e[%c"))         { if (args[0] == 0) vt_reply(vt, "\e[?1;2c"); T }             // DA1: VT100 with advanced video
+    if (MATCH("\e[>%c"))        { if (args[0] == 0) vt_reply(vt, "\e[>0;%d;0c", VERSION_NUMBER); T }   // DA2
+    if (MATCH("\e[=%c"))        { if (args[0] == 0) vt_reply(vt, "\eP!|00000000\e\\"); T }   // DA3
+    if (MATCH("\e[?%$p"))       { vt_reply(vt, "\e[?%d;%d$y", args[0], vt_mode_value(vt, true, args[0])); T }   // DECRQM
+    if (MATCH("\e[%$p"))        { vt_reply(vt, "\e[%d;%d$y", args[0], vt_mode_value(vt, false, args[0])); T }
+    if (MATCH("\e[>%q"))        { vt_reply(vt, "\eP>|libvirtterm(" LIBVIRTTERM_VERSION ")\e\\"); T }   // XTVERSION
+    if (MATCH("\e[?u"))         { vt_reply(vt, "\e[?%du", vt->kitty_flags_sz ? vt->kitty_flags[vt->kitty_flags_sz - 1] : 0); T }
+    if (MATCH("\e="))           { vt->keypad_app_mode = true; T }
+    if (MATCH("\e>"))           { vt->keypad_app_mode = false; T }
+    if (MATCH("\e[>%u"))        { vt_push_kitty_flags(vt, args[0]); T }
+    if (MATCH("\e[<%u"))        { vt_pop_kitty_flags(vt, N(args[0])); T }
+    if (MATCH("\e[=%%u"))       { vt_set_kitty_flags(vt, args[0], N(args[1])); T }
     if (MATCH("\e[%@"))         { vt_scroll_horizontal(vt, vt->cursor.row, vt->cursor.column, N(args[0])); T }
     if (MATCH("\e[%A"))         { vt_cursor_advance(vt, -N(args[0]), 0); T }
     if (MATCH("\e[%B"))         { vt_cursor_advance(vt, N(args[0]), 0); T }
     if (MATCH("\e[%C"))         { vt_cursor_advance(vt, 0, N(args[0])); T }
     if (MATCH("\e[%D"))         { vt_cursor_advance(vt, 0, -N(args[0])); T }
-    if (MATCH("\e[%E"))         { vt_cursor_advance(vt, args[0] - 1, -vt->cursor.column); T }
-    if (MATCH("\e[%F"))         { vt_cursor_advance(vt, args[0] + 1, -vt->cursor.column); T }
+    if (MATCH("\e[%E"))         { vt_cursor_advance(vt, N(args[0]), -vt->cursor.column); T }
+    if (MATCH("\e[%F"))         { vt_cursor_advance(vt, -N(args[0]), -vt->cursor.column); T }
     if (MATCH("\e[%G"))         { vt_move_cursor_to(vt, vt->cursor.row, args[0] - 1); T }
     if (MATCH("\e[%%H"))        { vt_move_cursor_to(vt, args[0] - 1, args[1] - 1); T }
     if (MATCH("\e[%K"))         { escape_seq_clear_cells(vt, 'K', args[0]); T }
     if (MATCH("\e[%J"))         { escape_seq_clear_cells(vt, 'J', args[0]); T }
-    if (MATCH("\e[%L"))         { vt_scroll_vertical(vt, vt->cursor.row, vt->scroll_area_bottom, -N(args[0])); T }
-    if (MATCH("\e[%M"))         { vt_scroll_vertical(vt, vt->cursor.row, vt->scroll_area_bottom, N(args[0])); T }
+    if (MATCH("\e[%L"))         { if (vt_cursor_in_margins(vt)) vt_scroll_vertical(vt, vt->cursor.row, vt->scroll_area_bottom, -N(args[0])); T }
+    if (MATCH("\e[%M"))         { if (vt_cursor_in_margins(vt)) vt_scroll_vertical(vt, vt->cursor.row, vt->scroll_area_bottom, N(args[0])); T }
+    if (MATCH("\e[%S"))         { vt_scroll_vertical(vt, vt->scroll_area_top, vt->scroll_area_bottom, N(args[0])); T }
+    if (MATCH("\e[%T"))         { vt_scroll_vertical(vt, vt->scroll_area_top, vt->scroll_area_bottom, -N(args[0])); T }
+    if (MATCH("\e[%'}"))        { if (vt_cursor_in_margins(vt)) vt_scroll_horizontal_rows(vt, vt->scroll_area_top, vt->scroll_area_bottom, vt->cursor.column, N(args[0])); T }    // DECIC
+    if (MATCH("\e[%'~"))        { if (vt_cursor_in_margins(vt)) vt_scroll_horizontal_rows(vt, vt->scroll_area_top, vt->scroll_area_bottom, vt->cursor.column, -N(args[0])); T }   // DECDC
+    if (MATCH("\e[% @"))        { vt_scroll_horizontal_rows(vt, vt->scroll_area_top, vt->scroll_area_bottom, vt->scroll_area_left, -N(args[0])); T }   // SL
+    if (MATCH("\e[% A"))        { vt_scroll_horizontal_rows(vt, vt->scroll_area_top, vt->scroll_area_bottom, vt->scroll_area_left, N(args[0])); T }    // SR
+    if (MATCH("\e[%%s"))        { if (vt->lr_margin_mode) vt_set_lr_margins(vt, args[0] - 1, args[1] - 1); T }   // DECSLRM
+    if (MATCH("\e[%%%%%%%%$v")) { vt_copy_rect(vt, args); T }                                           // DECCRA
+    if (MATCH("\e[%%%%%$x"))    { if ((args[0] >= 32 && args[0] < 127) || args[0] >= 160) vt_fill_rect_args(vt, args[0], &args[1]); T }   // DECFRA
+    if (MATCH("\e[%%%%$z"))     { vt_fill_rect_args(vt, ' ', args); T }                                 // DECERA
     if (MATCH("\e[%P"))         { vt_scroll_horizontal(vt, vt->cursor.row, vt->cursor.column, -N(args[0])); T }
-    if (MATCH("\e[%X"))         { for (INT i = 0; i < N(args[0]); ++i) vt_add_char(vt, ' '); T }
+    if (MATCH("\e[%X"))         { vt_erase_chars(vt, N(args[0])); T }                   // ECH
     if (MATCH("\e[%a"))         { vt_cursor_advance(vt, 0, N(args[0])); T }
     if (MATCH("\e[%d"))         { vt_move_cursor_to(vt, args[0] - 1, vt->cursor.column); T }
     if (MATCH("\e[%e"))         { vt_cursor_advance(vt, N(args[0]), 0); T }
     if (MATCH("\e[%%f"))        { vt_move_cursor_to(vt, args[0] - 1, args[1] - 1); T }
     if (MATCH("\e[%%r"))        { vt_set_scoll_area(vt, N(args[0]) - 1, N(args[1]) - 1); T }
-    if (MATCH("\e[%b"))         { INT n = N(args[0]); for (INT i = 0; i < n; ++i) vt_add_char(vt, vt->last_char); T }
+    if (MATCH("\e[%I"))         { vt_cursor_tab(vt, N(args[0])); T }                    // CHT
+    if (MATCH("\e[%Z"))         { vt_cursor_tab(vt, -N(args[0])); T }                   // CBT
+    if (MATCH("\eH"))           { vt_set_tab_stop(vt, vt->cursor.column, true); T }     // HTS
+    if (MATCH("\e[%g"))         { if (args[0] == 0) vt_set_tab_stop(vt, vt->cursor.column, false); else if (args[0] == 3) vt_clear_tab_stops(vt); T }   // TBC
+    if (MATCH("\e[?5W"))        { default_tab_stops(vt->tab_stops, vt->columns, 0); T }   // DECST8C
+    if (MATCH("\e[%b"))         { INT n = vt->last_char ? N(args[0]) : 0; for (INT i = 0; i < n; ++i) vt_add_char(vt, vt->last_char); T }   // REP
     if (MATCH("\e[4h"))         { vt->insert_mode = true; T }
     if (MATCH("\e[4l"))         { vt->insert_mode = false; T }
 
     if (MATCH("\e(0"))          { vt->acs_mode = true; T }
     if (MATCH("\e(B"))          { vt->acs_mode = false; T }
 
-    if (MATCH("\e7"))           { vt->cursor_saved = vt->cursor; }
-    if (MATCH("\e8"))           { vt->cursor = vt->cursor_saved; }
+    if (MATCH("\e7"))           { vt->cursor_saved = vt->cursor; T }
+    if (MATCH("\e8"))           { vt->cursor = vt->cursor_saved; T }
     if (MATCH("\ec"))           { vt_reset(vt); T }
     if (MATCH("\e[!p"))         { T }  // soft reset
 
     if (MATCH("\eM")) {
-        if (vt->cursor.row == 0)
+        if (vt->cursor.row == vt->scroll_area_top)
             vt_scroll_vertical(vt, vt->scroll_area_top, vt->scroll_area_bottom, -1);
         else
             vt_cursor_advance(vt, -1, 0);
         T
     }
 
-    if (MATCH("\e[%%%%m")) {
-        for (int i = 0; i < argn; ++i)
-            if (args[i] == 38 || args[i] == 48)
-                T
-        for (int i = 0; i < argn; ++i)
-            if (i == 0 || (i > 0 && args[i] != 0))
-                update_current_attrib(vt, args[i]);
+    if (MATCH("\e[%%%%%%%%m")) {
+        vt_apply_sgr(vt, args, argn);
         T
     }
 
@@ -782,11 +2442,13 @@ static void cancel_escape_seq(VT* vt)
 {
     char copy_buf[sizeof vt->esc_buffer];
     memcpy(copy_buf, vt->esc_buffer, sizeof vt->esc_buffer);
+    TRACE_ACTION(vt, VT_TRACE_INVALID)
     if (vt->config.debug >= VT_DEBUG_ERRORS_ONLY)
         fprintf(stderr, "Invalid escape sequence: (ESC)%s\n", &copy_buf[1]);
+    vt_debug_dump_trace(vt);
     vt_beep(vt);
     end_escape_seq(vt);
-    vt_write(vt, &copy_buf[1], strlen(copy_buf) - 1);
+    vt_parse(vt, &copy_buf[1], strlen(copy_buf) - 1);
 }
 
 static void vt_add_escape_char(VT* vt, char c)
@@ -799,17 +2461,398 @@ static void vt_add_escape_char(VT* vt, char c)
 
     vt->esc_buffer[len] = c;
 
+    // control sequences only end on their final byte (0x40-0x7e): there's no point matching parameters and intermediates
+    if (vt->esc_buffer[1] == '[' && len >= 2 && c >= 0x20 && c <= 0x3f)
+        return;
+
     if (parse_escape_seq(vt)) {
+        TRACE_ACTION(vt, VT_TRACE_SEQUENCE)
         end_escape_seq(vt);
     } else if (isalpha(vt->esc_buffer[strlen(vt->esc_buffer) - 1])) {
+        TRACE_ACTION(vt, VT_TRACE_UNRECOGNIZED)
         if (vt->config.debug >= VT_DEBUG_ERRORS_ONLY)
             fprintf(stderr, "Escape sequence not recognized: (ESC)%s\n", &vt->esc_buffer[1]);
+        vt_debug_dump_trace(vt);
         end_escape_seq(vt);
     }
 }
 
 #pragma endregion
 
+//
+// CONTROL STRINGS
+//
+
+#pragma region Control Strings
+
+static const uint32_t default_colors[16] = {
+    0x000000, 0x800000, 0x008000, 0x808000, 0x0000a0, 0x800080, 0x008080, 0xc0c0c0,
+    0x808080, 0xff0000, 0x00ff00, 0xffff00, 0x5050ff, 0xff00ff, 0x00ffff, 0xffffff,
+};
+
+static void vt_reset_colors(VT* vt)
+{
+    for (int i = 0; i < 16; ++i)
+        vt->colors[i] = default_colors[i];
+    for (int i = 16; i < VT_COLOR_MAX; ++i)
+        vt->colors[i] = -1;
+}
+
+static void vt_start_string(VT* vt, StringType type)
+{
+    vt->string_type = type;
+    vt->string_sz = 0;
+    vt->string_overflow = false;
+    vt->string_esc = false;
+}
+
+static void vt_append_to_string(VT* vt, const char* data, size_t sz)
+{
+    if (vt->string_overflow)
+        return;
+    if (vt->string_sz + sz > vt->config.max_string_size) {
+        vt->string_overflow = true;
+        return;
+    }
+
+    if (vt->string_sz + sz + 1 > vt->string_capacity) {   // room for the terminator
+        size_t capacity = vt->string_capacity ? vt->string_capacity : 64;
+        while (capacity < vt->string_sz + sz + 1)
+            capacity *= 2;
+        char* string = vt_alloc(vt, capacity);
+        if (!string) {
+            vt->string_overflow = true;
+            return;
+        }
+        if (vt->string)
+            memcpy(string, vt->string, vt->string_sz);
+        vt_dealloc(vt, vt->string);
+        vt->string = string;
+        vt->string_capacity = capacity;
+    }
+    memcpy(&vt->string[vt->string_sz], data, sz);
+    vt->string_sz += sz;
+}
+
+static void vt_add_text_event(VT* vt, VTTextReceivedType type, const char* text)
+{
+    vt_add_event(vt, &(VTEvent) { .type = VT_EVENT_TEXT_RECEIVED, .text_received = { .type = type, .text = strdup(text) } });
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// color specifications: rgb:r/g/b (1 to 4 hex digits each) or #rrggbb
+static int32_t parse_color_spec(const char* spec)
+{
+    uint32_t rgb = 0;
+
+    if (spec[0] == '#' && strlen(spec) == 7) {
+        for (int i = 1; i < 7; ++i) {
+            int v = hex_value(spec[i]);
+            if (v < 0)
+                return -1;
+            rgb = (rgb << 4) | v;
+        }
+        return rgb;
+    }
+
+    if (strncmp(spec, "rgb:", 4) != 0)
+        return -1;
+    const char* p = &spec[4];
+    for (int component = 0; component < 3; ++component) {
+        uint32_t value = 0;
+        int digits = 0;
+        for (; hex_value(*p) >= 0; ++p, ++digits)
+            value = (value << 4) | hex_value(*p);
+        if (digits < 1 || digits > 4 || (component < 2 ? *p != '/' : *p != '\0'))
+            return -1;
+        ++p;
+        rgb = (rgb << 8) | (value * 255 / ((1u << (digits * 4)) - 1));   // scale to 8 bits
+    }
+    return rgb;
+}
+
+static void vt_set_color(VT* vt, int index, const char* spec, const char* terminator)
+{
+    if (strcmp(spec, "?") == 0 && index >= 0 && index < VT_COLOR_MAX) {   // query
+        uint32_t rgb = vt_color_rgb(vt, index);
+        uint32_t r = (rgb >> 16) & 0xff, g = (rgb >> 8) & 0xff, b = rgb & 0xff;
+        if (index < 16)
+            vt_reply(vt, "\e]4;%d;rgb:%04x/%04x/%04x%s", index, r * 0x101, g * 0x101, b * 0x101, terminator);
+        else
+            vt_reply(vt, "\e]%d;rgb:%04x/%04x/%04x%s", index - VT_COLOR_FOREGROUND + 10, r * 0x101, g * 0x101, b * 0x101, terminator);
+        return;
+    }
+
+    int32_t rgb = parse_color_spec(spec);
+    if (index < 0 || index >= VT_COLOR_MAX || rgb < 0) {
+        if (vt->config.debug >= VT_DEBUG_ERRORS_ONLY)
+            fprintf(stderr, "Invalid color %d: %s\n", index, spec);
+        return;
+    }
+    vt->colors[index] = rgb;
+    vt_add_event(vt, &(VTEvent) { .type = VT_EVENT_PALETTE_UPDATED });
+}
+
+static void vt_reset_color(VT* vt, int index)
+{
+    if (index < 0 || index >= VT_COLOR_MAX)
+        return;
+    vt->colors[index] = index < 16 ? (int32_t) default_colors[index] : -1;
+    vt_add_event(vt, &(VTEvent) { .type = VT_EVENT_PALETTE_UPDATED });
+}
+
+static size_t base64_decode(const char* in, char* out)   // out can be the same as in
+{
+    size_t n = 0;
+    uint32_t bits = 0;
+    int nbits = 0;
+    for (; *in && *in != '='; ++in) {
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        const char* pos = strchr(alphabet, *in);
+        if (!pos)
+            continue;
+        bits = (bits << 6) | (pos - alphabet);
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            out[n++] = (char) (bits >> nbits);
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static void vt_osc(VT* vt, char* payload, const char* terminator)
+{
+    char* arg;
+    long command = strtol(payload, &arg, 10);
+    if (arg == payload || (*arg != ';' && *arg != '\0'))
+        goto invalid;
+    if (*arg == ';')
+        ++arg;
+
+    switch (command) {
+        case 0:     // window and icon title
+        case 2:     // window title
+            vt_add_text_event(vt, VTT_WINDOW_TITLE_UPDATED, arg);
+            break;
+        case 1:
+            vt_add_text_event(vt, VTT_ICON_TITLE_UPDATED, arg);
+            break;
+        case 7:     // current directory
+            vt_add_text_event(vt, VTT_DIRECTORY_HINT_UPDATED, arg);
+            break;
+        case 8: {   // hyperlink: <params>;<uri> (an empty URI closes it)
+            char* uri = strchr(arg, ';');
+            if (!uri)
+                goto invalid;
+            *uri++ = '\0';
+            vt_open_hyperlink(vt, arg, uri);
+            break;
+        }
+        case 52: {  // clipboard: <selection>;<base64 data>
+            char* data = strchr(arg, ';');
+            if (!data)
+                goto invalid;
+            ++data;
+            if (strcmp(data, "?") == 0)
+                break;   // clipboard queries are not answered
+            base64_decode(data, data);
+            vt_add_text_event(vt, VTT_CLIPBOARD_SET, data);
+            break;
+        }
+        case 4:     // palette: <index>;<color>[;<index>;<color>...]
+            for (char* p = arg; *p; ) {
+                char* index_end;
+                long index = strtol(p, &index_end, 10);
+                if (index_end == p || *index_end != ';')
+                    goto invalid;
+                char* spec = index_end + 1;
+                char* next = strchr(spec, ';');
+                if (next)
+                    *next++ = '\0';
+                if (index < 16)
+                    vt_set_color(vt, index, spec, terminator);
+                p = next ? next : &spec[strlen(spec)];
+            }
+            break;
+        case 10:    // foreground, background and cursor colors - each following color sets the next one
+        case 11:
+        case 12:
+            for (char* spec = arg; spec && *spec && command <= 12; ++command) {
+                char* next = strchr(spec, ';');
+                if (next)
+                    *next++ = '\0';
+                vt_set_color(vt, VT_COLOR_FOREGROUND + command - 10, spec, terminator);
+                spec = next;
+            }
+            break;
+        case 104:   // reset palette colors (all of them if none is given)
+            if (*arg == '\0') {
+                for (int i = 0; i < 16; ++i)
+                    vt_reset_color(vt, i);
+            }
+            for (char* p = arg; *p; ) {
+                vt_reset_color(vt, strtol(p, &p, 10));
+                while (*p == ';')
+                    ++p;
+            }
+            break;
+        case 110:
+        case 111:
+        case 112:
+            vt_reset_color(vt, VT_COLOR_FOREGROUND + command - 110);
+            break;
+        case 9:     // notification: <body>
+            vt_add_text_event(vt, VTT_NOTIFICATION, arg);
+            break;
+        case 777: { // notification: notify;<title>;<body>
+            if (strncmp(arg, "notify;", 7) != 0)
+                goto invalid;
+            char* title = &arg[7];
+            char* body = strchr(title, ';');
+            if (body)
+                *body = '\n';   // the title goes in the first line
+            vt_add_text_event(vt, VTT_NOTIFICATION, body && body == title ? body + 1 : title);
+            break;
+        }
+        default:
+            goto invalid;
+    }
+    return;
+
+invalid:
+    if (vt->config.debug >= VT_DEBUG_ERRORS_ONLY)
+        fprintf(stderr, "Invalid/unsupported OSC sequence: %.40s\n", payload);
+}
+
+// XTGETTCAP: termcap/terminfo capabilities, names and values in hex
+static const struct { const char* name; const char* value; } capabilities[] = {
+    { "TN",     "xterm" },
+    { "name",   "xterm" },
+    { "Co",     "16" },
+    { "colors", "16" },
+    { "kbs",    "\b" },
+    { "kcuu1",  "\eOA" },
+    { "kcud1",  "\eOB" },
+    { "kcuf1",  "\eOC" },
+    { "kcub1",  "\eOD" },
+};
+
+static void vt_request_termcap(VT* vt, const char* names)
+{
+    for (const char* p = names; *p; ) {
+        size_t len = strcspn(p, ";");
+        char name[32];
+        size_t name_sz = 0;
+        for (size_t i = 0; i + 1 < len && name_sz < sizeof name - 1; i += 2) {
+            int hi = hex_value(p[i]), lo = hex_value(p[i + 1]);
+            if (hi < 0 || lo < 0)
+                break;
+            name[name_sz++] = (char) (hi << 4 | lo);
+        }
+        name[name_sz] = '\0';
+
+        const char* value = NULL;
+        for (size_t i = 0; i < sizeof capabilities / sizeof capabilities[0]; ++i)
+            if (strcmp(name, capabilities[i].name) == 0)
+                value = capabilities[i].value;
+
+        if (value && len < 64) {
+            char hex[64];
+            size_t n = 0;
+            for (const char* v = value; *v && n + 2 < sizeof hex; ++v)
+                n += sprintf(&hex[n], "%02X", (uint8_t) *v);
+            vt_reply(vt, "\eP1+r%.*s=%s\e\\", (int) len, p, hex);
+        } else {
+            vt_reply(vt, "\eP0+r%.*s\e\\", (int) MIN(len, (size_t) 64), p);
+        }
+
+        p += len;
+        if (*p == ';')
+            ++p;
+    }
+}
+
+static void vt_end_string(VT* vt, const char* terminator)
+{
+    StringType type = vt->string_type;
+    vt->string_type = STR_NONE;
+    vt->string_esc = false;
+
+    if (vt->string_overflow) {
+        if (vt->config.debug >= VT_DEBUG_ERRORS_ONLY)
+            fprintf(stderr, "Control string larger than %zu bytes dropped.\n", vt->config.max_string_size);
+        return;
+    }
+
+    char empty[1] = "";
+    char* payload = vt->string ? vt->string : empty;
+    payload[vt->string_sz] = '\0';
+
+    switch (type) {
+        case STR_OSC:
+            vt_osc(vt, payload, terminator);
+            break;
+        case STR_DCS:
+            if (strncmp(payload, "+q", 2) == 0) {
+                vt_request_termcap(vt, &payload[2]);
+                break;
+            }
+            // fallthrough
+        default:   // other DCS strings, APC, PM and SOS are accepted and ignored
+            if (vt->config.debug >= VT_DEBUG_ERRORS_ONLY)
+                fprintf(stderr, "Unsupported control string: %.40s\n", payload);
+    }
+}
+
+// Adds bytes to the control string being received, returning how many were used (at least one). Ordinary bytes
+// are consumed in runs, so long payloads are copied in bulk.
+static size_t vt_add_string_bytes(VT* vt, const char* data, size_t sz)
+{
+    CHAR c = data[0];
+
+    if (vt->string_esc) {
+        vt->string_esc = false;
+        if (c == '\\') {                            // ST
+            vt_end_string(vt, "\e\\");
+        } else {                                    // ESC starts a new escape sequence, aborting the string
+            vt->string_type = STR_NONE;
+            vt_start_escape_seq(vt, '\e');
+            vt_add_escape_char(vt, c);
+        }
+        return 1;
+    }
+
+    switch (c) {
+        case 0x7:                                   // BEL (xterm's terminator)
+            vt_end_string(vt, "\a");
+            return 1;
+        case '\e':
+            vt->string_esc = true;
+            return 1;
+        case 0x18:                                  // CAN and SUB abort the string
+        case 0x1a:
+            vt->string_type = STR_NONE;
+            return 1;
+    }
+
+    size_t n = 1;
+    while (n < sz && data[n] != 0x7 && data[n] != '\e' && data[n] != 0x18 && data[n] != 0x1a)
+        ++n;
+    vt_append_to_string(vt, data, n);
+    return n;
+}
+
+#pragma endregion
+
 //
 // BASIC OPERATION
 //
@@ -836,23 +2879,52 @@ static void vt_add_regular_char(VT* vt, CHAR c)
         .type = VT_EVENT_CELLS_UPDATED,
         .cells = { .row_start = vt->cursor.row, .row_end = vt->cursor.row, .column_start = vt->cursor.column, .column_end = vt->cursor.column }
     });
-    vt_cursor_advance(vt, 0, 1);
+    if (vt->lr_margin_mode && vt->cursor.column == vt->scroll_area_right && vt->scroll_area_right < vt->columns - 1)
+        vt->margin_wrap_pending = true;     // the cursor stays on the margin until the next character
+    else
+        vt_cursor_advance(vt, 0, 1);
 
     vt_reset_cursor_blink(vt);
 }
 
-static void vt_add_char(VT* vt, CHAR c)
+// A run of printable characters: what fits on the line is written at once, with a single update event.
+static void vt_add_text(VT* vt, const char* str, size_t n)
 {
-    if (vt->config.debug >= VT_DEBUG_ALL_BYTES) {
-        if (c >= 32 && c < 127)
-            printf("%c", c);
-        else if (c != '\e')
-            printf("\e[0;36m[%02X]\e[0m", c);
-        if (c == 10 || c == 13)
-            printf("\n");
-        fflush(stdout);
+    while (n > 0) {
+        if (vt->acs_mode || vt->insert_mode || vt->lr_margin_mode) {
+            vt_add_regular_char(vt, str[0]);
+            vt->last_char = str[0];
+            ++str; --n;
+            continue;
+        }
+
+        vt_scroll_based_on_cursor(vt);
+        INT row = MAX(MIN(vt->cursor.row, vt->rows - 1), 0);
+        INT column = vt->cursor.column;
+        size_t k = MIN(n, (size_t) (vt->columns - column));
+        if (vt->cursor.row > vt->scroll_area_bottom)    // below the scroll area, each character scrolls it again
+            k = 1;
+
+        VTCell* cells = &vt->matrix[row * vt->columns + column];
+        vt_release_links(vt, cells, k);
+        vt->row_hash_valid[row] = false;
+        for (size_t i = 0; i < k; ++i)
+            cells[i] = (VTCell) { .ch = str[i], .attrib = vt->current_attrib, .link = vt->current_link };
+        vt_retain_links(vt, cells, k);
+
+        vt_add_event(vt, &(VTEvent) {
+            .type = VT_EVENT_CELLS_UPDATED,
+            .cells = { .row_start = row, .row_end = row, .column_start = column, .column_end = column + k - 1 }
+        });
+        vt_cursor_advance(vt, 0, k);
+        vt_reset_cursor_blink(vt);
+        vt->last_char = str[k - 1];
+        str += k; n -= k;
     }
+}
 
+static void vt_add_char(VT* vt, CHAR c)
+{
     switch (c) {
         case '\r':  // CR
             vt_cursor_to_bol(vt);
@@ -868,7 +2940,7 @@ static void vt_add_char(VT* vt, CHAR c)
             vt_cursor_advance(vt, 0, -1);
             break;
         case '\t':
-            vt_cursor_tab(vt);
+            vt_cursor_tab(vt, 1);
             break;
         case 7: // BELL
             vt_beep(vt);
@@ -878,63 +2950,42 @@ static void vt_add_char(VT* vt, CHAR c)
             break;
         default:
             vt_add_regular_char(vt, c);
-    }
-
-    if (c != '\e')
-        vt->last_char = c;
-}
-
-static void vt_add_to_window_title(VT* vt, CHAR c)
-{
-    if (vt->config.debug >= VT_DEBUG_ALL_BYTES) {
-        if (c >= 32 && c < 127)
-            printf("\e[0;34m%c\e[0m", c);
-        else
-            printf("\e[0;34m[%02X]\e[0m", c);
-        fflush(stdout);
-    }
-
-    if (vt->last_text_received == NULL) {
-        vt->last_text_received = calloc(1, 2);
-        vt->last_text_received[0] = (char) c;
-    } else {
-        size_t len = strlen(vt->last_text_received);
-        vt->last_text_received = realloc(vt->last_text_received, len + 2);
-        vt->last_text_received[len] = (char) c;
-        vt->last_text_received[len + 1] = 0;
-    }
-
-    size_t len = strlen(vt->last_text_received);
-    bool end = false;
-    if (vt->last_text_received[len - 1] == 0x7) {
-        vt->last_text_received[len - 1] = '\0';
-        end = true;
-    } else if (len >= 2 && vt->last_text_received[len - 2] == '\e' && vt->last_text_received[len -1] == '\\') {
-        vt->last_text_received[len - 2] = '\0';
-        end = true;
-    }
-
-    if (end) {
-        vt_add_event(vt, &(VTEvent) { .type = VT_EVENT_TEXT_RECEIVED, .text_received = {
-            .type = vt->receiving_text, .text = strdup(vt->last_text_received) } });
-        vt->receiving_text = VTT_NOT_RECEIVING;
+            vt->last_char = c;
     }
 }
 
-void vt_write(VT* vt, const char* str, size_t str_sz)
+static void vt_parse(VT* vt, const char* str, size_t str_sz)
 {
-    // parse characters
     for (size_t i = 0; i < str_sz; ++i) {
         CHAR c = str[i];
-        if (vt->receiving_text != VTT_NOT_RECEIVING)
-            vt_add_to_window_title(vt, c);
-        else if (!vt->esc_buffer[0])   // not parsing escape sequence
+        if (vt->string_type != STR_NONE) {
+            size_t n = vt_add_string_bytes(vt, &str[i], str_sz - i);
+            TRACE_BYTES(vt, &str[i], n, VT_TRACE_STRING)
+            i += n - 1;
+        } else if (!vt->esc_buffer[0]) {   // not parsing escape sequence
+            size_t n = vt->kernels->text_run((const uint8_t *) &str[i], str_sz - i);
+            if (n > 0) {
+                TRACE_BYTES(vt, &str[i], n, VT_TRACE_TEXT)
+                vt_add_text(vt, &str[i], n);
+                i += n - 1;
+                continue;
+            }
+            TRACE_BYTES(vt, &str[i], 1, VT_TRACE_TEXT)
             vt_add_char(vt, c);
-        else
+        } else {
+            TRACE_BYTES(vt, &str[i], 1, VT_TRACE_ESCAPE)
             vt_add_escape_char(vt, c);
+        }
     }
 }
 
+void vt_write(VT* vt, const char* str, size_t str_sz)
+{
+    TRACE_START(vt)
+    vt_parse(vt, str, str_sz);
+    TRACE_END(vt)
+}
+
 #pragma endregion
 
 //
@@ -943,40 +2994,81 @@ void vt_write(VT* vt, const char* str, size_t str_sz)
 
 #pragma region Information
 
-VTCell vt_cell(VT* vt, INT row, INT column)
+static bool attrib_eq(VTAttrib a, VTAttrib b)
 {
-    if (row * vt->columns + column >= vt->rows * vt->columns && vt->config.debug >= VT_DEBUG_ERRORS_ONLY) {
-        fprintf(stderr, "vt_char: trying read data outside of screen bounds");
-        return (VTCell) { .ch = ' ', .attrib = DEFAULT_ATTR };
-    }
+    return a.bold == b.bold && a.dim == b.dim && a.underline == b.underline && a.blink == b.blink && a.reverse == b.reverse
+        && a.invisible == b.invisible && a.italic == b.italic && a.fg_color == b.fg_color && a.bg_color == b.bg_color;
+}
 
-    VTCell ch = vt->matrix[row * vt->columns + column];
+static bool vt_is_cursor(VT* vt, INT row, INT column)
+{
+    return vt->cursor.visible
+        && vt->cursor.row == row
+        && vt->config.automatic_cursor
+        && (vt->cursor.column == column || (column == vt->columns - 1 && vt->cursor.column == vt->columns))
+        && (!vt->config.blink_cursor || vt->cursor_blink_on);
+}
 
-    bool is_cursor = vt->cursor.visible
-                && vt->cursor.row == row
-                && vt->config.automatic_cursor
-                && (vt->cursor.column == column || (column == vt->columns - 1 && vt->cursor.column == vt->columns))
-                && (!vt->config.blink_cursor || vt->cursor_blink_on);
+// the attributes as they're displayed: cursor, bright bold, reverse and blinking applied
+static VTAttrib vt_resolve_attrib(VT* vt, VTAttrib attrib, bool is_cursor)
+{
     if (is_cursor) {
-        ch.attrib.bg_color = vt->cursor.blinking ? vt->config.blinking_cursor_color : vt->config.cursor_color;
-        ch.attrib.fg_color = vt->config.cursor_char_color;
+        attrib.bg_color = vt->cursor.blinking ? vt->config.blinking_cursor_color : vt->config.cursor_color;
+        attrib.fg_color = vt->config.cursor_char_color;
     }
 
-    if (ch.attrib.bold && vt->config.bold_is_bright && ch.attrib.fg_color < 8)
-        ch.attrib.fg_color += 8;
+    if (attrib.bold && vt->config.bold_is_bright && attrib.fg_color < 8)
+        attrib.fg_color += 8;
 
-    if (ch.attrib.reverse) {
-        VTColor swp = ch.attrib.fg_color;
-        ch.attrib.fg_color = ch.attrib.bg_color;
-        ch.attrib.bg_color = swp;
+    if (attrib.reverse) {
+        VTColor swp = attrib.fg_color;
+        attrib.fg_color = attrib.bg_color;
+        attrib.bg_color = swp;
     }
 
-    if (ch.attrib.blink && vt->blink_on)
-        ch.attrib.fg_color = ch.attrib.bg_color;
+    if (attrib.blink && vt->blink_on)
+        attrib.fg_color = attrib.bg_color;
 
+    return attrib;
+}
+
+VTCell vt_cell(VT* vt, INT row, INT column)
+{
+    if (row * vt->columns + column >= vt->rows * vt->columns && vt->config.debug >= VT_DEBUG_ERRORS_ONLY) {
+        fprintf(stderr, "vt_char: trying read data outside of screen bounds");
+        return (VTCell) { .ch = ' ', .attrib = DEFAULT_ATTR };
+    }
+
+    VTCell ch = vt->matrix[row * vt->columns + column];
+    ch.attrib = vt_resolve_attrib(vt, ch.attrib, vt_is_cursor(vt, row, column));
     return ch;
 }
 
+// Cells with the same stored attributes always resolve to the same ones, so runs are split where the stored
+// attributes change, and around the cursor.
+size_t vt_row_runs(VT* vt, INT row, VTRunWriter writer, void* data)
+{
+    if (row < 0 || row >= vt->rows)
+        return 0;
+
+    VTCell const* cells = &vt->matrix[row * vt->columns];
+    CHAR chars[vt->columns];
+    for (INT column = 0; column < vt->columns; ++column)
+        chars[column] = cells[column].ch;
+
+    size_t runs = 0;
+    INT start = 0;
+    for (INT column = 1; column <= vt->columns; ++column) {
+        bool is_cursor = vt_is_cursor(vt, row, start);
+        if (column < vt->columns && !is_cursor && !vt_is_cursor(vt, row, column) && attrib_eq(cells[column].attrib, cells[start].attrib))
+            continue;
+        writer(row, start, &chars[start], column - start, vt_resolve_attrib(vt, cells[start].attrib, is_cursor), data);
+        ++runs;
+        start = column;
+    }
+    return runs;
+}
+
 INT vt_rows(VT* vt)
 {
     return vt->rows;
@@ -987,6 +3079,53 @@ INT vt_columns(VT* vt)
     return vt->columns;
 }
 
+bool vt_bracketed_paste(VT* vt)
+{
+    return vt->bracketed_paste;
+}
+
+bool vt_alternate_screen(VT* vt)
+{
+    return vt->alternate_screen;
+}
+
+uint32_t vt_color_rgb(VT* vt, int index)
+{
+    if (index < 0 || index >= VT_COLOR_MAX)
+        return 0;
+    if (vt->colors[index] >= 0)
+        return vt->colors[index];
+
+    switch (index) {   // dynamic colors that were not set follow the configuration
+        case VT_COLOR_FOREGROUND: return vt->colors[vt->config.default_fg_color];
+        case VT_COLOR_BACKGROUND: return vt->colors[vt->config.default_bg_color];
+        default:                  return vt->colors[vt->config.cursor_color];
+    }
+}
+
+// FNV-1a over the character and attributes of each cell, with a final mix so that similar rows spread over the bits
+uint64_t vt_row_hash(VT* vt, INT row)
+{
+    if (row < 0 || row >= vt->rows)
+        return 0;
+
+    if (!vt->row_hash_valid[row]) {
+        uint64_t h = 0xcbf29ce484222325;
+        VTCell const* cells = &vt->matrix[row * vt->columns];
+        for (INT column = 0; column < vt->columns; ++column) {
+            uint16_t attrib;
+            memcpy(&attrib, &cells[column].attrib, sizeof attrib);
+            h = (h ^ ((uint32_t) cells[column].ch | (uint32_t) attrib << 8)) * 0x100000001b3;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccd;
+        h ^= h >> 33;
+        vt->row_hashes[row] = h;
+        vt->row_hash_valid[row] = true;
+    }
+    return vt->row_hashes[row];
+}
+
 VTCursor vt_cursor(VT* vt)
 {
     VTCursor cursor = vt->cursor;
@@ -1004,166 +3143,183 @@ VTCursor vt_cursor(VT* vt)
 #pragma region Key Translation
 
 typedef struct {
-    VTKeys      key;
-    const char* str;
-} InputKey;
-
-static const InputKey vt_strings[] = {
-    { VT_ARROW_UP,    "\e[A" },
-    { VT_ARROW_DOWN,  "\e[B" },
-    { VT_ARROW_RIGHT, "\e[C" },
-    { VT_ARROW_LEFT,  "\e[D" },
-    { VT_HOME,        "\e[H" },
-    { VT_END,         "\e[F" },
-    { VT_INSERT,      "\e[2~" },
-    { VT_BACKSPACE,   "\b" },
-    { VT_TAB,         "\t" },
-    { VT_PAGE_UP,     "\e[5~" },
-    { VT_PAGE_DOWN,   "\e[6~" },
-    { VT_F1,          "\eOP" },
-    { VT_F2,          "\eOQ" },
-    { VT_F3,          "\eOR" },
-    { VT_F4,          "\eOS" },
-    { VT_F5,          "\e[15~" },
-    { VT_F6,          "\e[17~" },
-    { VT_F7,          "\e[18~" },
-    { VT_F8,          "\e[19~" },
-    { VT_F9,          "\e[20~" },
-    { VT_F10,         "\e[21~" },
-    { VT_F11,         "\e[23~" },
-    { VT_F12,         "\e[24~" },
-    { VT_DELETE,      "\e[3~" },
-};
+    uint8_t len;
+    char    str[8];
+} KeySequence;
+
+// Sequences for every special key, modifier combination (shift=1, alt=2, ctrl=4, as in the xterm modifier parameter
+// minus one) and mode (cursor application mode, keypad application mode), built by the compiler.
+
+#define S(str)                  { sizeof(str) - 1, str }
+#define PICK_0(normal, app)     normal
+#define PICK_1(normal, app)     app
+#define PICK(mode, normal, app) PICK_##mode(normal, app)
+#define K(key)                  ((key) - VT_ESC)
+
+// keys that send ESC [ 1 ; <modifiers> <letter> when modified
+#define CSI_LETTER(plain, letter) { \
+    S(plain), S("\e[1;2" letter), S("\e[1;3" letter), S("\e[1;4" letter), \
+    S("\e[1;5" letter), S("\e[1;6" letter), S("\e[1;7" letter), S("\e[1;8" letter) }
+
+// keys that send ESC [ <number> ; <modifiers> ~ when modified
+#define CSI_TILDE(number) { \
+    S("\e[" number "~"), S("\e[" number ";2~"), S("\e[" number ";3~"), S("\e[" number ";4~"), \
+    S("\e[" number ";5~"), S("\e[" number ";6~"), S("\e[" number ";7~"), S("\e[" number ";8~") }
+
+// keys that send a fixed sequence, prefixed by ESC when alt is pressed
+#define ALT_PREFIXED(plain, shift, ctrl, ctrl_shift) { \
+    S(plain), S(shift), S("\e" plain), S("\e" shift), S(ctrl), S(ctrl_shift), S("\e" ctrl), S("\e" ctrl_shift) }
+
+#define KEYPAD_0(plain, app) ALT_PREFIXED(plain, plain, plain, plain)
+#define KEYPAD_1(plain, app) { \
+    S("\eO" app), S("\eO2" app), S("\eO3" app), S("\eO4" app), S("\eO5" app), S("\eO6" app), S("\eO7" app), S("\eO8" app) }
+#define KEYPAD(mode, plain, app) KEYPAD_##mode(plain, app)
+
+#define KEY_TABLE(c, k) {                                                           \
+    [K(VT_ESC)]         = ALT_PREFIXED("\e", "\e", "\e", "\e"),                     \
+    [K(VT_F1)]          = CSI_LETTER("\eOP", "P"),                                  \
+    [K(VT_F2)]          = CSI_LETTER("\eOQ", "Q"),                                  \
+    [K(VT_F3)]          = CSI_LETTER("\eOR", "R"),                                  \
+    [K(VT_F4)]          = CSI_LETTER("\eOS", "S"),                                  \
+    [K(VT_F5)]          = CSI_TILDE("15"),                                          \
+    [K(VT_F6)]          = CSI_TILDE("17"),                                          \
+    [K(VT_F7)]          = CSI_TILDE("18"),                                          \
+    [K(VT_F8)]          = CSI_TILDE("19"),                                          \
+    [K(VT_F9)]          = CSI_TILDE("20"),                                          \
+    [K(VT_F10)]         = CSI_TILDE("21"),                                          \
+    [K(VT_F11)]         = CSI_TILDE("23"),                                          \
+    [K(VT_F12)]         = CSI_TILDE("24"),                                          \
+    [K(VT_INSERT)]      = CSI_TILDE("2"),                                           \
+    [K(VT_DELETE)]      = CSI_TILDE("3"),                                           \
+    [K(VT_HOME)]        = CSI_LETTER(PICK(c, "\e[H", "\eOH"), "H"),                 \
+    [K(VT_END)]         = CSI_LETTER(PICK(c, "\e[F", "\eOF"), "F"),                 \
+    [K(VT_PAGE_UP)]     = CSI_TILDE("5"),                                           \
+    [K(VT_PAGE_DOWN)]   = CSI_TILDE("6"),                                           \
+    [K(VT_ARROW_UP)]    = CSI_LETTER(PICK(c, "\e[A", "\eOA"), "A"),                 \
+    [K(VT_ARROW_DOWN)]  = CSI_LETTER(PICK(c, "\e[B", "\eOB"), "B"),                 \
+    [K(VT_ARROW_LEFT)]  = CSI_LETTER(PICK(c, "\e[D", "\eOD"), "D"),                 \
+    [K(VT_ARROW_RIGHT)] = CSI_LETTER(PICK(c, "\e[C", "\eOC"), "C"),                 \
+    [K(VT_BACKSPACE)]   = ALT_PREFIXED("\b", "\x7f", "\b", "\b"),                   \
+    [K(VT_TAB)]         = ALT_PREFIXED("\t", "\e[Z", "\t", "\t"),                   \
+    [K(VT_KP_0)]        = KEYPAD(k, "0", "p"),                                      \
+    [K(VT_KP_1)]        = KEYPAD(k, "1", "q"),                                      \
+    [K(VT_KP_2)]        = KEYPAD(k, "2", "r"),                                      \
+    [K(VT_KP_3)]        = KEYPAD(k, "3", "s"),                                      \
+    [K(VT_KP_4)]        = KEYPAD(k, "4", "t"),                                      \
+    [K(VT_KP_5)]        = KEYPAD(k, "5", "u"),                                      \
+    [K(VT_KP_6)]        = KEYPAD(k, "6", "v"),                                      \
+    [K(VT_KP_7)]        = KEYPAD(k, "7", "w"),                                      \
+    [K(VT_KP_8)]        = KEYPAD(k, "8", "x"),                                      \
+    [K(VT_KP_9)]        = KEYPAD(k, "9", "y"),                                      \
+    [K(VT_KP_DECIMAL)]  = KEYPAD(k, ".", "n"),                                      \
+    [K(VT_KP_DIVIDE)]   = KEYPAD(k, "/", "o"),                                      \
+    [K(VT_KP_MULTIPLY)] = KEYPAD(k, "*", "j"),                                      \
+    [K(VT_KP_MINUS)]    = KEYPAD(k, "-", "m"),                                      \
+    [K(VT_KP_PLUS)]     = KEYPAD(k, "+", "k"),                                      \
+    [K(VT_KP_ENTER)]    = KEYPAD(k, "\r", "M"),                                     \
+}
 
-static const InputKey vt_strings_ctrl[] = {
-    { VT_ARROW_UP,    "\e[1;5A" },
-    { VT_ARROW_DOWN,  "\e[1;5B" },
-    { VT_ARROW_RIGHT, "\e[1;5C" },
-    { VT_ARROW_LEFT,  "\e[1;5D" },
-    { VT_HOME,        "\e[1;5H" },
-    { VT_END,         "\e[1;5F" },
-    { VT_INSERT,      "\e[2;5~" },
-    { VT_BACKSPACE,   "\b" },
-    { VT_TAB,         "\t" },
-    { VT_PAGE_UP,     "\e[5;5~" },
-    { VT_PAGE_DOWN,   "\e[6;5~" },
-    { VT_F1,          "\e[1;5P" },
-    { VT_F2,          "\e[1;5Q" },
-    { VT_F3,          "\e[1;5R" },
-    { VT_F4,          "\e[1;5S" },
-    { VT_F5,          "\e[15;5~" },
-    { VT_F6,          "\e[17;5~" },
-    { VT_F7,          "\e[18;5~" },
-    { VT_F8,          "\e[19;5~" },
-    { VT_F9,          "\e[20;5~" },
-    { VT_F10,         "\e[21;5~" },
-    { VT_F11,         "\e[23;5~" },
-    { VT_F12,         "\e[24;5~" },
-    { VT_DELETE,      "\e[3;5~" },
+static const KeySequence key_table[2][2][K(VT_KEY_MAX)][8] = {   // [cursor app mode][keypad app mode][key][modifiers]
+    { KEY_TABLE(0, 0), KEY_TABLE(0, 1) },
+    { KEY_TABLE(1, 0), KEY_TABLE(1, 1) },
 };
 
-static const InputKey vt_strings_shift[] = {
-    { VT_ARROW_UP,    "\e[1;2A" },
-    { VT_ARROW_DOWN,  "\e[1;2B" },
-    { VT_ARROW_RIGHT, "\e[1;2C" },
-    { VT_ARROW_LEFT,  "\e[1;2D" },
-    { VT_HOME,        "\e[1;2H" },
-    { VT_END,         "\e[1;2F" },
-    { VT_INSERT,      "\e[2;5~" },  // TODO
-    { VT_BACKSPACE,   "\x7f" },
-    { VT_TAB,         "\e[Z" },
-    { VT_PAGE_UP,     "\e[5~" },
-    { VT_PAGE_DOWN,   "\e[6~" },
-    { VT_F1,          "\e[1;2P" },
-    { VT_F2,          "\e[1;2Q" },
-    { VT_F3,          "\e[1;2R" },
-    { VT_F4,          "\e[1;2S" },
-    { VT_F5,          "\e[15;2~" },
-    { VT_F6,          "\e[17;2~" },
-    { VT_F7,          "\e[18;2~" },
-    { VT_F8,          "\e[19;2~" },
-    { VT_F9,          "\e[20;2~" },
-    { VT_F10,         "\e[21;2~" },
-    { VT_F11,         "\e[23;2~" },
-    { VT_F12,         "\e[24;2~" },
-    { VT_DELETE,      "\e[3;2~" },
-};
+#undef KEY_TABLE
+#undef KEYPAD
+#undef KEYPAD_1
+#undef KEYPAD_0
+#undef ALT_PREFIXED
+#undef CSI_TILDE
+#undef CSI_LETTER
+#undef PICK
+#undef PICK_1
+#undef PICK_0
+#undef S
+
+static int copy_key_sequence(const char* str, size_t len, char* output, size_t max_sz)
+{
+    len = MIN(len, max_sz);
+    memcpy(output, str, len);
+    if (len < max_sz)
+        output[len] = '\0';
+    return (int) len;
+}
 
+// kitty keyboard protocol: keys that would be ambiguous are sent as ESC [ <code> ; <modifiers> u
+static int vt_translate_kitty_key(VT* vt, uint16_t key, int modifiers, char* output, size_t max_sz)
+{
+    uint8_t flags = vt->kitty_flags_sz ? vt->kitty_flags[vt->kitty_flags_sz - 1] : 0;
+
+    int code = -1;
+    switch (key) {
+        case VT_ESC:
+        case '\e':         code = 27; break;
+        case '\r':         code = 13; break;
+        case VT_TAB:       code = 9; break;
+        case VT_BACKSPACE: code = 127; break;
+        default:
+            if (key < 0x100)
+                code = tolower(key);
+    }
 
-static const InputKey vt_strings_ctrl_shift[] = {
-    { VT_ARROW_UP,    "\e[1;6A" },
-    { VT_ARROW_DOWN,  "\e[1;6B" },
-    { VT_ARROW_RIGHT, "\e[1;6C" },
-    { VT_ARROW_LEFT,  "\e[1;6D" },
-    { VT_HOME,        "\e[1;6H" },
-    { VT_END,         "\e[1;6F" },
-    { VT_INSERT,      "\e[2;6~" },
-    { VT_BACKSPACE,   "\b" },
-    { VT_TAB,         "\t" },
-    { VT_PAGE_UP,     "\e[5;6~" },
-    { VT_PAGE_DOWN,   "\e[6;6~" },
-    { VT_F1,          "\e[1;6P" },
-    { VT_F2,          "\e[1;6Q" },
-    { VT_F3,          "\e[1;6R" },
-    { VT_F4,          "\e[1;6S" },
-    { VT_F5,          "\e[15;6~" },
-    { VT_F6,          "\e[17;6~" },
-    { VT_F7,          "\e[18;6~" },
-    { VT_F8,          "\e[19;6~" },
-    { VT_F9,          "\e[20;6~" },
-    { VT_F10,         "\e[21;6~" },
-    { VT_F11,         "\e[23;6~" },
-    { VT_F12,         "\e[24;6~" },
-    { VT_DELETE,      "\e[3;6~" },
-};
+    bool report_all = flags & VT_KITTY_REPORT_ALL_KEYS;
+    if (code < 0 || !(flags & (VT_KITTY_DISAMBIGUATE | VT_KITTY_REPORT_ALL_KEYS)))
+        return -1;
+    if (!report_all && code != 27 && (modifiers & ~VTK_SHIFT) == 0) {
+        if (key == '\r' && modifiers == 0)
+            return copy_key_sequence("\r", 1, output, max_sz);
+        return -1;   // text is sent as text
+    }
 
+    char buf[16];
+    int n = modifiers ? snprintf(buf, sizeof buf, "\e[%d;%du", code, modifiers + 1) : snprintf(buf, sizeof buf, "\e[%du", code);
+    return copy_key_sequence(buf, n, output, max_sz);
+}
 
-int vt_translate_key(VT* vt, uint16_t key, bool shift, bool ctrl, char* output, size_t max_sz)
+int vt_translate_key_mod(VT* vt, uint16_t key, int modifiers, char* output, size_t max_sz)
 {
-    (void) vt;
-
-    memset(output, 0, max_sz);
+    modifiers &= (VTK_SHIFT | VTK_ALT | VTK_CTRL);
 
-    if (key == '\r') {
-        output[0] = '\n';
-        return 1;
+    if (vt->kitty_flags_sz > 0) {
+        int n = vt_translate_kitty_key(vt, key, modifiers, output, max_sz);
+        if (n >= 0)
+            return n;
     }
 
-    if (vt->cursor_app_mode) {
-        switch (key) {
-            case VT_ARROW_UP:    return sprintf(output, "\eOA");
-            case VT_ARROW_DOWN:  return sprintf(output, "\eOB");
-            case VT_ARROW_RIGHT: return sprintf(output, "\eOC");
-            case VT_ARROW_LEFT:  return sprintf(output, "\eOD");
-        }
+    if (key >= VT_ESC && key < VT_KEY_MAX) {
+        KeySequence const* seq = &key_table[vt->cursor_app_mode][vt->keypad_app_mode][K(key)][modifiers];
+        return copy_key_sequence(seq->str, seq->len, output, max_sz);
     }
 
-#define CHECK_KBD(SHIFT, CTRL, ARRAY) \
-    if (SHIFT && CTRL) \
-        for (size_t i = 0; i < (sizeof ARRAY) / (sizeof ARRAY[0]); ++i) \
-            if (key == ARRAY[i].key) \
-                return snprintf(output, max_sz, "%s", ARRAY[i].str);
-
-    CHECK_KBD(!shift, !ctrl, vt_strings)
-    CHECK_KBD(shift,  !ctrl, vt_strings_shift)
-    CHECK_KBD(!shift, ctrl,  vt_strings_ctrl)
-    CHECK_KBD(shift,  ctrl,  vt_strings_ctrl_shift)
-#undef CHECK_KBD
-
-    if (key != 0) {
-        if (ctrl) {
-            if (key >= 'A' && key <= '_')
-                output[0] = key - 'A' + 1;
-            else if (key >= 'a' && key <= 'z')
-                output[0] = key - 'a' + 1;
-        } else {
-            output[0] = (char) key;
-        }
+    if (key == 0 || key >= 0x100)
+        return 0;
+
+    char buf[2];
+    size_t n = 0;
+    if (modifiers & VTK_ALT)
+        buf[n++] = '\e';
+    if (key == '\r') {
+        buf[n++] = '\n';
+    } else if (modifiers & VTK_CTRL) {
+        if (key >= 'A' && key <= '_')
+            buf[n++] = key - 'A' + 1;
+        else if (key >= 'a' && key <= 'z')
+            buf[n++] = key - 'a' + 1;
+        else
+            return 0;
+    } else {
+        buf[n++] = (char) key;
     }
+    return copy_key_sequence(buf, n, output, max_sz);
+}
 
-    return 1;
+int vt_translate_key(VT* vt, uint16_t key, bool shift, bool ctrl, char* output, size_t max_sz)
+{
+    return vt_translate_key_mod(vt, key, (shift ? VTK_SHIFT : 0) | (ctrl ? VTK_CTRL : 0), output, max_sz);
 }
 
+#undef K
+
 #pragma endregion
 
 //
@@ -1172,70 +3328,611 @@ int vt_translate_key(VT* vt, uint16_t key, bool shift, bool ctrl, char* output,
 
 #pragma region Mouse Translation
 
+static const INT BUTTONS[] = { 0, 1, 2, 64, 65 };
+#define NO_BUTTON 3
+
+static int put_utf8(char* buf, unsigned v)
+{
+    if (v < 0x80) {
+        buf[0] = v;
+        return 1;
+    }
+    buf[0] = 0xc0 | (v >> 6);
+    buf[1] = 0x80 | (v & 0x3f);
+    return 2;
+}
+
+// Writes a single report in the encoding chosen by the application. Returns 0 if the position can't be encoded, or
+// if the report doesn't fit in the output.
+static int vt_mouse_report(VT* vt, VTMouseState const* state, INT button, bool motion, bool release, char* output, size_t max_sz)
+{
+    INT mod = vt->mouse_tracking == VTM_X10 ? 0 : state->mod;
+    INT cb = button + mod + (motion ? 32 : 0);
+    INT legacy_cb = release ? NO_BUTTON + mod : cb;   // the older encodings don't say which button was released
+
+    char buf[32];
+    int n = 0;
+    switch (vt->mouse_encoding) {
+        case VTME_SGR:
+            n = snprintf(buf, sizeof buf, "\e[<%d;%d;%d%c", cb, state->column + 1, state->row + 1, release ? 'm' : 'M');
+            break;
+        case VTME_SGR_PIXELS:
+            n = snprintf(buf, sizeof buf, "\e[<%d;%d;%d%c", cb, state->x + 1, state->y + 1, release ? 'm' : 'M');
+            break;
+        case VTME_URXVT:
+            n = snprintf(buf, sizeof buf, "\e[%d;%d;%dM", legacy_cb + 32, state->column + 1, state->row + 1);
+            break;
+        case VTME_UTF8:
+            if (state->column + 33 > 0x7ff || state->row + 33 > 0x7ff)
+                return 0;
+            n = snprintf(buf, sizeof buf, "\e[M");
+            n += put_utf8(&buf[n], legacy_cb + 32);
+            n += put_utf8(&buf[n], state->column + 33);
+            n += put_utf8(&buf[n], state->row + 33);
+            break;
+        case VTME_X10:
+            if (state->column + 33 > 0xff || state->row + 33 > 0xff)
+                return 0;
+            n = snprintf(buf, sizeof buf, "\e[M%c%c%c", legacy_cb + 32, state->column + 33, state->row + 33);
+            break;
+    }
+
+    if (n <= 0 || (size_t) n > max_sz)
+        return 0;
+    memcpy(output, buf, n);
+    return n;
+}
+
 int vt_translate_updated_mouse_state(VT* vt, VTMouseState state, char* output, size_t max_sz)
 {
     if (state.row < 0 || state.row > vt->rows || state.column < 0 || state.column > vt->columns)
         return 0;
 
-    static INT BUTTONS[] = { 0, 1, 2, 64, 65 };
+    VTMouseState last = vt->last_mouse_state;
+    vt->last_mouse_state = state;
+    if (vt->mouse_tracking == VTM_NO)
+        return 0;
 
-    bool buttons_changed = (memcmp(vt->last_mouse_state.button, state.button, sizeof state.button) != 0)
-                        || vt->last_mouse_state.mod != state.mod;
-    bool some_button_is_pressed = memcmp(state.button, (bool[]) {0,0,0,0,0}, 5) != 0;
-    bool location_changed = (vt->last_mouse_state.row != state.row) || (vt->last_mouse_state.column != state.column);
+    // buttons pressed or released - the wheel is reported every time it's set, and never released
+    for (VTMouseButton b = VTM_LEFT; b < VTM_MAX; ++b) {
+        bool wheel = (b == VTM_SCROLL_UP || b == VTM_SCROLL_DOWN);
+        if (state.button[b] && (wheel || !last.button[b]))
+            return vt_mouse_report(vt, &state, BUTTONS[b], false, false, output, max_sz);
+        if (!state.button[b] && last.button[b] && !wheel)
+            return vt->mouse_tracking >= VTM_CLICKS ? vt_mouse_report(vt, &state, BUTTONS[b], false, true, output, max_sz) : 0;
+    }
 
-    if (state.button[VTM_SCROLL_DOWN] || state.button[VTM_SCROLL_UP]) {
-        buttons_changed = true;
+    // motion, only reported when the cell (or the pixel, in SGR pixel mode) changes
+    bool moved = (vt->mouse_encoding == VTME_SGR_PIXELS) ? (state.x != last.x || state.y != last.y)
+                                                         : (state.row != last.row || state.column != last.column);
+    INT pressed = NO_BUTTON;
+    for (VTMouseButton b = VTM_LEFT; b <= VTM_RIGHT; ++b) {
+        if (state.button[b]) {
+            pressed = BUTTONS[b];
+            break;
+        }
     }
+    if (moved && (vt->mouse_tracking == VTM_ALL || (vt->mouse_tracking == VTM_DRAG && pressed != NO_BUTTON)))
+        return vt_mouse_report(vt, &state, pressed, true, false, output, max_sz);
+
+    return 0;
+}
 
-    bool report = (vt->mouse_tracking >= VTM_CLICKS && buttons_changed)
-               || (vt->mouse_tracking >= VTM_DRAG && location_changed && some_button_is_pressed)
-               || (vt->mouse_tracking == VTM_ALL && (buttons_changed || location_changed));
-    if (!report) {
-        vt->last_mouse_state = state;
+// Trackpads and high-resolution wheels move by fractions of a line: these are added up, and a wheel report is sent
+// for every whole line, all of them in the same output. What doesn't fit in the output is kept for the next call.
+int vt_translate_mouse_wheel(VT* vt, VTMouseState state, double lines, char* output, size_t max_sz)
+{
+    if (vt->mouse_tracking == VTM_NO || state.row < 0 || state.row > vt->rows || state.column < 0 || state.column > vt->columns) {
+        vt->wheel_remainder = 0;
         return 0;
     }
 
-    INT button = 0;
-    bool release = false;
-    for (VTMouseButton b = VTM_LEFT; b < VTM_MAX; ++b) {
-        if (state.button[b] && !vt->last_mouse_state.button[b]) {
-            button = BUTTONS[b];
-            break;
-        } else if (!state.button[b] && vt->last_mouse_state.button[b]) {
-            button = BUTTONS[b];
-            release = true;
+    if (lines == 0)
+        return 0;
+    if ((lines > 0) != (vt->wheel_remainder > 0))   // changed direction
+        vt->wheel_remainder = 0;
+    vt->wheel_remainder += lines;
+
+    size_t n = 0;
+    while (vt->wheel_remainder >= 1.0 || vt->wheel_remainder <= -1.0) {
+        bool up = vt->wheel_remainder > 0;
+        int len = vt_mouse_report(vt, &state, BUTTONS[up ? VTM_SCROLL_UP : VTM_SCROLL_DOWN], false, false, &output[n], max_sz - n);
+        if (len == 0) {
+            if (n == 0)                              // can't be reported at all
+                vt->wheel_remainder = 0;
             break;
         }
+        n += len;
+        vt->wheel_remainder -= up ? 1.0 : -1.0;
     }
+    return n;
+}
 
-    if ((!state.button[VTM_SCROLL_UP] && vt->last_mouse_state.button[VTM_SCROLL_UP]) || (!state.button[VTM_SCROLL_DOWN] && vt->last_mouse_state.button[VTM_SCROLL_DOWN])) {
-        vt->last_mouse_state = state;
+int vt_translate_focus(VT* vt, bool focused, char* output, size_t max_sz)
+{
+    if (!vt->focus_reporting || max_sz < 3)
         return 0;
+    memcpy(output, focused ? "\e[I" : "\e[O", 3);
+    return 3;
+}
+
+#undef NO_BUTTON
+
+#pragma endregion
+
+//
+// SELECTION
+//
+
+#pragma region Selection
+
+#define ROW_MAX INT16_MAX
+
+// get a row from the screen (pointing directly to the matrix) or from the scrollback (copied to vt->scrollback_row,
+// valid until the next call; rows wider than the widest the VT has had are cut)
+static INT vt_any_row(VT* vt, long row, VTCell const** cells, bool* wrapped)
+{
+    *wrapped = false;
+    if (row >= 0) {
+        if (row >= vt->rows)
+            return 0;
+        *cells = &vt->matrix[row * vt->columns];
+        *wrapped = vt->wrapped[row];
+        return vt->columns;
     }
 
-    vt->last_mouse_state = state;
+    INT columns = MAX(vt->columns, vt->scrollback_columns);
+    if (vt->scrollback_row_columns < columns) {
+        vt_dealloc(vt, vt->scrollback_row);
+        vt->scrollback_row = vt_alloc(vt, columns * sizeof(VTCell));
+        vt->scrollback_row_columns = vt->scrollback_row ? columns : 0;
+        if (!vt->scrollback_row)
+            return 0;
+    }
+    *cells = vt->scrollback_row;
+    return vt_scrollback_row(vt, -row - 1, vt->scrollback_row, columns, wrapped);
+}
 
-    if (vt->sgr_mouse_mode) {
-        INT m = button + state.mod + (!buttons_changed ? 32 : 0);
-        return snprintf(output, max_sz, "\e<%d;%d;%d%c", m, state.column + 1, state.row + 1, release ? 'm' : 'M');
-    } else if (state.row < 223 && state.column < 223) {
-        button = 3;
-        for (VTMouseButton b = VTM_LEFT; b < VTM_MAX; ++b) {
-            if (state.button[b]) {
-                button = BUTTONS[b];
-                break;
+static bool is_word_char(CHAR c)
+{
+    return c > ' ' && !strchr("\"'`()[]{}<>|,;", c);
+}
+
+static void vt_selection_update(VT* vt)
+{
+    long r0 = vt->selection_anchor_row, r1 = vt->selection_head_row;
+    INT c0 = vt->selection_anchor_column, c1 = vt->selection_head_column;
+
+    if (vt->selection_mode == VT_SELECT_RECTANGLE) {
+        vt->selection_start_row = MIN(r0, r1);
+        vt->selection_end_row = MAX(r0, r1);
+        vt->selection_start_column = MIN(c0, c1);
+        vt->selection_end_column = MAX(c0, c1);
+        return;
+    }
+
+    if (r1 < r0 || (r1 == r0 && c1 < c0)) {
+        long r = r0; r0 = r1; r1 = r;
+        INT c = c0; c0 = c1; c1 = c;
+    }
+
+    if (vt->selection_mode == VT_SELECT_LINE) {
+        c0 = 0;
+        c1 = ROW_MAX - 1;
+    } else if (vt->selection_mode == VT_SELECT_WORD) {
+        VTCell const* cells;
+        bool wrapped;
+        INT n = vt_any_row(vt, r0, &cells, &wrapped);
+        if (c0 < n && is_word_char(cells[c0].ch))
+            while (c0 > 0 && is_word_char(cells[c0 - 1].ch))
+                --c0;
+        n = vt_any_row(vt, r1, &cells, &wrapped);
+        if (c1 < n && is_word_char(cells[c1].ch))
+            while (c1 < n - 1 && is_word_char(cells[c1 + 1].ch))
+                ++c1;
+    }
+
+    vt->selection_start_row = r0;
+    vt->selection_start_column = c0;
+    vt->selection_end_row = r1;
+    vt->selection_end_column = c1;
+}
+
+// columns past the edges (a drag out of the window) select up to the edge; scrollback rows can be wider than the screen
+static INT vt_selection_column(VT* vt, INT column)
+{
+    return MAX(0, MIN(column, MAX(vt->columns, vt->scrollback_columns) - 1));
+}
+
+void vt_selection_start(VT* vt, VTSelectionMode mode, long row, INT column)
+{
+    column = vt_selection_column(vt, column);
+    vt->selection_active = true;
+    vt->selection_mode = mode;
+    vt->selection_anchor_row = vt->selection_head_row = row;
+    vt->selection_anchor_column = vt->selection_head_column = column;
+    vt_selection_update(vt);
+}
+
+void vt_selection_extend(VT* vt, long row, INT column)
+{
+    if (!vt->selection_active)
+        return;
+    vt->selection_head_row = row;
+    vt->selection_head_column = vt_selection_column(vt, column);
+    vt_selection_update(vt);
+}
+
+void vt_selection_clear(VT* vt)
+{
+    vt->selection_active = false;
+}
+
+// a line went into the scrollback, so the selected text is now one row up
+static void vt_selection_scrolled(VT* vt)
+{
+    if (!vt->selection_active)
+        return;
+    --vt->selection_anchor_row;
+    --vt->selection_head_row;
+    --vt->selection_start_row;
+    --vt->selection_end_row;
+}
+
+bool vt_selected(VT* vt, long row, INT column)
+{
+    if (!vt->selection_active || row < vt->selection_start_row || row > vt->selection_end_row)
+        return false;
+    if (vt->selection_mode == VT_SELECT_RECTANGLE)
+        return column >= vt->selection_start_column && column <= vt->selection_end_column;
+    return (row > vt->selection_start_row || column >= vt->selection_start_column)
+        && (row < vt->selection_end_row || column <= vt->selection_end_column);
+}
+
+typedef struct TextOutput {
+    char         buffer[4096];
+    size_t       sz;
+    size_t       total;
+    VTTextWriter writer;
+    void*        data;
+} TextOutput;
+
+static void output_flush(TextOutput* out)
+{
+    if (out->sz > 0)
+        out->writer(out->buffer, out->sz, out->data);
+    out->total += out->sz;
+    out->sz = 0;
+}
+
+static void output_text(TextOutput* out, const char* text, size_t sz)
+{
+    if (out->sz + sz > sizeof out->buffer)
+        output_flush(out);
+    memcpy(&out->buffer[out->sz], text, sz);
+    out->sz += sz;
+}
+
+static void output_char(TextOutput* out, CHAR c)
+{
+    if (out->sz + 2 > sizeof out->buffer)
+        output_flush(out);
+    if (c == 0) {
+        out->buffer[out->sz++] = ' ';
+    } else if (c < 0x80) {
+        out->buffer[out->sz++] = (char) c;
+    } else {    // characters are ISO-8859-1
+        out->buffer[out->sz++] = (char) (0xc0 | (c >> 6));
+        out->buffer[out->sz++] = (char) (0x80 | (c & 0x3f));
+    }
+}
+
+static void output_sgr(TextOutput* out, VTAttrib a)
+{
+    char buf[48] = "\e[0";
+    size_t n = 3;
+    if (a.bold) n += sprintf(&buf[n], ";1");
+    if (a.dim) n += sprintf(&buf[n], ";2");
+    if (a.italic) n += sprintf(&buf[n], ";3");
+    if (a.underline) n += sprintf(&buf[n], ";4");
+    if (a.blink) n += sprintf(&buf[n], ";5");
+    if (a.reverse) n += sprintf(&buf[n], ";7");
+    if (a.invisible) n += sprintf(&buf[n], ";8");
+    n += sprintf(&buf[n], ";%d", a.fg_color < 8 ? 30 + a.fg_color : 90 + a.fg_color - 8);
+    n += sprintf(&buf[n], ";%dm", a.bg_color < 8 ? 40 + a.bg_color : 100 + a.bg_color - 8);
+    output_text(out, buf, n);
+}
+
+size_t vt_selection_text(VT* vt, VTTextFormat format, VTTextWriter writer, void* data)
+{
+    if (!vt->selection_active)
+        return 0;
+
+    TextOutput out = { .sz = 0, .total = 0, .writer = writer, .data = data };
+    bool rectangle = vt->selection_mode == VT_SELECT_RECTANGLE;
+    bool attrib_set = false;
+    VTAttrib attrib = DEFAULT_ATTR;
+
+    for (long row = vt->selection_start_row; row <= vt->selection_end_row; ++row) {
+        VTCell const* cells = NULL;
+        bool wrapped = false;
+        INT n = vt_any_row(vt, row, &cells, &wrapped);
+
+        INT from = (rectangle || row == vt->selection_start_row) ? vt->selection_start_column : 0;
+        INT to = (rectangle || row == vt->selection_end_row) ? MIN(vt->selection_end_column, n - 1) : n - 1;
+        bool joined = !rectangle && wrapped && row != vt->selection_end_row && to == n - 1;
+
+        INT last = to;
+        if (!joined)   // trim trailing blanks
+            while (last >= from && (cells[last].ch == ' ' || cells[last].ch == 0))
+                --last;
+
+        for (INT column = MAX(from, 0); column <= last; ++column) {
+            if (format == VT_TEXT_SGR && (!attrib_set || !attrib_eq(attrib, cells[column].attrib))) {
+                attrib = cells[column].attrib;
+                attrib_set = true;
+                output_sgr(&out, attrib);
             }
+            output_char(&out, cells[column].ch);
         }
-        INT m = button + state.mod + (!buttons_changed ? 32 : 0);
-        return snprintf(output, max_sz, "\e[M%c%c%c", m + 32, state.column + 33, state.row + 33);
+
+        if (row != vt->selection_end_row && !joined)
+            output_text(&out, "\n", 1);
     }
 
-    // TODO - if scroll, send release too
+    if (attrib_set)
+        output_text(&out, "\e[0m", 4);
+    output_flush(&out);
 
-    return 0;
+    return out.total;
 }
 
 #pragma endregion
 
+//
+// HYPERLINKS
+//
+
+#pragma region Hyperlinks
+
+#define MAX_LINKS 65536   // link ids are uint16_t, and 0 means "no link"
+
+static uint32_t hyperlink_hash(const char* id, const char* uri)
+{
+    uint32_t h = 2166136261u;   // FNV-1a
+    for (const char* p = id ? id : ""; *p; ++p)
+        h = (h ^ (uint8_t) *p) * 16777619u;
+    h = (h ^ 0xff) * 16777619u;
+    for (const char* p = uri; *p; ++p)
+        h = (h ^ (uint8_t) *p) * 16777619u;
+    return h;
+}
+
+static char* vt_strdup(VT* vt, const char* str)
+{
+    size_t sz = strlen(str) + 1;
+    char* copy = vt_alloc(vt, sz);
+    if (copy)
+        memcpy(copy, str, sz);
+    return copy;
+}
+
+static bool vt_grow_hyperlinks(VT* vt)
+{
+    size_t capacity = vt->links_capacity ? vt->links_capacity * 2 : 16;
+    if (capacity > MAX_LINKS)
+        return false;
+
+    Hyperlink* links = vt_calloc(vt, capacity, sizeof(Hyperlink));
+    uint16_t* buckets = vt_calloc(vt, capacity, sizeof(uint16_t));
+    if (!links || !buckets) {
+        vt_dealloc(vt, links);
+        vt_dealloc(vt, buckets);
+        return false;
+    }
+
+    if (vt->links)
+        memcpy(links, vt->links, vt->links_capacity * sizeof(Hyperlink));
+    for (size_t i = 1; i < vt->links_used; ++i) {   // rehash live entries
+        if (links[i].uri) {
+            size_t bucket = links[i].hash & (capacity - 1);
+            links[i].next = buckets[bucket];
+            buckets[bucket] = i;
+        }
+    }
+
+    vt_dealloc(vt, vt->links);
+    vt_dealloc(vt, vt->links_buckets);
+    vt->links = links;
+    vt->links_buckets = buckets;
+    vt->links_capacity = capacity;
+    if (vt->links_used == 0)
+        vt->links_used = 1;   // entry 0 is "no link"
+    return true;
+}
+
+// returns a new reference to the link, or 0 if it can't be stored
+static uint16_t vt_intern_hyperlink(VT* vt, const char* id, const char* uri)
+{
+    uint32_t hash = hyperlink_hash(id, uri);
+
+    if (vt->links_capacity) {
+        for (uint16_t i = vt->links_buckets[hash & (vt->links_capacity - 1)]; i; i = vt->links[i].next) {
+            Hyperlink* link = &vt->links[i];
+            if (link->hash == hash && strcmp(link->uri, uri) == 0
+                    && ((!id && !link->id) || (id && link->id && strcmp(link->id, id) == 0))) {
+                ++link->refs;
+                return i;
+            }
+        }
+    }
+
+    if (!vt->links_free && vt->links_used == vt->links_capacity && !vt_grow_hyperlinks(vt)) {
+        if (vt->config.debug >= VT_DEBUG_ERRORS_ONLY)
+            fprintf(stderr, "Hyperlink table is full, link dropped: %s\n", uri);
+        return 0;
+    }
+
+    Hyperlink link = { .uri = vt_strdup(vt, uri), .id = id ? vt_strdup(vt, id) : NULL, .refs = 1, .hash = hash };
+    if (!link.uri || (id && !link.id)) {
+        vt_dealloc(vt, link.uri);
+        vt_dealloc(vt, link.id);
+        return 0;
+    }
+
+    uint16_t i;
+    if (vt->links_free) {
+        i = vt->links_free;
+        vt->links_free = vt->links[i].next;
+    } else {
+        i = vt->links_used++;
+    }
+    size_t bucket = hash & (vt->links_capacity - 1);
+    link.next = vt->links_buckets[bucket];
+    vt->links_buckets[bucket] = i;
+    vt->links[i] = link;
+    ++vt->links_count;
+    return i;
+}
+
+static void vt_unref_hyperlink(VT* vt, uint16_t i)
+{
+    Hyperlink* link = &vt->links[i];
+    if (--link->refs > 0)
+        return;
+
+    // remove from the bucket
+    uint16_t* p = &vt->links_buckets[link->hash & (vt->links_capacity - 1)];
+    while (*p != i)
+        p = &vt->links[*p].next;
+    *p = link->next;
+
+    vt_dealloc(vt, link->uri);
+    vt_dealloc(vt, link->id);
+    *link = (Hyperlink) { .next = vt->links_free };
+    vt->links_free = i;
+    --vt->links_count;
+}
+
+static void vt_retain_links(VT* vt, VTCell const* cells, size_t n)
+{
+    if (vt->links_count == 0)   // the usual case: no hyperlinks at all
+        return;
+    for (size_t i = 0; i < n; ++i)
+        if (cells[i].link)
+            ++vt->links[cells[i].link].refs;
+}
+
+static void vt_unref_links(VT* vt, VTCell const* cells, size_t n)   // like vt_release_links, leaving the cells as they are
+{
+    if (vt->links_count == 0)
+        return;
+    for (size_t i = 0; i < n; ++i)
+        if (cells[i].link)
+            vt_unref_hyperlink(vt, cells[i].link);
+}
+
+static void vt_release_links(VT* vt, VTCell* cells, size_t n)
+{
+    if (vt->links_count == 0)
+        return;
+    for (size_t i = 0; i < n; ++i) {
+        if (cells[i].link) {
+            vt_unref_hyperlink(vt, cells[i].link);
+            cells[i].link = 0;
+        }
+    }
+}
+
+static void vt_close_hyperlink(VT* vt)
+{
+    if (vt->current_link)
+        vt_unref_hyperlink(vt, vt->current_link);
+    vt->current_link = 0;
+}
+
+static void vt_open_hyperlink(VT* vt, const char* params, const char* uri)
+{
+    vt_close_hyperlink(vt);
+    if (!uri[0])
+        return;
+
+    // params are key=value pairs separated by ':' - only `id` is used
+    char id[256];
+    const char* id_param = NULL;
+    for (const char* p = params; *p; ) {
+        const char* end = strchr(p, ':');
+        size_t len = end ? (size_t) (end - p) : strlen(p);
+        if (len > 3 && strncmp(p, "id=", 3) == 0 && len - 3 < sizeof id) {
+            memcpy(id, &p[3], len - 3);
+            id[len - 3] = '\0';
+            id_param = id;
+        }
+        p += len + (end ? 1 : 0);
+    }
+
+    vt->current_link = vt_intern_hyperlink(vt, id_param, uri);
+}
+
+static void vt_free_hyperlinks(VT* vt)
+{
+    for (size_t i = 1; i < vt->links_used; ++i) {
+        vt_dealloc(vt, vt->links[i].uri);
+        vt_dealloc(vt, vt->links[i].id);
+    }
+    vt_dealloc(vt, vt->links);
+    vt_dealloc(vt, vt->links_buckets);
+    vt->links = NULL;
+    vt->links_buckets = NULL;
+    vt->links_capacity = vt->links_count = vt->links_used = 0;
+    vt->links_free = vt->current_link = 0;
+}
+
+const char* vt_hyperlink_uri(VT* vt, uint16_t link)
+{
+    if (link == 0 || link >= vt->links_used)
+        return NULL;
+    return vt->links[link].uri;
+}
+
+const char* vt_hyperlink(VT* vt, long row, INT column)
+{
+    if (vt->links_count == 0 || column < 0)
+        return NULL;
+
+    VTCell const* cells;
+    bool wrapped;
+    INT n = vt_any_row(vt, row, &cells, &wrapped);
+    return column < n ? vt_hyperlink_uri(vt, cells[column].link) : NULL;
+}
+
+size_t vt_row_hyperlinks(VT* vt, long row, VTHyperlinkRange* ranges, size_t max_ranges)
+{
+    if (vt->links_count == 0)
+        return 0;
+
+    VTCell const* cells;
+    bool wrapped;
+    INT n = vt_any_row(vt, row, &cells, &wrapped);
+
+    size_t count = 0;
+    for (INT column = 0; column < n; ) {
+        uint16_t link = cells[column].link;
+        INT start = column;
+        while (column < n && cells[column].link == link)
+            ++column;
+        if (link && vt_hyperlink_uri(vt, link)) {
+            if (count < max_ranges)
+                ranges[count] = (VTHyperlinkRange) { .column_start = start, .column_end = column - 1, .link = link };
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+#undef ROW_MAX
+
+#pragma endregion
+
 // https://man7.org/linux/man-pages/man4/console_codes.4.html
@@ -8,6 +8,8 @@
 #define CHAR uint8_t
 #define INT  int16_t
 
+#define LIBVIRTTERM_VERSION "2.0.0"
+
 //
 // Keys
 //
@@ -38,8 +40,33 @@ typedef enum VTKeys {
     VT_ARROW_RIGHT,
     VT_BACKSPACE,
     VT_TAB,
+    VT_KP_0,
+    VT_KP_1,
+    VT_KP_2,
+    VT_KP_3,
+    VT_KP_4,
+    VT_KP_5,
+    VT_KP_6,
+    VT_KP_7,
+    VT_KP_8,
+    VT_KP_9,
+    VT_KP_DECIMAL,
+    VT_KP_DIVIDE,
+    VT_KP_MULTIPLY,
+    VT_KP_MINUS,
+    VT_KP_PLUS,
+    VT_KP_ENTER,
+    VT_KEY_MAX,    /* do not use */
 } VTKeys;
 
+typedef enum VTKeyModifier {
+    VTK_SHIFT=1, VTK_ALT=2, VTK_CTRL=4,
+} VTKeyModifier;
+
+typedef enum VTKittyFlags {   // kitty keyboard protocol (only these are supported)
+    VT_KITTY_DISAMBIGUATE=1, VT_KITTY_REPORT_ALL_KEYS=8,
+} VTKittyFlags;
+
 //
 // Colors
 //
@@ -63,11 +90,18 @@ typedef enum VTColor {
     VT_BRIGHT_WHITE,
 } VTColor;
 
+// indexes for vt_color_rgb(), besides the 16 colors above
+#define VT_COLOR_FOREGROUND 16
+#define VT_COLOR_BACKGROUND 17
+#define VT_COLOR_CURSOR     18
+#define VT_COLOR_MAX        19
+
 
 //
 // Config
 //
 
+// errors are written to stderr; the higher levels also dump the trace there when an escape sequence fails
 typedef enum { VT_NO_DEBUG, VT_DEBUG_ERRORS_ONLY, VT_DEBUG_ALL_ESCAPE_SEQUENCES, VT_DEBUG_ALL_BYTES } VTDebug;
 
 typedef struct VTConfig {
@@ -80,8 +114,11 @@ typedef struct VTConfig {
     bool             bold_is_bright;         // true = bold is also bright color
     bool             blink_cursor;
     uint16_t         blink_ms;
+    size_t           scrollback_lines;       // lines of history kept in memory (0 = none, unless a backend is set)
+    size_t           max_string_size;        // OSC/DCS/APC payloads larger than this are dropped
     CHAR             acs_chars[32];          // see https://en.wikipedia.org/wiki/DEC_Special_Graphics (0x60 ~ 0x7e)
     VTDebug          debug;
+    size_t           trace_records;          // last bytes parsed kept for vt_trace() (0 = none), rounded up to a power of 2
 } VTConfig;
 
 #define VT_DEFAULT_CONFIG (VTConfig) {              \
@@ -94,8 +131,11 @@ typedef struct VTConfig {
     .bold_is_bright = true,                         \
     .blink_cursor = false,                          \
     .blink_ms = 700,                                \
+    .scrollback_lines = 0,                          \
+    .max_string_size = 1024 * 1024,                 \
     .acs_chars = "+#????o#??+++++~---_++++|<>*!fo", \
     .debug = VT_NO_DEBUG,                           \
+    .trace_records = 0,                             \
 }
 
 //
@@ -123,8 +163,13 @@ typedef struct __attribute__((packed)) VTAttrib {
 typedef struct __attribute__((packed)) VTCell {
     CHAR     ch;
     VTAttrib attrib;
+    uint16_t link;          // hyperlink (OSC 8), 0 = none - see vt_hyperlink_uri()
 } VTCell;
 
+// Runs of cells with the same attributes, resolved as in vt_cell() (cursor included), to be drawn at once. The
+// characters are contiguous, but only valid during the call.
+typedef void (*VTRunWriter)(INT row, INT column, CHAR const* chars, size_t n, VTAttrib attrib, void* data);
+
 //
 // Events
 //
@@ -134,12 +179,19 @@ typedef enum VTEventType {
     VT_EVENT_CURSOR_MOVED,
     VT_EVENT_BELL,
     VT_EVENT_TEXT_RECEIVED,
+    VT_EVENT_PALETTE_UPDATED,       // see vt_color_rgb()
+    VT_EVENT_SCROLLED,              // rows moved within a region - the rows uncovered come in a CELLS_UPDATED event
 } VTEventType;
 
 typedef enum VTTextReceivedType {
     VTT_NOT_RECEIVING, VTT_WINDOW_TITLE_UPDATED, VTT_DIRECTORY_HINT_UPDATED,
+    VTT_ICON_TITLE_UPDATED,
+    VTT_CLIPBOARD_SET,              // already decoded from base64
+    VTT_NOTIFICATION,               // if a title was sent, it comes first, followed by a newline
 } VTTextReceivedType;
 
+// Events are meant to be applied in order to a copy of the screen, reading the cells at the time the event is
+// processed: scroll events are always placed before any pending cell update, which are adjusted accordingly.
 typedef struct VTEvent {
     VTEventType type;
     union {
@@ -153,6 +205,11 @@ typedef struct VTEvent {
             VTTextReceivedType type;
             const char*        text;
         } text_received;
+        struct {
+            INT row_start;
+            INT row_end;
+            INT rows;               // > 0: contents moved up by this many rows, < 0: moved down
+        } scroll;
     };
     struct VTEvent* _next;
 } VTEvent;
@@ -172,16 +229,102 @@ typedef enum VTMouseModifier {
 typedef struct VTMouseState {
     INT             row;
     INT             column;
-    bool            button[VTM_MAX];
+    INT             x;                  // position in pixels inside the terminal area, reported in SGR pixel mode (1016)
+    INT             y;
+    bool            button[VTM_MAX];    // the wheel "buttons" are set for a single tick each time
     VTMouseModifier mod;
 } VTMouseState;
 
+//
+// Scrollback
+//
+
+// Optional storage for lines that don't fit in the in-memory scrollback anymore (see libvirtterm_scrollback.h
+// for a file-backed implementation). Line 0 is the oldest line stored in the backend. While a search runs (see
+// libvirtterm_search.h), read() can be called from the search thread and the VT's thread at the same time.
+typedef struct VTScrollbackBackend {
+    void*  data;
+    void   (*push)(void* data, VTCell const* cells, INT columns, bool wrapped);
+    size_t (*lines)(void* data);
+    INT    (*read)(void* data, size_t line, VTCell* cells, INT max_columns, bool* wrapped);
+    void   (*clear)(void* data);
+} VTScrollbackBackend;
+
+//
+// Selection
+//
+
+typedef enum VTSelectionMode {
+    VT_SELECT_CHARACTER, VT_SELECT_WORD, VT_SELECT_LINE, VT_SELECT_RECTANGLE,
+} VTSelectionMode;
+
+typedef enum VTTextFormat {
+    VT_TEXT_PLAIN, VT_TEXT_SGR,     // SGR: attributes are added as escape sequences
+} VTTextFormat;
+
+typedef void (*VTTextWriter)(const char* text, size_t sz, void* data);
+
+//
+// Hyperlinks
+//
+
+typedef struct VTHyperlinkRange {
+    INT      column_start;
+    INT      column_end;    // inclusive
+    uint16_t link;
+} VTHyperlinkRange;
+
+//
+// Tracing
+//
+
+// Flight recorder: every byte given to vt_write() is kept in a ring, in binary form, so the bytes that led to a
+// problem can be dumped after the fact. Recording a byte is a few stores - no formatting, no I/O and no locks. Compiling
+// the library with VT_NO_TRACE removes it altogether.
+
+typedef enum VTTraceState {
+    VT_TRACE_TEXT, VT_TRACE_ESCAPE, VT_TRACE_STRING,      // what the parser was reading when the byte arrived
+} VTTraceState;
+
+typedef enum VTTraceAction {
+    VT_TRACE_BYTE,              // nothing else happened yet
+    VT_TRACE_SEQUENCE,          // the byte completed an escape sequence
+    VT_TRACE_UNRECOGNIZED,      // the byte completed an escape sequence that isn't supported
+    VT_TRACE_INVALID,           // the escape sequence was malformed, its bytes are parsed again as text
+} VTTraceAction;
+
+typedef struct VTTraceRecord {
+    uint32_t time_us;           // wall clock, in microseconds (wraps around), taken once per vt_write()
+    uint8_t  byte;
+    uint8_t  state;             // VTTraceState
+    uint8_t  action;            // VTTraceAction
+} VTTraceRecord;
+
 //
 // Terminal
 //
 
+// threads: the library has no mutable global state, so different VTs can be used from different threads at the same
+// time. A single VT is not synchronized - all calls on it (including vt_next_event) must come from one thread at a
+// time (the only exception is a search from libvirtterm_search.h, which reads the scrollback while it runs). The
+// allocator of a VT is only called from within calls on that VT, so an arena or other unsynchronized allocator is safe
+// as long as it isn't shared with VTs used by other threads.
 typedef struct VT VT;
 
+// memory allocation: everything a VT owns is allocated through this (the text in VT_EVENT_TEXT_RECEIVED events
+// is the exception, as it is handed over to the caller and released with free())
+typedef struct VTAllocator {
+    void* data;
+    void* (*alloc)(void* data, size_t sz);     // returns NULL if out of memory
+    void  (*free)(void* data, void* ptr);
+} VTAllocator;
+
+// built-in arena over a caller-provided memory region. Freed blocks go to a free list sorted by address, merged with
+// the free blocks next to them, and are reused (first fit) before the arena grows; a free block at the end of the
+// used part gives its memory back to it. vt_arena_used() is what the live allocations take, vt_arena_peak() the
+// most of the region that was ever in use.
+typedef struct VTArena VTArena;
+
 typedef struct VTCursor {
     INT  row;
     INT  column;
@@ -194,26 +337,68 @@ typedef struct VTCursor {
 //
 
 // initialization
-VT*  vt_new(INT rows, INT columns, VTConfig const* config);
+VT*  vt_new(INT rows, INT columns, VTConfig const* config, VTAllocator const* allocator);   // NULL allocator: malloc/free
 void vt_free(VT* vt);
 
+// arena
+VTArena*    vt_arena_new(void* memory, size_t sz);   // the arena bookkeeping lives in the region itself
+VTAllocator vt_arena_allocator(VTArena* arena);
+size_t      vt_arena_used(VTArena* arena);
+size_t      vt_arena_peak(VTArena* arena);
+
 // events
 bool vt_next_event(VT* vt, VTEvent* e);
 
+// replies to the application (cursor position reports, device attributes...), to be written back to it - the PTY
+// layer does this automatically. Replies are kept until read, up to a limit.
+size_t vt_read_reply(VT* vt, char* buf, size_t max_sz);   // returns the number of bytes read
+
 // operations
 void vt_write(VT* vt, const char* new_text, size_t new_text_sz);
 void vt_reset(VT* vt);
 void vt_resize(VT* vt, INT rows, INT columns);
 
+// tracing - these can be called from any thread while the VT is in use (but not after vt_free); they only return
+// records that are complete, and that weren't overwritten while being copied
+size_t vt_trace(VT* vt, VTTraceRecord* records, size_t max_records);   // most recent records, oldest first; returns how many
+void   vt_trace_dump(VT* vt, VTTextWriter writer, void* data);          // human-readable
+
 // information
 VTCell vt_cell(VT* vt, INT row, INT column);
+uint64_t vt_row_hash(VT* vt, INT row);   // characters and attributes of the row (not the cursor), computed when it changes
+size_t vt_row_runs(VT* vt, INT row, VTRunWriter writer, void* data);   // returns the number of runs
 int    vt_translate_key(VT* vt, uint16_t key, bool shift, bool ctrl, char* output, size_t max_sz);
+int    vt_translate_key_mod(VT* vt, uint16_t key, int modifiers, char* output, size_t max_sz);   // modifiers: VTKeyModifier
 int    vt_translate_updated_mouse_state(VT* vt, VTMouseState state, char* output, size_t max_sz);
+int    vt_translate_mouse_wheel(VT* vt, VTMouseState state, double lines, char* output, size_t max_sz);   // lines > 0: up, can be fractional
+int    vt_translate_focus(VT* vt, bool focused, char* output, size_t max_sz);
 
 #define CURSOR_NOT_VISIBLE -1
 VTCursor vt_cursor(VT* vt);
 
 INT vt_rows(VT* vt);
 INT vt_columns(VT* vt);
+bool vt_bracketed_paste(VT* vt);
+bool vt_alternate_screen(VT* vt);
+uint32_t vt_color_rgb(VT* vt, int index);   // 0xRRGGBB, index is a VTColor or VT_COLOR_FOREGROUND/BACKGROUND/CURSOR
+
+// scrollback (line 0 is the most recent line that left the screen)
+void   vt_set_scrollback_backend(VT* vt, VTScrollbackBackend const* backend);   // NULL to detach
+size_t vt_scrollback_lines(VT* vt);
+size_t vt_scrollback_total(VT* vt);    // lines that ever entered the scrollback, including discarded ones
+INT    vt_scrollback_row(VT* vt, size_t line, VTCell* cells, INT max_columns, bool* wrapped);   // wrapped can be NULL
+void   vt_clear_scrollback(VT* vt);
+
+// selection (row 0 is the first screen row, negative rows are in the scrollback - -1 being the most recent line)
+void   vt_selection_start(VT* vt, VTSelectionMode mode, long row, INT column);
+void   vt_selection_extend(VT* vt, long row, INT column);
+void   vt_selection_clear(VT* vt);
+bool   vt_selected(VT* vt, long row, INT column);
+size_t vt_selection_text(VT* vt, VTTextFormat format, VTTextWriter writer, void* data);   // UTF-8, returns bytes written
+
+// hyperlinks (rows are numbered as in the selection); links in lines moved to a scrollback backend are dropped
+const char* vt_hyperlink_uri(VT* vt, uint16_t link);            // NULL if the link doesn't exist
+const char* vt_hyperlink(VT* vt, long row, INT column);        // URI under the cell, NULL if none
+size_t      vt_row_hyperlinks(VT* vt, long row, VTHyperlinkRange* ranges, size_t max_ranges);   // returns the number of ranges
 
 #endif
@@ -10,16 +10,39 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#define PASTE_START "\e[200~"
+#define PASTE_END   "\e[201~"
+
 typedef struct VTPTY {
     int    master_pty;
     size_t input_buffer_size;
     VT*    vt;
     char   pty_name[1024];
+
+    // data waiting for the PTY to become writable
+    char*  output;
+    size_t output_start;
+    size_t output_sz;
+    size_t output_capacity;
+
+    // a mouse motion report at the end of the queue is replaced (instead of followed) by the next one
+    bool         motion_queued;
+    size_t       motion_start;
+    VTMouseState last_mouse_state;
+
+    VTTextWriter recorder;
+    void*        recorder_data;
 } VTPTY;
 
 VTPTY* vtpty_new(VT* vt, size_t input_buffer_size)
+{
+    return vtpty_new_command(vt, input_buffer_size, NULL);
+}
+
+VTPTY* vtpty_new_command(VT* vt, size_t input_buffer_size, char* const argv[])
 {
     VTPTY* p = calloc(1, sizeof(VTPTY));
     p->master_pty = -1;
@@ -31,6 +54,11 @@ VTPTY* vtpty_new(VT* vt, size_t input_buffer_size)
     if (pid == 0) {
         setenv("LC_ALL", "en_US.ISO-8859-1", 1);
         setenv("TERM", "xterm", 1);
+        if (argv) {
+            execvp(argv[0], argv);
+            perror(argv[0]);
+            exit(1);
+        }
         char *shell_path = getenv("SHELL");
         if (shell_path)
             execl(shell_path, shell_path, NULL);
@@ -49,42 +77,177 @@ VTPTY* vtpty_new(VT* vt, size_t input_buffer_size)
 void vtpty_close(VTPTY* p)
 {
     close(p->master_pty);
+    free(p->output);
     free(p);
 }
 
-VTPTYStatus write_to_vt(VTPTY* p, const char* buf, size_t n)
+// makes room for n more bytes of output; false if out of memory (the output queued is kept)
+static bool reserve_output(VTPTY* p, size_t n)
+{
+    if (p->output_start + p->output_sz + n <= p->output_capacity)
+        return true;
+
+    if (p->output_start > 0) {
+        memmove(p->output, &p->output[p->output_start], p->output_sz);
+        if (p->motion_queued)
+            p->motion_start -= p->output_start;
+        p->output_start = 0;
+    }
+    if (p->output_sz + n > p->output_capacity) {
+        size_t capacity = p->output_capacity ? p->output_capacity : 4096;
+        while (p->output_sz + n > capacity)
+            capacity *= 2;
+        char* output = realloc(p->output, capacity);
+        if (!output)
+            return false;
+        p->output = output;
+        p->output_capacity = capacity;
+    }
+    return true;
+}
+
+static bool enqueue_output(VTPTY* p, const char* buf, size_t n)
 {
-    if (n > 0 && buf[0] != 0) {
-        int r = write(p->master_pty, buf, n);
+    if (n == 0)
+        return true;
+    if (!reserve_output(p, n))
+        return false;
+
+    p->motion_queued = false;
+    memcpy(&p->output[p->output_start + p->output_sz], buf, n);
+    p->output_sz += n;
+    return true;
+}
+
+VTPTYStatus vtpty_flush(VTPTY* p)
+{
+    while (p->output_sz > 0) {
+        ssize_t r = write(p->master_pty, &p->output[p->output_start], p->output_sz);
         if (r == 0)
             return VTP_CLOSE;
         if (r < 0) {
             switch (errno) {
-                case EAGAIN: return VTP_CONTINUE;
+                case EINTR: continue;
+                case EAGAIN: return VTP_CONTINUE;     // the rest is sent once the PTY is writable again
                 case EIO: return VTP_CLOSE;
                 default: return VTP_ERROR;
             }
         }
+        p->output_start += r;
+        p->output_sz -= r;
+        if (p->output_start > p->motion_start)
+            p->motion_queued = false;
     }
+    p->output_start = 0;
+    p->motion_queued = false;
     return VTP_CONTINUE;
 }
 
+static VTPTYStatus write_to_vt(VTPTY* p, const char* buf, size_t n)
+{
+    if (!enqueue_output(p, buf, n))
+        return VTP_ERROR;
+    return vtpty_flush(p);
+}
+
+bool vtpty_output_pending(VTPTY* p)
+{
+    return p->output_sz > 0;
+}
+
+int vtpty_fd(VTPTY* p)
+{
+    return p->master_pty;
+}
+
 VTPTYStatus vtpty_keypress(VTPTY* p, uint16_t key, bool shift, bool ctrl)
+{
+    return vtpty_keypress_mod(p, key, (shift ? VTK_SHIFT : 0) | (ctrl ? VTK_CTRL : 0));
+}
+
+VTPTYStatus vtpty_keypress_mod(VTPTY* p, uint16_t key, int modifiers)
 {
     char buf[16];
-    int n = vt_translate_key(p->vt, key, shift, ctrl, buf, sizeof buf);
+    int n = vt_translate_key_mod(p->vt, key, modifiers, buf, sizeof buf);
+    if (n > 0 && buf[0] == 0)
+        n = 0;
     return write_to_vt(p, buf, n);
 }
 
+VTPTYStatus vtpty_paste(VTPTY* p, const char* text, size_t sz)
+{
+    bool bracketed = vt_bracketed_paste(p->vt);
+    if (!reserve_output(p, strlen(PASTE_START) + sz + strlen(PASTE_END)))    // so the text is sent whole or not at all
+        return VTP_ERROR;
+    if (bracketed)
+        enqueue_output(p, PASTE_START, strlen(PASTE_START));
+
+    // newlines are sent as CR, like a typed Enter; an end marker inside the text is dropped so it can't end the paste early
+    size_t start = 0;
+    for (size_t i = 0; i < sz; ++i) {
+        if (text[i] == '\n' || text[i] == '\r') {
+            enqueue_output(p, &text[start], i - start);
+            enqueue_output(p, "\r", 1);
+            if (text[i] == '\r' && i + 1 < sz && text[i + 1] == '\n')
+                ++i;
+            start = i + 1;
+        } else if (bracketed && text[i] == '\e' && sz - i >= strlen(PASTE_END) && memcmp(&text[i], PASTE_END, strlen(PASTE_END)) == 0) {
+            enqueue_output(p, &text[start], i - start);
+            i += strlen(PASTE_END) - 1;
+            start = i + 1;
+        }
+    }
+    enqueue_output(p, &text[start], sz - start);
+
+    if (bracketed)
+        enqueue_output(p, PASTE_END, strlen(PASTE_END));
+    return vtpty_flush(p);
+}
+
 VTPTYStatus vtpty_update_mouse_state(VTPTY* p, VTMouseState state)
 {
+    bool motion = memcmp(state.button, p->last_mouse_state.button, sizeof state.button) == 0
+               && state.mod == p->last_mouse_state.mod
+               && !state.button[VTM_SCROLL_UP] && !state.button[VTM_SCROLL_DOWN];
+    p->last_mouse_state = state;
+
     char buf[24];
     int n = vt_translate_updated_mouse_state(p->vt, state, buf, sizeof buf);
-    return write_to_vt(p, buf, n);
+    if (n <= 0)
+        return VTP_CONTINUE;
+    if (!motion)
+        return write_to_vt(p, buf, n);
+
+    // motion reports are only sent on the next flush, so a burst of them costs a single write
+    if (p->motion_queued)
+        p->output_sz = p->motion_start - p->output_start;
+    if (!enqueue_output(p, buf, n))
+        return VTP_ERROR;
+    p->motion_start = p->output_start + p->output_sz - n;
+    p->motion_queued = true;
+    return VTP_CONTINUE;
+}
+
+VTPTYStatus vtpty_update_mouse_wheel(VTPTY* p, VTMouseState state, double lines)
+{
+    char buf[256];
+    int n = vt_translate_mouse_wheel(p->vt, state, lines, buf, sizeof buf);
+    return n > 0 ? write_to_vt(p, buf, n) : VTP_CONTINUE;
+}
+
+VTPTYStatus vtpty_update_focus(VTPTY* p, bool focused)
+{
+    char buf[8];
+    int n = vt_translate_focus(p->vt, focused, buf, sizeof buf);
+    return n > 0 ? write_to_vt(p, buf, n) : VTP_CONTINUE;
 }
 
 VTPTYStatus vtpty_step(VTPTY* p)
 {
+    VTPTYStatus status = vtpty_flush(p);
+    if (status != VTP_CONTINUE)
+        return status;
+
     char buf[p->input_buffer_size];
     int n = read(p->master_pty, buf, sizeof(buf));
 
@@ -99,7 +262,22 @@ VTPTYStatus vtpty_step(VTPTY* p)
         return VTP_CLOSE;
 
 skip:
+    if (p->recorder && n > 0)
+        p->recorder(buf, n, p->recorder_data);
     vt_write(p->vt, buf, n);
+
+    // replies (cursor position, device attributes...) go back right away, as the application is waiting for them
+    char reply[512];
+    size_t reply_sz;
+    bool replied = false;
+    while ((reply_sz = vt_read_reply(p->vt, reply, sizeof reply)) > 0) {
+        if (!enqueue_output(p, reply, reply_sz))
+            return VTP_ERROR;
+        replied = true;
+    }
+    if (replied && (status = vtpty_flush(p)) != VTP_CONTINUE)
+        return status;
+
     if (n == p->input_buffer_size)
         return vtpty_step(p);     // tail call
     else
@@ -117,6 +295,12 @@ void vtpty_resize(VTPTY* p, int rows, int columns)
     vt_resize(p->vt, rows, columns);
 }
 
+void vtpty_record(VTPTY* p, VTTextWriter recorder, void* data)
+{
+    p->recorder = recorder;
+    p->recorder_data = data;
+}
+
 const char* vtpty_name(VTPTY* p)
 {
     return p->pty_name;
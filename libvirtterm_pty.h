@@ -9,14 +9,32 @@ typedef struct VTPTY VTPTY;
 typedef enum VTPTYStatus { VTP_CONTINUE, VTP_CLOSE, VTP_ERROR } VTPTYStatus;
 
 VTPTY*      vtpty_new(VT* vt, size_t input_buffer_size);
+VTPTY*      vtpty_new_command(VT* vt, size_t input_buffer_size, char* const argv[]);   // runs argv instead of $SHELL
 void        vtpty_close(VTPTY* p);
 
 VTPTYStatus vtpty_keypress(VTPTY* p, uint16_t key, bool shift, bool ctrl);
+VTPTYStatus vtpty_keypress_mod(VTPTY* p, uint16_t key, int modifiers);   // modifiers: VTKeyModifier
+VTPTYStatus vtpty_paste(VTPTY* p, const char* text, size_t sz);
 VTPTYStatus vtpty_step(VTPTY* p);
 
+// Data to the PTY is never dropped: what the PTY doesn't accept right away is queued, and sent on the next
+// vtpty_step() or vtpty_flush(). Mouse motion reports are always left for the next flush, and a newer report
+// replaces one still in the queue. Hosts with their own event loop can wait for vtpty_fd() to be writable
+// while vtpty_output_pending() is true, and then call vtpty_flush(). Replies from the terminal (see vt_read_reply)
+// are sent by vtpty_step() as soon as the data that asked for them is processed. When the queue can't grow, VTP_ERROR
+// is returned and what was already queued is kept (a paste is then not queued at all).
+VTPTYStatus vtpty_flush(VTPTY* p);
+bool        vtpty_output_pending(VTPTY* p);
+int         vtpty_fd(VTPTY* p);
+
 void        vtpty_resize(VTPTY* p, int rows, int columns);
 
 VTPTYStatus vtpty_update_mouse_state(VTPTY* p, VTMouseState state);
+VTPTYStatus vtpty_update_mouse_wheel(VTPTY* p, VTMouseState state, double lines);   // high-resolution wheel, lines > 0: up
+VTPTYStatus vtpty_update_focus(VTPTY* p, bool focused);
+
+// Everything read from the PTY is also given to the recorder, before the terminal parses it (to replay it later).
+void        vtpty_record(VTPTY* p, VTTextWriter recorder, void* data);
 
 const char* vtpty_name(VTPTY* p);
 
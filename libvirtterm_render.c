@@ -0,0 +1,448 @@
+#include "libvirtterm_render.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#define GLYPH_CACHE_SIZE 1024           // direct-mapped, must be a power of two
+#define PENDING_SCROLLS  8              // more than this between frames and the whole screen is drawn
+
+typedef struct PendingScroll {
+    INT row_start;
+    INT row_end;
+    INT rows;
+} PendingScroll;
+
+typedef struct VTRender {
+    VT*            vt;
+    VTFont const*  font;
+    VTRenderFormat format;
+    int            bpp;                 // bytes per pixel
+
+    // what's in the buffer
+    INT            rows;
+    INT            columns;
+    VTCell*        cells;
+    bool*          dirty;               // rows that might have changed
+    bool           all_dirty;           // the buffer contents can't be trusted
+    INT            cursor_row;
+    PendingScroll  scrolls[PENDING_SCROLLS];
+    size_t         scroll_count;
+
+    // glyphs already drawn in the buffer format, with colors and attributes - the key is 0 for an empty slot
+    uint32_t*      glyph_keys;
+    uint8_t*       glyph_pixels;
+    size_t         glyph_sz;
+    uint32_t       colors[VT_COLOR_MAX];   // palette in the buffer format, refreshed every frame
+} VTRender;
+
+//
+// font
+//
+
+static uint32_t read_le(const uint8_t* p, int n)
+{
+    uint32_t v = 0;
+    for (int i = n - 1; i >= 0; --i)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+// BI_RLE8: runs of (count, index), or escapes (0, 0) end of line, (0, 1) end of bitmap, (0, 2, dx, dy) skip,
+// and (0, n) followed by n literal indexes, padded to 16 bits. Lines are bottom-up.
+static bool decode_rle8(const uint8_t* data, size_t sz, uint8_t* pixels, int width, int height)
+{
+    int x = 0, y = height - 1;
+    size_t i = 0;
+    while (i + 1 < sz) {
+        uint8_t count = data[i++], value = data[i++];
+        if (count > 0) {
+            for (; count > 0 && x < width && y >= 0; --count)
+                pixels[y * width + x++] = value;
+        } else if (value == 0) {
+            x = 0;
+            --y;
+        } else if (value == 1) {
+            return true;
+        } else if (value == 2) {
+            if (i + 2 > sz)
+                return false;
+            x += data[i++];
+            y -= data[i++];
+        } else {
+            if (i + value > sz)
+                return false;
+            for (int j = 0; j < value; ++j)
+                if (x < width && y >= 0)
+                    pixels[y * width + x++] = data[i + j];
+            i += (value + 1) & ~1;
+        }
+    }
+    return true;
+}
+
+VTFont* vtfont_load_bmp(const char* path, int glyph_width, int glyph_height)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    VTFont* font = NULL;
+    uint8_t* data = NULL;
+    fseek(f, 0, SEEK_END);
+    long sz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (sz < 54 || !(data = malloc(sz)) || fread(data, 1, sz, f) != (size_t) sz)
+        goto done;
+
+    uint32_t offset = read_le(&data[10], 4);
+    int32_t width = (int32_t) read_le(&data[18], 4);
+    int32_t height = (int32_t) read_le(&data[22], 4);
+    int bits = (int) read_le(&data[28], 2);
+    uint32_t compression = read_le(&data[30], 4);
+    bool top_down = height < 0;
+    if (top_down)
+        height = -height;
+    bool rle = compression == 1 && bits == 8 && !top_down;
+    size_t stride = ((size_t) width * bits + 31) / 32 * 4;
+    if (data[0] != 'B' || data[1] != 'M' || (compression != 0 && !rle) || (bits != 8 && bits != 24 && bits != 32)
+            || width <= 0 || width < glyph_width || height < glyph_height || glyph_width <= 0 || glyph_height <= 0
+            || offset > (size_t) sz || (!rle && offset + stride * height > (size_t) sz))
+        goto done;
+
+    if (!(font = malloc(sizeof(VTFont))) || !(font->pixels = calloc((size_t) width * height, 1))) {
+        free(font);
+        font = NULL;
+        goto done;
+    }
+    font->width = width;
+    font->height = height;
+    font->glyph_width = glyph_width;
+    font->glyph_height = glyph_height;
+
+    // palette index 0 (8 bpp) or black is the background, anything else is ink
+    if (rle) {
+        if (!decode_rle8(&data[offset], sz - offset, font->pixels, width, height)) {
+            vtfont_free(font);
+            font = NULL;
+            goto done;
+        }
+        for (size_t i = 0; i < (size_t) width * height; ++i)
+            font->pixels[i] = font->pixels[i] ? 0xFF : 0;
+    } else {
+        for (int y = 0; y < height; ++y) {
+            const uint8_t* line = &data[offset + stride * (top_down ? y : height - 1 - y)];
+            for (int x = 0; x < width; ++x) {
+                const uint8_t* px = &line[x * bits / 8];
+                bool ink = bits == 8 ? px[0] != 0 : (px[0] | px[1] | px[2]) != 0;
+                font->pixels[y * width + x] = ink ? 0xFF : 0;
+            }
+        }
+    }
+
+done:
+    free(data);
+    fclose(f);
+    return font;
+}
+
+void vtfont_free(VTFont* font)
+{
+    if (font)
+        free(font->pixels);
+    free(font);
+}
+
+//
+// pixels
+//
+
+static uint32_t pixel_color(VTRender* r, uint32_t rgb)
+{
+    uint8_t red = (rgb >> 16) & 0xFF, green = (rgb >> 8) & 0xFF, blue = rgb & 0xFF;
+    if (r->format == VTR_RGB565)
+        return ((red >> 3) << 11) | ((green >> 2) << 5) | (blue >> 3);
+    uint8_t bytes[4] = { red, green, blue, 0xFF };
+    uint32_t v;
+    memcpy(&v, bytes, 4);
+    return v;
+}
+
+static uint32_t dim_color(uint32_t rgb)
+{
+    return (((rgb >> 16) & 0xFF) * 6 / 10) << 16 | (((rgb >> 8) & 0xFF) * 6 / 10) << 8 | (rgb & 0xFF) * 6 / 10;
+}
+
+static void fill32(uint32_t* dst, uint32_t color, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i v = _mm_set1_epi32((int) color);
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i *) &dst[i], v);
+#endif
+    for (; i < n; ++i)
+        dst[i] = color;
+}
+
+static void fill16(uint16_t* dst, uint16_t color, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i v = _mm_set1_epi16((short) color);
+    for (; i + 8 <= n; i += 8)
+        _mm_storeu_si128((__m128i *) &dst[i], v);
+#endif
+    for (; i < n; ++i)
+        dst[i] = color;
+}
+
+// fills `columns` blank cells starting at the given pixel
+static void fill_cells(VTRender* r, uint8_t* dst, size_t pitch, INT columns, uint32_t color)
+{
+    size_t n = (size_t) columns * r->font->glyph_width;
+    for (int y = 0; y < r->font->glyph_height; ++y, dst += pitch) {
+        if (r->bpp == 4)
+            fill32((uint32_t *) dst, color, n);
+        else
+            fill16((uint16_t *) dst, (uint16_t) color, n);
+    }
+}
+
+//
+// glyph cache
+//
+
+static uint32_t glyph_key(VTCell cell)
+{
+    return 1u | (uint32_t) cell.ch << 1 | cell.attrib.fg_color << 9 | cell.attrib.bg_color << 13
+         | cell.attrib.underline << 17 | cell.attrib.dim << 18 | cell.attrib.invisible << 19;
+}
+
+static const uint8_t* cached_glyph(VTRender* r, VTCell cell)
+{
+    uint32_t key = glyph_key(cell);
+    size_t slot = (key * 2654435761u) >> 22 & (GLYPH_CACHE_SIZE - 1);
+    uint8_t* pixels = &r->glyph_pixels[slot * r->glyph_sz];
+    if (r->glyph_keys[slot] == key)
+        return pixels;
+
+    VTFont const* font = r->font;
+    uint32_t fg = r->colors[cell.attrib.fg_color];
+    if (cell.attrib.dim)
+        fg = pixel_color(r, dim_color(vt_color_rgb(r->vt, cell.attrib.fg_color)));
+    uint32_t bg = r->colors[cell.attrib.bg_color];
+
+    int per_row = font->width / font->glyph_width;
+    int gx = (cell.ch % per_row) * font->glyph_width, gy = (cell.ch / per_row) * font->glyph_height;
+    bool has_glyph = !cell.attrib.invisible && gy + font->glyph_height <= font->height;
+
+    for (int y = 0; y < font->glyph_height; ++y) {
+        const uint8_t* ink = &font->pixels[(gy + y) * font->width + gx];
+        bool underline = cell.attrib.underline && !cell.attrib.invisible && y == font->glyph_height - 2;
+        for (int x = 0; x < font->glyph_width; ++x) {
+            uint32_t color = (underline || (has_glyph && ink[x])) ? fg : bg;
+            uint8_t* px = &pixels[(y * font->glyph_width + x) * r->bpp];
+            if (r->bpp == 4)
+                memcpy(px, &color, 4);
+            else
+                memcpy(px, &(uint16_t) { (uint16_t) color }, 2);
+        }
+    }
+
+    r->glyph_keys[slot] = key;
+    return pixels;
+}
+
+//
+// renderer
+//
+
+VTRender* vtrender_new(VT* vt, VTFont const* font, VTRenderFormat format)
+{
+    VTRender* r = calloc(1, sizeof(VTRender));
+    if (!r)
+        return NULL;
+    r->vt = vt;
+    r->font = font;
+    r->format = format;
+    r->bpp = format == VTR_RGB565 ? 2 : 4;
+    r->all_dirty = true;
+    r->glyph_sz = (size_t) font->glyph_width * font->glyph_height * r->bpp;
+    r->glyph_keys = calloc(GLYPH_CACHE_SIZE, sizeof(uint32_t));
+    r->glyph_pixels = malloc(GLYPH_CACHE_SIZE * r->glyph_sz);
+    if (!r->glyph_keys || !r->glyph_pixels) {
+        vtrender_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void vtrender_free(VTRender* r)
+{
+    if (!r)
+        return;
+    free(r->cells);
+    free(r->dirty);
+    free(r->glyph_keys);
+    free(r->glyph_pixels);
+    free(r);
+}
+
+void vtrender_invalidate(VTRender* r)
+{
+    r->all_dirty = true;
+    r->scroll_count = 0;
+}
+
+int vtrender_width(VTRender* r)
+{
+    return vt_columns(r->vt) * r->font->glyph_width;
+}
+
+int vtrender_height(VTRender* r)
+{
+    return vt_rows(r->vt) * r->font->glyph_height;
+}
+
+void vtrender_damage(VTRender* r, VTEvent const* e)
+{
+    if (r->all_dirty || r->rows != vt_rows(r->vt) || r->columns != vt_columns(r->vt)) {
+        vtrender_invalidate(r);
+        return;
+    }
+
+    switch (e->type) {
+        case VT_EVENT_CELLS_UPDATED:
+            for (INT row = e->cells.row_start; row <= e->cells.row_end; ++row)
+                if (row >= 0 && row < r->rows)
+                    r->dirty[row] = true;
+            break;
+        case VT_EVENT_SCROLLED: {
+            INT top = e->scroll.row_start, bottom = e->scroll.row_end;
+            INT n = e->scroll.rows > 0 ? e->scroll.rows : -e->scroll.rows;
+            if (top < 0 || bottom >= r->rows || n > bottom - top || r->scroll_count == PENDING_SCROLLS) {
+                vtrender_invalidate(r);
+                break;
+            }
+            // the cells follow the pixels, which are moved in the next frame; rows that were dirty stay dirty where
+            // they were, and also where they were moved to
+            INT from = e->scroll.rows > 0 ? top + n : top, to = e->scroll.rows > 0 ? top : top + n;
+            memmove(&r->cells[to * r->columns], &r->cells[from * r->columns], (bottom - top + 1 - n) * r->columns * sizeof(VTCell));
+            bool moved[bottom - top + 1];
+            memcpy(moved, &r->dirty[top], sizeof moved);
+            for (INT row = 0; row <= bottom - top - n; ++row)
+                r->dirty[to + row] |= moved[from - top + row];
+            if (r->cursor_row >= from && r->cursor_row <= from + bottom - top - n)   // so is the cursor drawn
+                r->cursor_row += to - from;
+            r->scrolls[r->scroll_count++] = (PendingScroll) { top, bottom, e->scroll.rows };
+            break;
+        }
+        case VT_EVENT_PALETTE_UPDATED:
+            memset(r->glyph_keys, 0, GLYPH_CACHE_SIZE * sizeof(uint32_t));
+            vtrender_invalidate(r);
+            break;
+        default:                        // the cursor rows are always checked
+            break;
+    }
+}
+
+static bool resize_cells(VTRender* r)
+{
+    INT rows = vt_rows(r->vt), columns = vt_columns(r->vt);
+    VTCell* cells = realloc(r->cells, (size_t) rows * columns * sizeof(VTCell));
+    if (!cells)
+        return false;
+    r->cells = cells;
+    bool* dirty = realloc(r->dirty, rows * sizeof(bool));
+    if (!dirty)
+        return false;
+    r->dirty = dirty;
+    memset(r->dirty, 0, rows * sizeof(bool));
+    r->rows = rows;
+    r->columns = columns;
+    r->cursor_row = 0;
+    vtrender_invalidate(r);
+    return true;
+}
+
+static bool same_cell(VTCell a, VTCell b)
+{
+    return a.ch == b.ch && memcmp(&a.attrib, &b.attrib, sizeof(VTAttrib)) == 0;   // links don't change the pixels
+}
+
+size_t vtrender_draw(VTRender* r, void* pixels, size_t pitch)
+{
+    if ((r->rows != vt_rows(r->vt) || r->columns != vt_columns(r->vt) || !r->cells) && !resize_cells(r))
+        return 0;
+
+    for (int i = 0; i < VT_COLOR_MAX; ++i)
+        r->colors[i] = pixel_color(r, vt_color_rgb(r->vt, i));
+
+    uint8_t* buffer = pixels;
+    int gw = r->font->glyph_width, gh = r->font->glyph_height;
+
+    // move the pixels that were scrolled
+    for (size_t i = 0; i < r->scroll_count; ++i) {
+        PendingScroll s = r->scrolls[i];
+        INT n = s.rows > 0 ? s.rows : -s.rows;
+        INT from = s.rows > 0 ? s.row_start + n : s.row_start, to = s.rows > 0 ? s.row_start : s.row_start + n;
+        memmove(&buffer[to * gh * pitch], &buffer[from * gh * pitch], (size_t) (s.row_end - s.row_start + 1 - n) * gh * pitch);
+    }
+    r->scroll_count = 0;
+
+    // the cursor is drawn by vt_cell(), and its row is checked every frame, as it might blink
+    INT cursor_row = vt_cursor(r->vt).row;
+    r->dirty[r->cursor_row] = true;
+    if (cursor_row >= 0 && cursor_row < r->rows) {
+        r->dirty[cursor_row] = true;
+        r->cursor_row = cursor_row;
+    }
+
+    size_t drawn = 0;
+    for (INT row = 0; row < r->rows; ++row) {
+        if (!r->dirty[row] && !r->all_dirty)
+            continue;
+        r->dirty[row] = false;
+
+        VTCell* cached = &r->cells[row * r->columns];
+        uint8_t* line = &buffer[row * gh * pitch];
+        for (INT column = 0; column < r->columns; ) {
+            VTCell cell = vt_cell(r->vt, row, column);
+            if (!r->all_dirty && same_cell(cell, cached[column])) {
+                ++column;
+                continue;
+            }
+
+            // runs of blank cells with the same background are filled, everything else comes from the glyph cache
+            if ((cell.ch == ' ' || cell.ch == 0) && !cell.attrib.underline) {
+                INT end = column + 1;
+                cached[column] = cell;
+                for (; end < r->columns; ++end) {
+                    VTCell next = vt_cell(r->vt, row, end);
+                    if ((next.ch != ' ' && next.ch != 0) || next.attrib.underline || next.attrib.bg_color != cell.attrib.bg_color)
+                        break;
+                    cached[end] = next;
+                }
+                fill_cells(r, &line[column * gw * r->bpp], pitch, end - column, r->colors[cell.attrib.bg_color]);
+                drawn += end - column;
+                column = end;
+                continue;
+            }
+
+            const uint8_t* src = cached_glyph(r, cell);
+            uint8_t* dst = &line[column * gw * r->bpp];
+            for (int y = 0; y < gh; ++y)
+                memcpy(&dst[y * pitch], &src[y * gw * r->bpp], gw * r->bpp);
+            cached[column] = cell;
+            ++drawn;
+            ++column;
+        }
+    }
+
+    r->all_dirty = false;
+    return drawn;
+}
@@ -0,0 +1,40 @@
+#ifndef LIBVIRTTERM_RENDER_H
+#define LIBVIRTTERM_RENDER_H
+
+#define _XOPEN_SOURCE 700
+#include "libvirtterm.h"
+
+// Software rasterizer: draws the terminal into a pixel buffer owned by the caller, using a bitmap font, with no
+// need for a GPU or a display. Only the rows reported by the events given to vtrender_damage() are looked at, and
+// only the cells that changed since the previous frame are drawn. Scrolls are applied by moving the pixels already
+// in the buffer, so the buffer must keep the previous frame - call vtrender_invalidate() when it doesn't.
+
+typedef enum VTRenderFormat {
+    VTR_RGBA8888,           // bytes R, G, B, A
+    VTR_RGB565,             // native endianness
+} VTRenderFormat;
+
+typedef struct VTFont {
+    uint8_t* pixels;        // one byte per pixel, 0 is the background
+    int      width;
+    int      height;
+    int      glyph_width;   // glyphs are laid out left to right, top to bottom, in character order
+    int      glyph_height;
+} VTFont;
+
+VTFont*   vtfont_load_bmp(const char* path, int glyph_width, int glyph_height);   // 8 bpp (uncompressed or RLE), 24 or 32 bpp
+void      vtfont_free(VTFont* font);
+
+typedef struct VTRender VTRender;
+
+VTRender* vtrender_new(VT* vt, VTFont const* font, VTRenderFormat format);   // the font must outlive the renderer
+void      vtrender_free(VTRender* r);
+
+void      vtrender_damage(VTRender* r, VTEvent const* e);     // to be given every event read from the VT
+void      vtrender_invalidate(VTRender* r);                   // the whole screen is drawn in the next frame
+
+int       vtrender_width(VTRender* r);                        // size of the buffer in pixels
+int       vtrender_height(VTRender* r);
+size_t    vtrender_draw(VTRender* r, void* pixels, size_t pitch);   // pitch in bytes, returns the number of cells drawn
+
+#endif //LIBVIRTTERM_RENDER_H
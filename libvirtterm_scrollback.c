@@ -0,0 +1,269 @@
+#include "libvirtterm_scrollback.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define INDEX_CHUNK     (64 * 1024)     // index entries added every time the index file grows
+#define MAPPED_SEGMENTS 4               // segments kept mapped for reading
+
+typedef struct MappedSegment {
+    size_t   segment;
+    uint8_t* data;
+    size_t   last_use;
+} MappedSegment;
+
+typedef struct VTScrollback {
+    VT*           vt;
+    size_t        segment_size;
+
+    // segment log: each record is a uint16_t with the number of columns, a uint8_t with the wrap flag, and the cells
+    int           data_fd;
+    size_t        data_size;            // bytes used
+    size_t        active_segment;       // segment being written, always mapped
+    uint8_t*      active;
+
+    // row offset index: one uint64_t per line, pointing to the record in the segment log
+    int           index_fd;
+    uint64_t*     index;
+    size_t        index_capacity;
+    size_t        lines;
+
+    // read-only segments, evicted in LRU order; reads can come from a search thread and the VT's thread at the same
+    // time (see libvirtterm_search.h), so they are serialized
+    MappedSegment   mapped[MAPPED_SEGMENTS];
+    size_t          use_counter;
+    pthread_mutex_t mapped_lock;
+} VTScrollback;
+
+static int open_unlinked_file(const char* directory)
+{
+    char path[1024];
+    snprintf(path, sizeof path, "%s/libvirtterm-XXXXXX", directory);
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    return fd;
+}
+
+static uint8_t* map_segment(VTScrollback* sb, size_t segment, int prot)
+{
+    void* data = mmap(NULL, sb->segment_size, prot, MAP_SHARED, sb->data_fd, (off_t) (segment * sb->segment_size));
+    return data == MAP_FAILED ? NULL : data;
+}
+
+static void unmap_read_segments(VTScrollback* sb)
+{
+    for (size_t i = 0; i < MAPPED_SEGMENTS; ++i) {
+        if (sb->mapped[i].data)
+            munmap(sb->mapped[i].data, sb->segment_size);
+        sb->mapped[i] = (MappedSegment) {};
+    }
+}
+
+static bool start_segment(VTScrollback* sb, size_t segment)
+{
+    if (sb->active)
+        munmap(sb->active, sb->segment_size);
+    sb->active = NULL;
+
+    if (ftruncate(sb->data_fd, (off_t) ((segment + 1) * sb->segment_size)) != 0)
+        return false;
+    sb->active_segment = segment;
+    sb->data_size = segment * sb->segment_size;
+    sb->active = map_segment(sb, segment, PROT_READ | PROT_WRITE);
+    return sb->active != NULL;
+}
+
+// the new mapping is made before the old one is dropped, so the index stays usable when growing it fails
+static bool grow_index(VTScrollback* sb)
+{
+    size_t new_capacity = sb->index_capacity + INDEX_CHUNK;
+    if (ftruncate(sb->index_fd, (off_t) (new_capacity * sizeof(uint64_t))) != 0)
+        return false;
+    void* index = mmap(NULL, new_capacity * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, sb->index_fd, 0);
+    if (index == MAP_FAILED)
+        return false;
+
+    if (sb->index)
+        munmap(sb->index, sb->index_capacity * sizeof(uint64_t));
+    sb->index = index;
+    sb->index_capacity = new_capacity;
+    return true;
+}
+
+//
+// backend callbacks
+//
+
+#define RECORD_HEADER (sizeof(uint16_t) + sizeof(uint8_t))
+
+static void vtsb_push(void* data, VTCell const* cells, INT columns, bool wrapped)
+{
+    VTScrollback* sb = data;
+
+    size_t record_size = RECORD_HEADER + columns * sizeof(VTCell);
+    if (record_size > sb->segment_size)
+        return;
+
+    if (!sb->active && !start_segment(sb, sb->active_segment))
+        return;
+    size_t offset = sb->data_size - sb->active_segment * sb->segment_size;
+    if (offset + record_size > sb->segment_size) {
+        if (!start_segment(sb, sb->active_segment + 1))
+            return;
+        offset = 0;
+    }
+
+    if (sb->lines == sb->index_capacity && !grow_index(sb))
+        return;
+
+    uint16_t n = columns;
+    memcpy(&sb->active[offset], &n, sizeof n);
+    sb->active[offset + sizeof n] = wrapped;
+    memcpy(&sb->active[offset + RECORD_HEADER], cells, columns * sizeof(VTCell));
+
+    sb->index[sb->lines++] = sb->data_size;
+    sb->data_size += record_size;
+}
+
+static size_t vtsb_backend_lines(void* data)
+{
+    return ((VTScrollback *) data)->lines;
+}
+
+static INT read_record(const uint8_t* base, size_t offset, VTCell* cells, INT max_columns, bool* wrapped)
+{
+    if (!base)
+        return 0;
+
+    uint16_t n;
+    memcpy(&n, &base[offset], sizeof n);
+    if (n > max_columns)
+        n = max_columns;
+    *wrapped = base[offset + sizeof n];
+    memcpy(cells, &base[offset + RECORD_HEADER], n * sizeof(VTCell));
+    return n;
+}
+
+static INT vtsb_read(void* data, size_t line, VTCell* cells, INT max_columns, bool* wrapped)
+{
+    VTScrollback* sb = data;
+    if (line >= sb->lines)
+        return 0;
+
+    uint64_t position = sb->index[line];
+    size_t segment = position / sb->segment_size;
+    size_t offset = position % sb->segment_size;
+
+    if (segment == sb->active_segment)
+        return read_record(sb->active, offset, cells, max_columns, wrapped);
+
+    pthread_mutex_lock(&sb->mapped_lock);
+    MappedSegment* slot = &sb->mapped[0];
+    for (size_t i = 0; i < MAPPED_SEGMENTS; ++i) {
+        if (sb->mapped[i].data && sb->mapped[i].segment == segment) {
+            slot = &sb->mapped[i];
+            break;
+        }
+        if (sb->mapped[i].last_use < slot->last_use)
+            slot = &sb->mapped[i];
+    }
+    if (!slot->data || slot->segment != segment) {
+        if (slot->data)
+            munmap(slot->data, sb->segment_size);
+        *slot = (MappedSegment) { .segment = segment, .data = map_segment(sb, segment, PROT_READ) };
+    }
+    slot->last_use = ++sb->use_counter;
+    INT n = read_record(slot->data, offset, cells, max_columns, wrapped);
+    pthread_mutex_unlock(&sb->mapped_lock);
+    return n;
+}
+
+static void vtsb_clear(void* data)
+{
+    VTScrollback* sb = data;
+
+    unmap_read_segments(sb);
+    if (sb->active)
+        munmap(sb->active, sb->segment_size);
+    sb->active = NULL;
+    sb->active_segment = 0;
+    sb->data_size = 0;
+    sb->lines = 0;
+    // shrinking the file only gives the disk space back: when it fails, the file is simply overwritten from the start
+    if (ftruncate(sb->data_fd, 0) != 0)
+        return;
+}
+
+//
+// public functions
+//
+
+VTScrollback* vtsb_new(VT* vt, const char* directory, size_t segment_size)
+{
+    VTScrollback* sb = calloc(1, sizeof(VTScrollback));
+    if (!sb)
+        return NULL;
+    sb->vt = vt;
+    pthread_mutex_init(&sb->mapped_lock, NULL);
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    if (segment_size == 0)
+        segment_size = VTSB_DEFAULT_SEGMENT_SIZE;
+    sb->segment_size = (segment_size + page_size - 1) / page_size * page_size;
+
+    sb->data_fd = open_unlinked_file(directory);
+    sb->index_fd = open_unlinked_file(directory);
+    if (sb->data_fd < 0 || sb->index_fd < 0) {
+        if (sb->data_fd >= 0)
+            close(sb->data_fd);
+        if (sb->index_fd >= 0)
+            close(sb->index_fd);
+        pthread_mutex_destroy(&sb->mapped_lock);
+        free(sb);
+        return NULL;
+    }
+
+    vt_set_scrollback_backend(vt, &(VTScrollbackBackend) {
+        .data = sb,
+        .push = vtsb_push,
+        .lines = vtsb_backend_lines,
+        .read = vtsb_read,
+        .clear = vtsb_clear,
+    });
+
+    return sb;
+}
+
+void vtsb_close(VTScrollback* sb)
+{
+    if (!sb)
+        return;
+
+    vt_set_scrollback_backend(sb->vt, NULL);
+
+    unmap_read_segments(sb);
+    if (sb->active)
+        munmap(sb->active, sb->segment_size);
+    if (sb->index)
+        munmap(sb->index, sb->index_capacity * sizeof(uint64_t));
+    close(sb->data_fd);
+    close(sb->index_fd);
+    pthread_mutex_destroy(&sb->mapped_lock);
+    free(sb);
+}
+
+size_t vtsb_lines(VTScrollback* sb)
+{
+    return sb->lines;
+}
+
+size_t vtsb_disk_usage(VTScrollback* sb)
+{
+    return sb->data_size + sb->lines * sizeof(uint64_t);
+}
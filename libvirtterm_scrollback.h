@@ -0,0 +1,22 @@
+#ifndef LIBVIRTTERM_SCROLLBACK_H
+#define LIBVIRTTERM_SCROLLBACK_H
+
+#define _XOPEN_SOURCE 700
+
+#include "libvirtterm.h"
+
+// File-backed scrollback: lines that leave the in-memory scrollback are appended to a memory-mapped segment log,
+// so only the segments being written or read are paged in. The files are unlinked as soon as they are created,
+// so nothing is left on disk once the terminal is closed.
+
+typedef struct VTScrollback VTScrollback;
+
+#define VTSB_DEFAULT_SEGMENT_SIZE (16 * 1024 * 1024)
+
+VTScrollback* vtsb_new(VT* vt, const char* directory, size_t segment_size);   // attaches itself to the VT; NULL on error
+void          vtsb_close(VTScrollback* sb);                                    // detaches from the VT
+
+size_t        vtsb_lines(VTScrollback* sb);
+size_t        vtsb_disk_usage(VTScrollback* sb);
+
+#endif //LIBVIRTTERM_SCROLLBACK_H
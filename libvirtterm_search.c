@@ -0,0 +1,464 @@
+#include "libvirtterm_search.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#define ROW_MAX          INT16_MAX
+#define TRIGRAM_USED     (1u << 24)
+#define INITIAL_POSTINGS 4096
+
+typedef struct Posting {
+    uint32_t  trigram;          // 0 = empty slot
+    uint32_t  count;
+    uint32_t  capacity;
+    uint32_t* lines;
+} Posting;
+
+typedef struct VTSearch {
+    VT*            vt;
+    VTCell*        row;
+    char*          text;                // the row being searched, followed by a '\0' so it can be given to regexec()
+
+    // trigram index of the scrollback: only line numbers are kept (the n-th line that entered the scrollback is
+    // line n), the lines themselves are read back from the VT
+    size_t         index_first;         // lines before this one may still be in the postings
+    size_t         history_first;       // lines before this one were discarded by the VT
+    size_t         indexed_total;
+    Posting*       postings;
+    size_t         postings_capacity;
+    size_t         postings_used;
+
+    // screen copied by vtsearch_start(): `screen_rows` rows of `screen_columns + 1` bytes, each ending with a '\0'
+    char*          screen;
+    INT            screen_rows;
+    INT            screen_columns;
+    size_t         screen_capacity;
+
+    // search in progress
+    pthread_t      thread;
+    bool           running;
+    atomic_bool    cancel;
+    atomic_bool    done;
+    char*          pattern;
+    size_t         pattern_len;
+    int            flags;
+    regex_t        regex;
+    bool           regex_compiled;
+    size_t         max_matches;
+    char*          scratch;
+    size_t         scratch_capacity;
+    VTSearchMatch* matches;
+    size_t         match_count;
+    size_t         match_capacity;
+} VTSearch;
+
+//
+// trigram index
+//
+
+static uint32_t trigram(const char* p)
+{
+    return TRIGRAM_USED | (uint32_t) tolower((uint8_t) p[0]) << 16 | (uint32_t) tolower((uint8_t) p[1]) << 8 | (uint32_t) tolower((uint8_t) p[2]);
+}
+
+static Posting* posting_slot(Posting* postings, size_t capacity, uint32_t key)
+{
+    size_t i = (key * 2654435761u) & (capacity - 1);
+    while (postings[i].trigram != 0 && postings[i].trigram != key)
+        i = (i + 1) & (capacity - 1);
+    return &postings[i];
+}
+
+static bool postings_grow(VTSearch* s)
+{
+    size_t new_capacity = s->postings_capacity ? s->postings_capacity * 2 : INITIAL_POSTINGS;
+    Posting* new_postings = calloc(new_capacity, sizeof(Posting));
+    if (!new_postings)
+        return false;
+    for (size_t i = 0; i < s->postings_capacity; ++i)
+        if (s->postings[i].trigram)
+            *posting_slot(new_postings, new_capacity, s->postings[i].trigram) = s->postings[i];
+    free(s->postings);
+    s->postings = new_postings;
+    s->postings_capacity = new_capacity;
+    return true;
+}
+
+static void postings_free(VTSearch* s)
+{
+    for (size_t i = 0; i < s->postings_capacity; ++i)
+        free(s->postings[i].lines);
+    free(s->postings);
+    s->postings = NULL;
+    s->postings_capacity = s->postings_used = 0;
+}
+
+// removes from the postings the lines discarded by the VT
+static void postings_prune(VTSearch* s)
+{
+    for (size_t i = 0; i < s->postings_capacity; ++i) {
+        Posting* p = &s->postings[i];
+        uint32_t first = 0;
+        while (first < p->count && p->lines[first] < s->history_first)
+            ++first;
+        if (first > 0) {
+            memmove(p->lines, &p->lines[first], (p->count - first) * sizeof(uint32_t));
+            p->count -= first;
+        }
+    }
+    s->index_first = s->history_first;
+}
+
+static bool index_line(VTSearch* s, uint32_t line_nr, const char* line, size_t len)
+{
+    for (size_t i = 0; i + 3 <= len; ++i) {
+        if (s->postings_used * 10 >= s->postings_capacity * 7 && !postings_grow(s))
+            return false;
+
+        uint32_t key = trigram(&line[i]);
+        Posting* p = posting_slot(s->postings, s->postings_capacity, key);
+        if (p->trigram == 0) {
+            p->trigram = key;
+            ++s->postings_used;
+        } else if (p->count > 0 && p->lines[p->count - 1] == line_nr) {
+            continue;
+        }
+
+        if (p->count == p->capacity) {
+            uint32_t capacity = p->capacity ? p->capacity * 2 : 4;
+            uint32_t* lines = realloc(p->lines, capacity * sizeof(uint32_t));
+            if (!lines)
+                return false;
+            p->lines = lines;
+            p->capacity = capacity;
+        }
+        p->lines[p->count++] = line_nr;
+    }
+    return true;
+}
+
+static size_t row_to_text(VTCell const* cells, INT n, char* text)
+{
+    size_t len = 0;
+    for (INT i = 0; i < n; ++i) {
+        text[i] = cells[i].ch ? (char) cells[i].ch : ' ';
+        if (text[i] != ' ')
+            len = i + 1;
+    }
+    text[len] = '\0';
+    return len;
+}
+
+// reads scrollback line `nr` (see VTSearch) into s->text
+static size_t history_line(VTSearch* s, size_t nr)
+{
+    INT n = vt_scrollback_row(s->vt, s->indexed_total - 1 - nr, s->row, ROW_MAX, NULL);
+    return row_to_text(s->row, n, s->text);
+}
+
+// indexes the scrollback lines added since the last search, and forgets the ones the VT no longer has; false if the
+// index couldn't be allocated (it's then rebuilt on the next search)
+static bool update_index(VTSearch* s)
+{
+    size_t total = vt_scrollback_total(s->vt);
+    size_t available = vt_scrollback_lines(s->vt);
+    size_t first_new = total - available > s->indexed_total ? total - available : s->indexed_total;
+
+    s->indexed_total = total;
+    s->history_first = total - available;
+    for (size_t nr = first_new; nr < total; ++nr) {
+        if (!index_line(s, nr, s->text, history_line(s, nr))) {
+            postings_free(s);
+            s->indexed_total = s->index_first = 0;
+            return false;
+        }
+    }
+
+    if (s->history_first > s->index_first && (s->history_first - s->index_first) * 2 >= total - s->index_first)
+        postings_prune(s);
+    return true;
+}
+
+//
+// matching
+//
+
+static const char* find_substring(const char* hay, size_t n, const char* needle, size_t m)
+{
+    if (m == 0 || m > n)
+        return NULL;
+
+    size_t i = 0;
+#ifdef __SSE2__
+    // compare the first and last byte of the needle against 16 positions at a time, and only then the whole needle
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *) &hay[i]);
+        __m128i block_last = _mm_loadu_si128((const __m128i *) &hay[i + m - 1]);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(&hay[i + bit], needle, m) == 0)
+                return &hay[i + bit];
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while (i + m <= n) {
+        const char* p = memchr(&hay[i], needle[0], n - m + 1 - i);
+        if (!p)
+            return NULL;
+        if (memcmp(p, needle, m) == 0)
+            return p;
+        i = p - hay + 1;
+    }
+    return NULL;
+}
+
+static bool add_match(VTSearch* s, long row, size_t start, size_t end)
+{
+    if (s->max_matches && s->match_count == s->max_matches)
+        return false;
+    if (s->match_count == s->match_capacity) {
+        size_t capacity = s->match_capacity ? s->match_capacity * 2 : 64;
+        VTSearchMatch* matches = realloc(s->matches, capacity * sizeof(VTSearchMatch));
+        if (!matches)
+            return false;       // out of memory: the search stops with the matches found so far
+        s->matches = matches;
+        s->match_capacity = capacity;
+    }
+    s->matches[s->match_count++] = (VTSearchMatch) { .row = row, .column_start = start, .column_end = end };
+    return true;
+}
+
+static bool search_line(VTSearch* s, long row, const char* line, size_t len)
+{
+    if (s->flags & VTS_REGEX) {
+        regmatch_t m;
+        size_t pos = 0;
+        while (pos <= len && regexec(&s->regex, &line[pos], 1, &m, pos > 0 ? REG_NOTBOL : 0) == 0) {
+            if (m.rm_eo > m.rm_so && !add_match(s, row, pos + m.rm_so, pos + m.rm_eo - 1))
+                return false;
+            pos += (m.rm_eo > 0) ? m.rm_eo : 1;
+        }
+        return true;
+    }
+
+    if (s->flags & VTS_IGNORE_CASE) {
+        if (len > s->scratch_capacity) {
+            char* scratch = realloc(s->scratch, len);
+            if (!scratch)
+                return false;
+            s->scratch = scratch;
+            s->scratch_capacity = len;
+        }
+        for (size_t i = 0; i < len; ++i)
+            s->scratch[i] = (char) tolower((uint8_t) line[i]);
+        line = s->scratch;
+    }
+
+    size_t pos = 0;
+    const char* found;
+    while ((found = find_substring(&line[pos], len - pos, s->pattern, s->pattern_len))) {
+        size_t start = found - line;
+        if (!add_match(s, row, start, start + s->pattern_len - 1))
+            return false;
+        pos = start + s->pattern_len;
+    }
+    return true;
+}
+
+static void* search_thread(void* data)
+{
+    VTSearch* s = data;
+
+    if (update_index(s) && !(s->flags & VTS_REGEX) && s->pattern_len >= 3) {
+        // only lines that contain the least common trigram of the pattern need to be looked at
+        Posting const* candidates = NULL;
+        for (size_t i = 0; i + 3 <= s->pattern_len; ++i) {
+            Posting const* p = s->postings ? posting_slot(s->postings, s->postings_capacity, trigram(&s->pattern[i])) : NULL;
+            if (!p || p->trigram == 0)
+                goto screen;
+            if (!candidates || p->count < candidates->count)
+                candidates = p;
+        }
+        for (uint32_t i = 0; i < candidates->count && !atomic_load(&s->cancel); ++i) {
+            size_t nr = candidates->lines[i];
+            if (nr < s->history_first)
+                continue;
+            if (!search_line(s, -(long) (s->indexed_total - nr), s->text, history_line(s, nr)))
+                goto done;
+        }
+    } else {
+        for (size_t line = vt_scrollback_lines(s->vt); line-- > 0 && !atomic_load(&s->cancel); ) {
+            INT n = vt_scrollback_row(s->vt, line, s->row, ROW_MAX, NULL);
+            if (!search_line(s, -(long) (line + 1), s->text, row_to_text(s->row, n, s->text)))
+                goto done;
+        }
+    }
+
+screen:
+    for (INT row = 0; row < s->screen_rows && !atomic_load(&s->cancel); ++row) {
+        const char* line = &s->screen[row * (s->screen_columns + 1)];
+        if (!search_line(s, (long) row, line, strlen(line)))
+            goto done;
+    }
+
+done:
+    atomic_store(&s->done, true);
+    return NULL;
+}
+
+// the screen is copied on the caller's thread, so the worker only reads the scrollback (see libvirtterm_search.h)
+static bool snapshot_screen(VTSearch* s)
+{
+    INT rows = vt_rows(s->vt), columns = vt_columns(s->vt);
+    size_t sz = (size_t) rows * (columns + 1);
+    if (sz > s->screen_capacity) {
+        char* screen = realloc(s->screen, sz);
+        if (!screen)
+            return false;
+        s->screen = screen;
+        s->screen_capacity = sz;
+    }
+    s->screen_rows = rows;
+    s->screen_columns = columns;
+
+    for (INT row = 0; row < rows; ++row) {
+        char* text = &s->screen[row * (columns + 1)];
+        size_t len = 0;
+        for (INT column = 0; column < columns; ++column) {
+            CHAR ch = vt_cell(s->vt, row, column).ch;
+            text[column] = ch ? (char) ch : ' ';
+            if (text[column] != ' ')
+                len = column + 1;
+        }
+        text[len] = '\0';
+    }
+    return true;
+}
+
+//
+// public functions
+//
+
+VTSearch* vtsearch_new(VT* vt)
+{
+    VTSearch* s = calloc(1, sizeof(VTSearch));
+    if (!s)
+        return NULL;
+    s->vt = vt;
+    s->row = malloc(ROW_MAX * sizeof(VTCell));
+    s->text = malloc(ROW_MAX + 1);
+    if (!s->row || !s->text) {
+        free(s->row);
+        free(s->text);
+        free(s);
+        return NULL;
+    }
+    atomic_init(&s->cancel, false);
+    atomic_init(&s->done, true);
+    return s;
+}
+
+static void vtsearch_reset_pattern(VTSearch* s)
+{
+    free(s->pattern);
+    s->pattern = NULL;
+    if (s->regex_compiled)
+        regfree(&s->regex);
+    s->regex_compiled = false;
+}
+
+void vtsearch_free(VTSearch* s)
+{
+    if (!s)
+        return;
+    vtsearch_cancel(s);
+    vtsearch_reset_pattern(s);
+    postings_free(s);
+    free(s->scratch);
+    free(s->matches);
+    free(s->row);
+    free(s->text);
+    free(s->screen);
+    free(s);
+}
+
+bool vtsearch_start(VTSearch* s, const char* pattern, int flags, size_t max_matches)
+{
+    vtsearch_cancel(s);
+    vtsearch_reset_pattern(s);
+    s->match_count = 0;
+
+    if (flags & VTS_REGEX) {
+        if (regcomp(&s->regex, pattern, REG_EXTENDED | ((flags & VTS_IGNORE_CASE) ? REG_ICASE : 0)) != 0)
+            return false;
+        s->regex_compiled = true;
+    }
+
+    if (!(s->pattern = strdup(pattern)))
+        return false;
+    s->pattern_len = strlen(pattern);
+    if (flags & VTS_IGNORE_CASE)
+        for (size_t i = 0; i < s->pattern_len; ++i)
+            s->pattern[i] = (char) tolower((uint8_t) s->pattern[i]);
+    s->flags = flags;
+    s->max_matches = max_matches;
+    if (!snapshot_screen(s))
+        return false;
+
+    atomic_store(&s->cancel, false);
+    atomic_store(&s->done, false);
+    if (pthread_create(&s->thread, NULL, search_thread, s) != 0) {
+        search_thread(s);   // run it here instead
+        return true;
+    }
+    s->running = true;
+    return true;
+}
+
+void vtsearch_wait(VTSearch* s)
+{
+    if (s->running) {
+        pthread_join(s->thread, NULL);
+        s->running = false;
+    }
+}
+
+void vtsearch_cancel(VTSearch* s)
+{
+    atomic_store(&s->cancel, true);
+    vtsearch_wait(s);
+}
+
+bool vtsearch_done(VTSearch* s)
+{
+    if (!atomic_load(&s->done))
+        return false;
+    vtsearch_wait(s);
+    return true;
+}
+
+size_t vtsearch_matches(VTSearch* s, VTSearchMatch const** matches)
+{
+    if (!vtsearch_done(s)) {
+        *matches = NULL;
+        return 0;
+    }
+    *matches = s->matches;
+    return s->match_count;
+}
+
+size_t vtsearch_indexed_lines(VTSearch* s)
+{
+    return s->indexed_total - s->history_first;
+}
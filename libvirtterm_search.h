@@ -0,0 +1,38 @@
+#ifndef LIBVIRTTERM_SEARCH_H
+#define LIBVIRTTERM_SEARCH_H
+
+#define _XOPEN_SOURCE 700
+#include "libvirtterm.h"
+
+// Text search over the screen and the scrollback. Scrollback lines are added to a trigram index (which only keeps line
+// numbers) as they are found in the terminal, so repeated searches only read back the lines that can contain the
+// pattern. vtsearch_start() copies the screen; the search itself, and indexing the lines added since the previous
+// one, run on a background thread that reads the scrollback (vt_scrollback_row). Until the search is done (or
+// cancelled), the VT must not be changed in any way - nothing written to it, no resize, no scrollback cleared or backend
+// replaced - but it can still be read from its own thread (rendered, vt_cell, vt_scrollback_row...). The scrollback
+// backend's read() is then called from both threads: the file-backed one (libvirtterm_scrollback.h) allows it.
+
+typedef struct VTSearch VTSearch;
+
+typedef enum VTSearchFlags {
+    VTS_LITERAL = 0, VTS_REGEX = 1, VTS_IGNORE_CASE = 2,
+} VTSearchFlags;
+
+typedef struct VTSearchMatch {
+    long row;               // 0 is the first screen row, -1 is the most recent scrollback line (at the time of the search)
+    INT  column_start;
+    INT  column_end;        // inclusive
+} VTSearchMatch;
+
+VTSearch* vtsearch_new(VT* vt);     // NULL if out of memory
+void      vtsearch_free(VTSearch* s);
+
+bool      vtsearch_start(VTSearch* s, const char* pattern, int flags, size_t max_matches);   // false: bad regex or no memory
+void      vtsearch_cancel(VTSearch* s);
+bool      vtsearch_done(VTSearch* s);
+void      vtsearch_wait(VTSearch* s);
+
+size_t    vtsearch_matches(VTSearch* s, VTSearchMatch const** matches);   // only valid once the search is done
+size_t    vtsearch_indexed_lines(VTSearch* s);
+
+#endif //LIBVIRTTERM_SEARCH_H
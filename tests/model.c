@@ -0,0 +1,557 @@
+// Differential test: random mixes of text and escape sequences are written to a terminal and to a reference model of it,
+// and the screens (characters, attributes, wrapped lines), cursor and modes are compared. The model is deliberately
+// naive - a grid of cells, one cell at a time, no hashes or bulk paths - so that the optimized code has something simple
+// to be checked against. A failing input is shrunk to the smallest one that still fails before being reported.
+//
+//   libvirtterm-model               MODEL_RUNS random inputs (default 20000) from MODEL_SEED (default 1)
+//   libvirtterm-model FILE...       replay inputs saved in files: the first two bytes are the rows and columns (a
+//                                   failing input is saved like that in model-failure)
+//
+// Left/right margins, character sets, the alternate screen and control strings are not modelled.
+
+#include "../libvirtterm.c"
+
+#include <stdlib.h>
+
+#define MAX_ROWS    24
+#define MAX_COLUMNS 80
+#define MAX_TOKENS  200
+
+//
+// model
+//
+
+typedef struct Model {
+    INT      rows, columns;
+    VTCell   cells[MAX_ROWS][MAX_COLUMNS];
+    bool     wrapped[MAX_ROWS];
+    INT      row, column;           // like the terminal's, one past the last row and column is allowed: column == columns
+    INT      saved_row, saved_column;   // means the next character goes on the next line
+    INT      top, bottom;           // scroll area
+    VTAttrib attrib;
+    bool     insert;
+    CHAR     last_char;             // last graphic character, for REP
+} Model;
+
+static INT clamp(INT v, INT min, INT max)
+{
+    return v < min ? min : v > max ? max : v;
+}
+
+static void model_init(Model* m, INT rows, INT columns)
+{
+    *m = (Model) { .rows = rows, .columns = columns, .bottom = rows - 1 };
+    m->attrib = (VTAttrib) { .fg_color = VT_WHITE, .bg_color = VT_BLACK };
+    for (INT r = 0; r < rows; ++r)
+        for (INT c = 0; c < columns; ++c)
+            m->cells[r][c] = (VTCell) { .ch = ' ', .attrib = m->attrib };
+}
+
+static VTCell model_blank(Model* m)
+{
+    return (VTCell) { .ch = ' ', .attrib = m->attrib };
+}
+
+static void model_move(Model* m, INT row, INT column)
+{
+    m->row = clamp(row, 0, m->rows);
+    m->column = clamp(column, 0, m->columns);
+}
+
+// erases from one position to another, in reading order
+static void model_erase(Model* m, INT row_start, INT column_start, INT row_end, INT column_end)
+{
+    INT from = clamp(row_start, 0, m->rows - 1) * m->columns + clamp(column_start, 0, m->columns - 1);
+    INT to = clamp(row_end, 0, m->rows - 1) * m->columns + clamp(column_end, 0, m->columns - 1);
+    for (INT i = from; i <= to; ++i)
+        m->cells[i / m->columns][i % m->columns] = model_blank(m);
+}
+
+// n > 0 moves the rows up, n < 0 down
+static void model_scroll(Model* m, INT top, INT bottom, INT n)
+{
+    top = MAX(top, 0);
+    bottom = MIN(bottom, m->rows - 1);
+    if (n == 0 || top > bottom)
+        return;
+
+    INT k = MIN(abs(n), bottom - top + 1);
+    if (n > 0) {
+        for (INT r = top; r <= bottom; ++r) {
+            for (INT c = 0; c < m->columns; ++c)
+                m->cells[r][c] = r + k <= bottom ? m->cells[r + k][c] : model_blank(m);
+            m->wrapped[r] = r + k <= bottom ? m->wrapped[r + k] : false;
+        }
+    } else {
+        for (INT r = bottom; r >= top; --r) {
+            for (INT c = 0; c < m->columns; ++c)
+                m->cells[r][c] = r - k >= top ? m->cells[r - k][c] : model_blank(m);
+            m->wrapped[r] = r - k >= top ? m->wrapped[r - k] : false;
+        }
+    }
+}
+
+// n > 0 moves the cells from the column to the end of the line right, n < 0 left
+static void model_shift(Model* m, INT row, INT column, INT n)
+{
+    if (row >= m->rows || column >= m->columns || n == 0)
+        return;
+
+    INT k = MIN(abs(n), m->columns - column);
+    if (n > 0)
+        for (INT c = m->columns - 1; c >= column; --c)
+            m->cells[row][c] = c - k >= column ? m->cells[row][c - k] : model_blank(m);
+    else
+        for (INT c = column; c < m->columns; ++c)
+            m->cells[row][c] = c + k < m->columns ? m->cells[row][c + k] : model_blank(m);
+}
+
+static void model_line_feed(Model* m)
+{
+    model_move(m, m->row + 1, m->column);
+    if (m->row > m->bottom) {
+        model_scroll(m, m->top, m->bottom, 1);
+        model_move(m, m->row - 1, m->column);
+    }
+}
+
+static void model_graphic_char(Model* m, CHAR c)
+{
+    if (m->column >= m->columns) {
+        if (m->row < m->rows)
+            m->wrapped[m->row] = true;
+        m->column = 0;
+        ++m->row;
+    }
+    if (m->row > m->bottom) {       // below the scroll area too: each character scrolls it
+        model_scroll(m, m->top, m->bottom, 1);
+        model_move(m, m->row - 1, m->column);
+    }
+
+    if (m->insert)
+        model_shift(m, m->row, m->column, 1);
+    m->cells[MIN(m->row, m->rows - 1)][m->column] = (VTCell) { .ch = c, .attrib = m->attrib };   // the cursor may be below the last row
+    model_move(m, m->row, m->column + 1);
+    m->last_char = c;
+}
+
+static void model_tab(Model* m, INT n)
+{
+    INT column = MIN(m->column, m->columns - 1);
+    for (; n > 0 && column < m->columns - 1; --n)
+        column = MIN((column / 8 + 1) * 8, m->columns - 1);
+    for (; n < 0 && column > 0; ++n)
+        column = (column - 1) / 8 * 8;
+    model_move(m, m->row, column);
+}
+
+static void model_char(Model* m, CHAR c)
+{
+    switch (c) {
+        case '\r': model_move(m, m->row, 0); break;
+        case '\n': model_line_feed(m); break;
+        case '\b': model_move(m, m->row, m->column - 1); break;
+        case '\t': model_tab(m, 1); break;
+        default:   model_graphic_char(m, c);
+    }
+}
+
+static void model_sgr(Model* m, INT p)
+{
+    VTAttrib* a = &m->attrib;
+    if (p == 0)
+        *a = (VTAttrib) { .fg_color = VT_WHITE, .bg_color = VT_BLACK };
+    else if (p == 1) a->bold = true;
+    else if (p == 4) a->underline = true;
+    else if (p == 5) a->blink = true;
+    else if (p == 7) a->reverse = true;
+    else if (p == 22) a->bold = a->dim = false;
+    else if (p == 24) a->underline = false;
+    else if (p == 27) a->reverse = false;
+    else if (p >= 30 && p <= 37) a->fg_color = p - 30;
+    else if (p == 39) a->fg_color = VT_WHITE;
+    else if (p >= 40 && p <= 47) a->bg_color = p - 40;
+    else if (p == 49) a->bg_color = VT_BLACK;
+    else if (p >= 90 && p <= 97) a->fg_color = p - 90 + 8;
+}
+
+//
+// inputs: a list of tokens, each applied to the model as it's generated
+//
+
+typedef struct Token {
+    char   bytes[96];
+    size_t sz;
+} Token;
+
+typedef struct Case {
+    INT      rows, columns;
+    Token    tokens[MAX_TOKENS];
+    size_t   n_tokens;
+    uint64_t chunk_seed;            // how the input is split into writes
+} Case;
+
+static uint64_t rng;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static INT random_param(Case* c)
+{
+    switch (next_random() % 4) {
+        case 0:  return 0;                                          // default
+        case 1:  return 1;
+        default: return next_random() % (MAX(c->rows, c->columns) + 4);
+    }
+}
+
+static void generate_token(Case* c, Token* t)
+{
+    static const char csi_final[] = "ABCDEFGdHJKLMST@PXbIZ";
+    static const int sgr[] = { 0, 1, 4, 5, 7, 22, 24, 27, 30, 31, 34, 37, 39, 40, 42, 47, 49, 91, 97 };
+
+    int n = 0;
+    switch (next_random() % 12) {
+        case 0: case 1: case 2: {                                   // text, sometimes long enough to wrap
+            size_t len = next_random() % 2 ? next_random() % 8 + 1 : next_random() % (sizeof t->bytes - 1) + 1;
+            for (size_t i = 0; i < len; ++i)
+                t->bytes[i] = next_random() % 8 ? (char) (next_random() % 95 + 0x20) : (char) (next_random() % 0x60 + 0xa0);
+            n = len;
+            break;
+        }
+        case 3:
+            n = sprintf(t->bytes, "%c", "\r\n\b\t"[next_random() % 4]);
+            break;
+        case 4: case 5: case 6: {
+            char final = csi_final[next_random() % (sizeof csi_final - 1)];
+            if (final == 'J' || final == 'K')
+                n = sprintf(t->bytes, "\e[%d%c", (int) (next_random() % 3), final);
+            else if (final == 'H' && next_random() % 2)
+                n = sprintf(t->bytes, "\e[%d;%dH", random_param(c), random_param(c));
+            else if (next_random() % 4 == 0)
+                n = sprintf(t->bytes, "\e[%c", final);
+            else
+                n = sprintf(t->bytes, "\e[%d%c", random_param(c), final);
+            break;
+        }
+        case 7: {
+            n = sprintf(t->bytes, "\e[");
+            for (int i = next_random() % 3; i >= 0; --i)
+                n += sprintf(&t->bytes[n], "%d%s", sgr[next_random() % (sizeof sgr / sizeof sgr[0])], i ? ";" : "m");
+            break;
+        }
+        case 8:
+            if (next_random() % 3 == 0) {
+                n = sprintf(t->bytes, "\e[r");
+            } else {
+                INT top = next_random() % c->rows + 1, bottom = next_random() % c->rows + 1;
+                if (top == bottom)
+                    return generate_token(c, t);
+                n = sprintf(t->bytes, "\e[%d;%dr", MIN(top, bottom), MAX(top, bottom));
+            }
+            break;
+        case 9:
+            n = sprintf(t->bytes, "\e[4%c", next_random() % 2 ? 'h' : 'l');
+            break;
+        case 10: case 11:
+            n = sprintf(t->bytes, "\e%c", "78M"[next_random() % 3]);
+            break;
+    }
+    t->sz = n;
+}
+
+static void model_csi(Model* m, INT const* args, int argn, char final)
+{
+    INT a = args[0], n = a == 0 ? 1 : a;
+    switch (final) {
+        case 'A': model_move(m, m->row - n, m->column); break;
+        case 'B': model_move(m, m->row + n, m->column); break;
+        case 'C': model_move(m, m->row, m->column + n); break;
+        case 'D': model_move(m, m->row, m->column - n); break;
+        case 'E': model_move(m, m->row + n, 0); break;
+        case 'F': model_move(m, m->row - n, 0); break;
+        case 'G': model_move(m, m->row, a - 1); break;
+        case 'd': model_move(m, a - 1, m->column); break;
+        case 'H': model_move(m, a - 1, (argn > 1 ? args[1] : 0) - 1); break;
+        case 'J':
+            if (a == 0) {
+                model_erase(m, m->row, m->column, m->rows - 1, m->columns - 1);
+                for (INT r = m->row; r < m->rows; ++r)
+                    m->wrapped[r] = false;
+            } else if (a == 1) {
+                model_erase(m, 0, 0, m->row, m->column);
+            } else {
+                model_erase(m, 0, 0, m->rows - 1, m->columns - 1);
+                memset(m->wrapped, 0, sizeof m->wrapped);
+            }
+            break;
+        case 'K':
+            if (a != 1 && m->row < m->rows)
+                m->wrapped[m->row] = false;
+            model_erase(m, m->row, a == 0 ? m->column : 0, m->row, a == 1 ? m->column : m->columns - 1);
+            break;
+        case 'L':
+        case 'M':
+            if (m->row >= m->top && m->row <= m->bottom && m->column < m->columns)
+                model_scroll(m, m->row, m->bottom, final == 'L' ? -n : n);
+            break;
+        case 'S': model_scroll(m, m->top, m->bottom, n); break;
+        case 'T': model_scroll(m, m->top, m->bottom, -n); break;
+        case '@': model_shift(m, m->row, m->column, n); break;
+        case 'P': model_shift(m, m->row, m->column, -n); break;
+        case 'X': model_erase(m, m->row, m->column, m->row, MIN(m->column + n - 1, m->columns - 1)); break;
+        case 'b':
+            for (INT i = 0; i < n && m->last_char; ++i)
+                model_graphic_char(m, m->last_char);
+            break;
+        case 'I': model_tab(m, n); break;
+        case 'Z': model_tab(m, -n); break;
+        case 'r':
+            m->top = argn > 1 ? a - 1 : 0;
+            m->bottom = argn > 1 ? args[1] - 1 : m->rows - 1;
+            model_move(m, 0, 0);
+            break;
+        case 'm':
+            for (int i = 0; i < argn; ++i)
+                model_sgr(m, args[i]);
+            break;
+        case 'h': m->insert = true; break;
+        case 'l': m->insert = false; break;
+    }
+}
+
+static void model_token(Model* m, Token const* t)
+{
+    if (t->bytes[0] != '\e') {
+        for (size_t i = 0; i < t->sz; ++i)
+            model_char(m, t->bytes[i]);
+    } else if (t->bytes[1] == '[') {
+        INT args[8] = { 0 };
+        int argn = 0;
+        const char* p = &t->bytes[2];
+        while (*p >= '0' && *p <= '9') {
+            args[argn++] = strtol(p, (char **) &p, 10);
+            if (*p == ';')
+                ++p;
+        }
+        model_csi(m, args, argn ? argn : 1, *p);
+    } else if (t->bytes[1] == '7') {
+        m->saved_row = m->row;
+        m->saved_column = m->column;
+    } else if (t->bytes[1] == '8') {
+        m->row = m->saved_row;
+        m->column = m->saved_column;
+    } else if (t->bytes[1] == 'M') {
+        if (m->row == m->top)
+            model_scroll(m, m->top, m->bottom, -1);
+        else
+            model_move(m, m->row - 1, m->column);
+    }
+}
+
+//
+// comparison
+//
+
+static bool same_cell(VTCell a, VTCell b)
+{
+    return a.ch == b.ch && attrib_eq(a.attrib, b.attrib) && a.link == b.link;
+}
+
+// NULL if the terminal and the model agree, or what's different
+static const char* compare(VT* vt, Model* m, char* buf, size_t sz)
+{
+    for (INT r = 0; r < m->rows; ++r) {
+        for (INT c = 0; c < m->columns; ++c)
+            if (!same_cell(vt->matrix[r * vt->columns + c], m->cells[r][c]))
+                return snprintf(buf, sz, "cell %d,%d: '%c' in the terminal, '%c' in the model", r, c,
+                                vt->matrix[r * vt->columns + c].ch, m->cells[r][c].ch), buf;
+        if (vt->wrapped[r] != m->wrapped[r])
+            return snprintf(buf, sz, "wrapped flag of row %d", r), buf;
+    }
+    if (vt->cursor.row != m->row || vt->cursor.column != m->column)
+        return snprintf(buf, sz, "cursor: %d,%d in the terminal, %d,%d in the model", vt->cursor.row, vt->cursor.column, m->row, m->column), buf;
+    if (vt->scroll_area_top != m->top || vt->scroll_area_bottom != m->bottom)
+        return "scroll area";
+    if (vt->insert_mode != m->insert)
+        return "insert mode";
+    if (!attrib_eq(vt->current_attrib, m->attrib))
+        return "current attributes";
+    if (vt->esc_buffer[0])
+        return "escape sequence not finished";
+    return NULL;
+}
+
+static const char* run_case(Case* c, char* buf, size_t sz)
+{
+    size_t n = 0;
+    static char input[MAX_TOKENS * sizeof(Token)];
+    for (size_t i = 0; i < c->n_tokens; ++i) {
+        memcpy(&input[n], c->tokens[i].bytes, c->tokens[i].sz);
+        n += c->tokens[i].sz;
+    }
+
+    Model m;
+    model_init(&m, c->rows, c->columns);
+    for (size_t i = 0; i < c->n_tokens; ++i)
+        model_token(&m, &c->tokens[i]);
+
+    VTConfig config = VT_DEFAULT_CONFIG;
+    VT* vt = vt_new(c->rows, c->columns, &config, NULL);
+    uint64_t saved_rng = rng;
+    rng = c->chunk_seed;
+    for (size_t i = 0; i < n; ) {                                  // split anywhere, even inside sequences
+        size_t chunk = MIN(next_random() % 64 + 1, n - i);
+        vt_write(vt, &input[i], chunk);
+        while (vt_next_event(vt, NULL));
+        i += chunk;
+    }
+    rng = saved_rng;
+
+    const char* difference = compare(vt, &m, buf, sz);
+    vt_free(vt);
+    return difference;
+}
+
+//
+// shrinking: drop tokens, then shorten the ones left, as long as the input still fails
+//
+
+static void shrink(Case* c)
+{
+    char buf[256];
+    Case* smaller = malloc(sizeof(Case));
+    for (size_t chunk = c->n_tokens / 2; chunk >= 1; chunk /= 2) {
+        for (size_t i = 0; i + chunk <= c->n_tokens; ) {
+            *smaller = *c;
+            memmove(&smaller->tokens[i], &smaller->tokens[i + chunk], (c->n_tokens - i - chunk) * sizeof(Token));
+            smaller->n_tokens -= chunk;
+            if (run_case(smaller, buf, sizeof buf))
+                *c = *smaller;
+            else
+                i += chunk;
+        }
+    }
+    for (size_t i = 0; i < c->n_tokens; ++i) {
+        while (c->tokens[i].bytes[0] != '\e' && c->tokens[i].sz > 1) {
+            *smaller = *c;
+            --smaller->tokens[i].sz;
+            if (!run_case(smaller, buf, sizeof buf))
+                break;
+            *c = *smaller;
+        }
+    }
+    free(smaller);
+}
+
+static void print_case(Case* c)
+{
+    printf("%d rows, %d columns: \"", c->rows, c->columns);
+    for (size_t i = 0; i < c->n_tokens; ++i) {
+        for (size_t j = 0; j < c->tokens[i].sz; ++j) {
+            uint8_t b = c->tokens[i].bytes[j];
+            if (b == '\e')                printf("\\e");
+            else if (b == '"' || b == '\\') printf("\\%c", b);
+            else if (b >= 0x20 && b < 0x7f)  printf("%c", b);
+            else                              printf("\\x%02x", b);
+        }
+    }
+    printf("\"\n");
+}
+
+static bool check(Case* c)
+{
+    char buf[256];
+    const char* difference = run_case(c, buf, sizeof buf);
+    if (!difference)
+        return true;
+    shrink(c);
+    difference = run_case(c, buf, sizeof buf);
+    printf("model and terminal differ (%s) with:\n  ", difference);
+    print_case(c);
+
+    FILE* f = fopen("model-failure", "wb");                         // to replay it
+    if (f) {
+        fputc(c->rows, f);
+        fputc(c->columns, f);
+        for (size_t i = 0; i < c->n_tokens; ++i)
+            fwrite(c->tokens[i].bytes, 1, c->tokens[i].sz, f);
+        fclose(f);
+        printf("  saved in model-failure\n");
+    }
+    return false;
+}
+
+static bool escape_complete(Token const* t)
+{
+    if (t->bytes[0] != '\e' || t->sz < 2)
+        return false;
+    if (t->bytes[1] != '[')
+        return true;
+    uint8_t last = t->bytes[t->sz - 1];
+    return t->sz > 2 && last >= 0x40 && last <= 0x7e;
+}
+
+static bool replay_file(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    static Case c;
+    uint8_t size[2];
+    c = (Case) { .chunk_seed = 1 };
+    if (fread(size, 1, 2, f) != 2)
+        exit(1);
+    c.rows = clamp(size[0], 1, MAX_ROWS);
+    c.columns = clamp(size[1], 1, MAX_COLUMNS);
+
+    // each escape sequence or run of other bytes becomes a token, so the model parses it the same way
+    int ch;
+    while ((ch = fgetc(f)) != EOF) {
+        Token* t = &c.tokens[c.n_tokens];
+        if (t->sz > 0 && (ch == '\e' || escape_complete(t) || t->sz == sizeof t->bytes - 1)) {
+            if (++c.n_tokens == MAX_TOKENS)
+                break;
+            t = &c.tokens[c.n_tokens];
+        }
+        t->bytes[t->sz++] = ch;
+    }
+    if (c.n_tokens < MAX_TOKENS && c.tokens[c.n_tokens].sz > 0)
+        ++c.n_tokens;
+    fclose(f);
+    return check(&c);
+}
+
+int main(int argc, char* argv[])
+{
+    bool ok = true;
+    for (int i = 1; i < argc; ++i)
+        ok &= replay_file(argv[i]);
+    if (argc > 1)
+        return ok ? 0 : 1;
+
+    const char* seed = getenv("MODEL_SEED");
+    const char* runs = getenv("MODEL_RUNS");
+    rng = seed ? strtoull(seed, NULL, 10) | 1 : 1;
+    long n_runs = runs ? atol(runs) : 20000;
+
+    static Case c;
+    for (long run = 0; run < n_runs; ++run) {
+        c = (Case) { .rows = next_random() % MAX_ROWS + 1, .columns = next_random() % MAX_COLUMNS + 1 };
+        c.chunk_seed = next_random() | 1;
+        c.n_tokens = next_random() % MAX_TOKENS + 1;
+        for (size_t i = 0; i < c.n_tokens; ++i)
+            generate_token(&c, &c.tokens[i]);
+        if (!check(&c))
+            return 1;
+    }
+    printf("%ld inputs, terminal and model agree\n", n_runs);
+    return 0;
+}
@@ -1,12 +1,15 @@
+#include "../libvirtterm_scrollback.c"
+#include "../libvirtterm_search.c"
+#include "../libvirtterm_render.c"
 #include "../libvirtterm.c"
 
 #include <assert.h>
 #include <string.h>
 
-#define R { vt_reset(vt); }                                    // reset
-#define W(str) { vt_step(vt, str, strlen(str)); }              // write to screen
+#define R { vt_reset(vt); while (vt_next_event(vt, NULL)); }  // reset
+#define W(str) { vt_write(vt, str, strlen(str)); }             // write to screen
 #define A(v) { assert(v); }                                    // assert
-#define ACH(r, c, cmp) { A(vt_char(vt, r, c).ch == cmp); }     // assert char in r,c is cmp
+#define ACH(r, c, cmp) { A(vt_cell(vt, r, c).ch == cmp); }     // assert char in r,c is cmp
 #define ACU(r, c) { A(vt_cursor(vt).row == r && vt_cursor(vt).column == c); } // assert cursor is in r,c
 #define CMP(r, c, txt) { for (size_t i = 0; i < strlen(txt); ++i) A(vt->matrix[r * vt->columns + c + i].ch == txt[i]); }  // assert if screen text is this
 #define P { vt_print(vt); }
@@ -24,6 +27,157 @@
     printf("+--------------------+\n");
 }
 
+static void collect_text(const char* text, size_t sz, void* data)
+{
+    char* buf = data;
+    size_t len = strlen(buf);
+    memcpy(&buf[len], text, sz);
+    buf[len + sz] = '\0';
+}
+
+static const char* selection_text(VT* vt, VTTextFormat format)
+{
+    static char buf[1024];
+    buf[0] = '\0';
+    vt_selection_text(vt, format, collect_text, buf);
+    return buf;
+}
+
+typedef struct Runs { int n; INT column[32]; size_t sz[32]; VTAttrib attrib[32]; char text[256]; } Runs;
+
+static void collect_run(INT row, INT column, CHAR const* chars, size_t n, VTAttrib attrib, void* data)
+{
+    (void) row;
+    Runs* runs = data;
+    runs->column[runs->n] = column;
+    runs->sz[runs->n] = n;
+    runs->attrib[runs->n++] = attrib;
+    strncat(runs->text, (const char *) chars, n);
+}
+
+// threads: each thread parses its own terminals, each one with its own arena
+
+#define STRESS_VTS     64
+#define STRESS_THREADS 16
+
+static void stress_parse(VT* vt, int seed)
+{
+    char buf[64];
+    for (int i = 0; i < 400; ++i) {
+        int n = snprintf(buf, sizeof buf, "\e[%d;%dH\e[3%d;4%dmline %d of %d\e[0m", (i * 7 + seed) % 24 + 1,
+                         (i * 13) % 70 + 1, i % 8, (i + seed) % 8, i, seed);
+        vt_write(vt, buf, n);
+        if (i % 50 == 0)
+            W("\e[24;1H\n\n\e[2;20r\e[3S\e[r")
+        while (vt_next_event(vt, NULL));
+    }
+}
+
+static uint64_t stress_hash(VT* vt)
+{
+    uint64_t h = 0;
+    for (INT row = 0; row < vt->rows; ++row)
+        h = h * 31 + vt_row_hash(vt, row);
+    return h;
+}
+
+typedef struct StressThread {
+    pthread_t thread;
+    int       first_vt;
+    uint64_t  hashes[STRESS_VTS / STRESS_THREADS];
+} StressThread;
+
+static void* stress_thread(void* data)
+{
+    StressThread* t = data;
+    VTConfig config = VT_DEFAULT_CONFIG;
+    for (int i = 0; i < STRESS_VTS / STRESS_THREADS; ++i) {
+        void* memory = malloc(256 * 1024);
+        VTAllocator allocator = vt_arena_allocator(vt_arena_new(memory, 256 * 1024));
+        VT* vt = vt_new(24, 80, &config, &allocator);
+        stress_parse(vt, t->first_vt + i);
+        t->hashes[i] = stress_hash(vt);
+        vt_free(vt);
+        free(memory);
+    }
+    return NULL;
+}
+
+// tracing: a thread writes a known stream while the trace is read from another one, which must only ever see
+// consecutive bytes of it
+
+typedef struct TraceThread {
+    pthread_t   thread;
+    VT*         vt;
+    atomic_bool done;
+} TraceThread;
+
+static void* trace_writer(void* data)
+{
+    TraceThread* t = data;
+    char buf[1000];
+    for (int i = 0; i < 2000; ++i) {
+        for (size_t j = 0; j < sizeof buf; ++j)
+            buf[j] = (char) ('a' + (i * sizeof buf + j) % 26);
+        vt_write(t->vt, buf, sizeof buf);
+        while (vt_next_event(t->vt, NULL));
+    }
+    atomic_store(&t->done, true);
+    return NULL;
+}
+
+// kernels: every version is compared to the scalar one, and terminals using them must end up identical
+
+static uint64_t kernel_rng = 88172645463325252ull;
+
+static uint8_t kernel_random(void)
+{
+    kernel_rng ^= kernel_rng << 13;
+    kernel_rng ^= kernel_rng >> 7;
+    kernel_rng ^= kernel_rng << 17;
+    return (uint8_t) kernel_rng;
+}
+
+static void kernel_compare(VTKernels const* k)
+{
+    static uint8_t data[300];
+    static VTCell a[300], b[300];
+    for (int round = 0; round < 2000; ++round) {
+        size_t offset = kernel_random() % 40, sz = kernel_random() % 200 + kernel_random() % 60;
+        for (size_t i = 0; i < sizeof data; ++i)                    // a control character now and then
+            data[i] = kernel_random() % 64 == 0 ? kernel_random() % 0x20 : kernel_random() % 0xe0 + 0x20;
+        A(k->text_run(&data[offset], sz) == kernels_scalar.text_run(&data[offset], sz))
+
+        VTCell value = { .ch = kernel_random(), .attrib = { .fg_color = kernel_random() % 16, .bold = true }, .link = kernel_random() };
+        memset(a, 0xaa, sizeof a); memset(b, 0xaa, sizeof b);
+        k->fill_cells(&a[offset], value, sz);
+        kernels_scalar.fill_cells(&b[offset], value, sz);
+        A(memcmp(a, b, sizeof a) == 0)                              // nothing written past the end either
+
+        memset(a, 0, sizeof a);
+        for (int i = kernel_random() % 4; i > 0; --i) {
+            size_t at = kernel_random() % 300;
+            a[at].ch = 0xff; a[at].link = 0xffff;                   // not attributes
+            switch (kernel_random() % 3) {
+                case 0: a[at].attrib.blink = true; break;
+                case 1: a[at].attrib.fg_color = VT_WHITE; break;
+                case 2: a[at].attrib.italic = true; a[at].attrib.bg_color = VT_RED; break;
+            }
+        }
+        VTAttrib bits = kernel_random() % 2 ? (VTAttrib) { .blink = true } : (VTAttrib) { .fg_color = 1 };
+        A(k->find_attrib(&a[offset], sz, bits) == kernels_scalar.find_attrib(&a[offset], sz, bits))
+    }
+}
+
+static void kernel_parse(VT* vt)
+{
+    W("\e[5mblinking\e[0m plain text that is long enough to wrap around the end of the line\r\n")
+    W("\e]8;;http://x\e\\linked\e]8;;\e\\ \e[4h\e[1;31minserted\e[4l \e(0lqqk\e(B\e[?69h\e[5;30s over the margin\e[?69l")
+    W("\e[H\e[J\x7f\xc3\xa9\e[12;3H\e[1;4;5mmore blinking text\e[0m\e[K\e[10;70H0123456789abcdef\e[20H")
+    for (int i = 0; i < 8; ++i)                                     // scrolls, the blinking cells too
+        W("scrolling \e[7mline\e[0m\tafter a tab\r\n")
+}
+
 int main()
 {
     VTConfig config = VT_DEFAULT_CONFIG;
@@ -40,8 +194,14 @@ int main()
     // escape sequence cursor right
     R W("a\e[2Cb") ACH(0, 0, 'a') ACH(0, 1, ' ') ACH(0, 2, ' ') ACH(0, 3, 'b')
 
+    // sequences found wrong by the model test (tests/model.c)
+    R W("a\e7bc\e8d") CMP(0, 0, "adc")                               // DECSC, DECRC
+    R W("\e[3;5H\e[E") ACU(3, 0) W("\e[2F") ACU(1, 0)                // CNL, CPL
+    R W("abcd\e[3D\e[2X") CMP(0, 0, "a  d") ACU(0, 1)                 // ECH doesn't move the cursor
+    R W("a\r\n\e[2b") CMP(1, 0, "aa") ACU(1, 2)                       // REP repeats the last graphic character
+
     // escape sequence too long
-    R W("\e012345678901234567890123456789012345") ACH(0, 0, '0')
+    R W("\e012345678901234567890123456789012345678901234567890123456789012345678") ACH(0, 0, '0')
 
     // vt_memset
     R vt_memset_ch(vt, 1, 1, 3, 6, 'x');
@@ -116,9 +276,588 @@ int main()
     ACH(0, 1, '0') ACU(9, 19)                         // no scroll for now
     W("x") ACH(0, 1, '1') ACH(9, 0, 'x') ACU(9, 1)   // scroll
 
+    // bracketed paste mode
+    R A(!vt_bracketed_paste(vt)) W("\e[?2004h") A(vt_bracketed_paste(vt)) W("\e[?2004l") A(!vt_bracketed_paste(vt))
+
+    // alternate screen
+    R W("primary\r\n") A(!vt_alternate_screen(vt))
+    W("\e[?1049h") A(vt_alternate_screen(vt)) ACH(0, 0, ' ') ACU(1, 0) W("\e[Halt") ACH(0, 0, 'a')
+    W("\e[?1049l") A(!vt_alternate_screen(vt)) ACH(0, 0, 'p') ACU(1, 0)
+    W("\e[?47h") ACH(0, 0, 'a') W("\e[?47l") ACH(0, 0, 'p')                    // 47 keeps the alternate screen contents
+    W("\e[?1047h") ACH(0, 0, 'a') W("\e[?1047l") W("\e[?47h") ACH(0, 0, ' ') W("\e[?47l")   // 1047 clears it when leaving
+    {
+        VTConfig sb_config = VT_DEFAULT_CONFIG;
+        sb_config.scrollback_lines = 10;
+        VT* vt = vt_new(3, 5, &sb_config, NULL);
+        W("1\r\n2\r\n3\r\n4") A(vt_scrollback_lines(vt) == 1)
+        W("\e[?1049h\r\n\n\n\n") A(vt_scrollback_lines(vt) == 1)            // alternate screen doesn't scroll into the scrollback
+        vt_resize(vt, 4, 6); A(vt_alternate_screen(vt)) W("\e[?1049l") A(!vt_alternate_screen(vt)) ACH(0, 0, ' ')
+        vt_free(vt);
+    }
+
+    // arena allocator
+    {
+        static max_align_t memory[64 * 1024 / sizeof(max_align_t)];
+        VTArena* arena = vt_arena_new(memory, sizeof memory);
+        VTAllocator allocator = vt_arena_allocator(arena);
+        VT* vt = vt_new(10, 20, &config, &allocator);
+        A(vt && vt_arena_used(arena) > 0)
+        size_t used = vt_arena_used(arena);
+        for (int i = 0; i < 100; ++i) {                             // consumed events are reused
+            W("x") while (vt_next_event(vt, NULL));
+        }
+        W("\e]0;a window title that is longer than the initial buffer of the text, so it has to grow\a")
+        VTEvent e; A(vt_next_event(vt, &e) && e.type == VT_EVENT_TEXT_RECEIVED && strlen(e.text_received.text) == 84)
+        free((void *) e.text_received.text);
+        A(vt_arena_used(arena) < used + 1024)
+        vt_free(vt);
+        A(vt_arena_used(arena) == 0 && vt_arena_peak(arena) > used)
+        A(vt_new(200, 200, &config, &allocator) == NULL && vt_arena_used(arena) == 0)   // doesn't fit
+
+        vt = vt_new(10, 20, &config, &allocator);                   // freed blocks are reused
+        used = vt_arena_used(arena);
+        for (int i = 0; i < 1000; ++i) {
+            vt_resize(vt, 10 + i % 5, 20 + i % 7);
+            W("\e]8;;http://example.com/a/link/long/enough/to/matter\e\\link\e]8;;\e\\\e[?1049hx\e[?1049l")
+            while (vt_next_event(vt, NULL)) {}
+        }
+        vt_resize(vt, 10, 20);
+        A(vt_rows(vt) == 10 && vt_columns(vt) == 20 && vt_arena_peak(arena) < 4 * used)
+        vt_free(vt);
+        A(vt_arena_used(arena) == 0)
+    }
+    {
+        // no room for the alternate screen: 1049 leaves the primary one (and the cursor) alone
+        static max_align_t memory[64 * 1024 / sizeof(max_align_t)];
+        VTArena* arena = vt_arena_new(memory, sizeof memory);
+        VTAllocator allocator = vt_arena_allocator(arena);
+        VT* vt = vt_new(24, 80, &config, &allocator);
+        W("important")
+        while (vt_next_event(vt, NULL)) {}
+        size_t used = vt_arena_used(arena);
+        vt_free(vt);
+        arena = vt_arena_new(memory, used + 1024);
+        allocator = vt_arena_allocator(arena);
+        vt = vt_new(24, 80, &config, &allocator);
+        W("important")
+        while (vt_next_event(vt, NULL)) {}
+        W("\e[?1049h") A(!vt_alternate_screen(vt)) ACH(0, 0, 'i') ACU(0, 9)
+        W("\e[?47h") A(!vt_alternate_screen(vt)) W("\e[?1047h") A(!vt_alternate_screen(vt)) ACH(0, 8, 't')
+        vt_free(vt);
+    }
+
+    // independent terminals on several threads give the same results as on a single one
+    {
+        static StressThread threads[STRESS_THREADS];
+        for (int i = 0; i < STRESS_THREADS; ++i) {
+            threads[i].first_vt = i * (STRESS_VTS / STRESS_THREADS);
+            A(pthread_create(&threads[i].thread, NULL, stress_thread, &threads[i]) == 0)
+        }
+        for (int i = 0; i < STRESS_THREADS; ++i)
+            pthread_join(threads[i].thread, NULL);
+
+        for (int i = 0; i < STRESS_VTS; ++i) {
+            VT* vt = vt_new(24, 80, &config, NULL);
+            stress_parse(vt, i);
+            A(stress_hash(vt) == threads[i / (STRESS_VTS / STRESS_THREADS)].hashes[i % (STRESS_VTS / STRESS_THREADS)])
+            vt_free(vt);
+        }
+    }
+
+    // tracing
+    {
+        VTConfig traced = config;
+        traced.trace_records = 10;                                  // rounded up to 16
+        VT* vt = vt_new(10, 20, &traced, NULL);
+        VTTraceRecord t[32];
+        A(vt_trace(vt, t, 32) == 0)
+        W("ab\e[1m")
+        A(vt_trace(vt, t, 32) == 6 && t[0].byte == 'a' && t[0].state == VT_TRACE_TEXT && t[2].byte == '\e' && t[2].state == VT_TRACE_TEXT)
+        A(t[3].state == VT_TRACE_ESCAPE && t[4].action == VT_TRACE_BYTE && t[5].byte == 'm' && t[5].action == VT_TRACE_SEQUENCE)
+        W("\e]0;x\a")
+        VTEvent e; while (vt_next_event(vt, &e)) if (e.type == VT_EVENT_TEXT_RECEIVED) free((void *) e.text_received.text);
+        A(vt_trace(vt, t, 32) == 12 && t[7].state == VT_TRACE_ESCAPE && t[8].state == VT_TRACE_STRING && t[11].byte == '\a')
+        W("\e[1z")
+        A(vt_trace(vt, t, 32) == 16 && t[15].byte == 'z' && t[15].action == VT_TRACE_UNRECOGNIZED)
+        A(vt_trace(vt, t, 2) == 2 && t[1].byte == 'z')              // most recent ones
+        W("0123456789")                                             // wraps around
+        A(vt_trace(vt, t, 32) == 16 && t[6].byte == '0' && t[15].byte == '9')
+
+        char dump[1024] = "";
+        vt_trace_dump(vt, collect_text, dump);
+        A(strstr(dump, "x\\x07") && strstr(dump, "\\e[1z <unrecognized> ") && strstr(dump, "0123456789\n"))
+        vt_free(vt);
+    }
+
+    {
+        VTConfig traced = config;
+        traced.trace_records = 64;
+        static TraceThread t;
+        t.vt = vt_new(10, 20, &traced, NULL);
+        atomic_init(&t.done, false);
+        A(pthread_create(&t.thread, NULL, trace_writer, &t) == 0)
+        VTTraceRecord records[64];
+        size_t reads = 0;
+        while (!atomic_load(&t.done)) {
+            size_t n = vt_trace(t.vt, records, 64);
+            for (size_t i = 1; i < n; ++i)
+                A(records[i].byte == (records[i - 1].byte == 'z' ? 'a' : records[i - 1].byte + 1))
+            reads += n > 0;
+        }
+        pthread_join(t.thread, NULL);
+        A(reads > 0 && vt_trace(t.vt, records, 64) == 64)
+        vt_free(t.vt);
+    }
+
+    // runs of cells with the same attributes
+    {
+        R W("ab\e[1mcd\e[0m\e[7mef\e[0m")
+        Runs runs = {};
+        A(vt_row_runs(vt, 0, collect_run, &runs) == 5 && strcmp(runs.text, "abcdef              ") == 0)
+        A(runs.column[1] == 2 && runs.sz[1] == 2 && runs.attrib[1].fg_color == VT_BRIGHT_WHITE)      // bold is bright
+        A(runs.column[2] == 4 && runs.attrib[2].fg_color == VT_BLACK && runs.attrib[2].bg_color == VT_WHITE)   // reversed
+        A(runs.column[3] == 6 && runs.sz[3] == 1 && runs.attrib[3].bg_color == config.cursor_color)  // cursor
+        A(runs.column[4] == 7 && runs.sz[4] == 13)
+        runs = (Runs) {};
+        A(vt_row_runs(vt, 1, collect_run, &runs) == 1 && runs.sz[0] == 20)
+        A(vt_row_runs(vt, 10, collect_run, &runs) == 0)
+    }
+
+    // SIMD kernels
+    {
+        for (size_t i = 0; i < sizeof vt_all_kernels / sizeof vt_all_kernels[0]; ++i)
+            if (vt_kernels_usable(vt_all_kernels[i]))
+                kernel_compare(vt_all_kernels[i]);
+
+        VT* vt = vt_new(24, 80, &config, NULL);
+        VT* reference = vt_new(24, 80, &config, NULL);
+        reference->kernels = &kernels_scalar;
+        kernel_parse(vt);
+        { VT* vt = reference; kernel_parse(vt); }
+        A(stress_hash(vt) == stress_hash(reference) && vt_cursor(vt).row == vt_cursor(reference).row && vt_cursor(vt).column == vt_cursor(reference).column)
+
+        VTEvent e, f;
+        while (vt_next_event(vt, NULL)) {}
+        while (vt_next_event(reference, NULL)) {}
+        vt->last_blink = reference->last_blink = vt_now_ms() - 10000;     // blinking cells are redrawn
+        vt_timed_operations(vt); vt_timed_operations(reference);
+        int updates = 0;
+        while (vt_next_event(vt, &e)) {
+            A(vt_next_event(reference, &f) && e.type == f.type)
+            if (e.type == VT_EVENT_CELLS_UPDATED)
+                A(memcmp(&e.cells, &f.cells, sizeof e.cells) == 0 && ++updates)
+        }
+        A(!vt_next_event(reference, &f) && updates == 18)
+
+        W("\e[H\e[J\e[2;4r\e[8;1Habc\e[r")                          // text written as a run behaves as character by character
+        ACH(6, 0, 'a') ACH(5, 1, 'b') ACH(4, 2, 'c')
+        vt_free(reference);
+        vt_free(vt);
+    }
+
+    // mouse and focus reports
+    {
+        char buf[64];
+#define MOUSE(r, c, left, right) vt_translate_updated_mouse_state(vt, (VTMouseState) { .row = r, .column = c, .button = { [VTM_LEFT] = left, [VTM_RIGHT] = right } }, buf, sizeof buf)
+#define AM(expr, str) { int n = (expr); A(n == (int) strlen(str) && memcmp(buf, str, n) == 0) }
+        VT* vt = vt_new(10, 300, &config, NULL);
+        AM(MOUSE(1, 2, 1, 0), "") AM(MOUSE(1, 2, 0, 0), "")         // not tracking
+        W("\e[?1000h") AM(MOUSE(1, 2, 0, 0), "") AM(MOUSE(1, 2, 1, 0), "\e[M #\"") AM(MOUSE(1, 3, 1, 0), "") AM(MOUSE(1, 3, 0, 0), "\e[M#$\"")
+        W("\e[?1002h") AM(MOUSE(1, 2, 1, 0), "\e[M #\"") AM(MOUSE(1, 3, 1, 0), "\e[M@$\"") AM(MOUSE(1, 3, 1, 0), "") AM(MOUSE(1, 3, 0, 0), "\e[M#$\"")
+        W("\e[?1006h") AM(MOUSE(1, 2, 0, 1), "\e[<2;3;2M") AM(MOUSE(1, 4, 0, 1), "\e[<34;5;2M") AM(MOUSE(1, 4, 0, 0), "\e[<2;5;2m")
+        AM(MOUSE(1, 5, 0, 0), "")                                   // 1006 only changes the encoding
+        W("\e[?1006$p") A(vt_read_reply(vt, buf, sizeof buf) == 11 && memcmp(buf, "\e[?1006;1$y", 11) == 0)
+        W("\e[?1003h") AM(MOUSE(2, 5, 0, 0), "\e[<35;6;3M")
+        W("\e[?1015h") AM(MOUSE(1, 2, 1, 0), "\e[32;3;2M") AM(MOUSE(1, 2, 0, 0), "\e[35;3;2M")
+        W("\e[?1005h") AM(MOUSE(1, 200, 1, 0), "\e[M \xc3\xa9\"")
+        W("\e[?1005l") AM(MOUSE(1, 250, 0, 0), "")                  // back to X10, which can't encode the column
+        W("\e[?1016h")
+        AM(vt_translate_updated_mouse_state(vt, (VTMouseState) { .row = 1, .column = 2, .x = 15, .y = 7 }, buf, sizeof buf), "\e[<35;16;8M")
+        AM(vt_translate_updated_mouse_state(vt, (VTMouseState) { .row = 1, .column = 2, .x = 16, .y = 7 }, buf, sizeof buf), "\e[<35;17;8M")
+        W("\e[?1016l\e[?1003l\e[?9h")                               // X10 compatibility: presses, without modifiers
+        AM(vt_translate_updated_mouse_state(vt, (VTMouseState) { .row = 1, .column = 2, .button = { 1 }, .mod = VTM_CTRL }, buf, sizeof buf), "\e[M #\"")
+        AM(MOUSE(1, 2, 0, 0), "")
+
+        // the wheel accumulates fractions of a line, and sends every whole line in a single output
+        W("\e[?9l\e[?1000h\e[?1006h")
+        VTMouseState at = { .row = 0, .column = 0 };
+        AM(vt_translate_mouse_wheel(vt, at, 0.4, buf, sizeof buf), "")
+        AM(vt_translate_mouse_wheel(vt, at, 0.4, buf, sizeof buf), "")
+        AM(vt_translate_mouse_wheel(vt, at, 0.4, buf, sizeof buf), "\e[<64;1;1M")
+        AM(vt_translate_mouse_wheel(vt, at, 2.5, buf, sizeof buf), "\e[<64;1;1M\e[<64;1;1M")
+        AM(vt_translate_mouse_wheel(vt, at, -0.5, buf, sizeof buf), "")      // changing direction drops the remainder
+        AM(vt_translate_mouse_wheel(vt, at, -0.6, buf, sizeof buf), "\e[<65;1;1M")
+        A(vt_translate_mouse_wheel(vt, at, 3, buf, 15) == 10)                // only what fits, the rest is kept
+        AM(vt_translate_mouse_wheel(vt, at, 0.1, buf, sizeof buf), "\e[<64;1;1M\e[<64;1;1M")
+
+        AM(vt_translate_focus(vt, true, buf, sizeof buf), "")
+        W("\e[?1004h") AM(vt_translate_focus(vt, true, buf, sizeof buf), "\e[I") AM(vt_translate_focus(vt, false, buf, sizeof buf), "\e[O")
+        R AM(vt_translate_focus(vt, true, buf, sizeof buf), "") AM(MOUSE(1, 2, 1, 0), "")
+#undef AM
+#undef MOUSE
+        vt_free(vt);
+    }
+
+    // control strings
+    {
+        VTConfig str_config = VT_DEFAULT_CONFIG;
+        str_config.max_string_size = 64;
+        VT* vt = vt_new(2, 10, &str_config, NULL);
+        VTEvent e;
+#define TEXT(t, expected) { while (vt_next_event(vt, &e) && e.type != VT_EVENT_TEXT_RECEIVED) {} \
+                            A(e.type == VT_EVENT_TEXT_RECEIVED && e.text_received.type == t && strcmp(e.text_received.text, expected) == 0) \
+                            free((void *) e.text_received.text); }
+        W("\e]0;title\a") TEXT(VTT_WINDOW_TITLE_UPDATED, "title")
+        W("\e]2;other\e\\") TEXT(VTT_WINDOW_TITLE_UPDATED, "other")
+        W("\e]1;icon\a") TEXT(VTT_ICON_TITLE_UPDATED, "icon")
+        W("\e]7;file:///tmp\a") TEXT(VTT_DIRECTORY_HINT_UPDATED, "file:///tmp")
+        W("\e]52;c;aGVsbG8gd29ybGQ=\a") TEXT(VTT_CLIPBOARD_SET, "hello world")
+        W("\e]9;done\a") TEXT(VTT_NOTIFICATION, "done")
+        W("\e]777;notify;Build;finished\a") TEXT(VTT_NOTIFICATION, "Build\nfinished")
+        W("\e]0;split ") W("across writes\a") TEXT(VTT_WINDOW_TITLE_UPDATED, "split across writes")
+        W("\e]4;1;rgb:ff/80/00;2;#102030\a") A(vt_color_rgb(vt, VT_RED) == 0xff8000 && vt_color_rgb(vt, VT_GREEN) == 0x102030)
+        W("\e]4;3;rgb:f/8/0\a") A(vt_color_rgb(vt, VT_YELLOW) == 0xff8800)
+        W("\e]104;1\a") A(vt_color_rgb(vt, VT_RED) == 0x800000 && vt_color_rgb(vt, VT_GREEN) == 0x102030)
+        A(vt_color_rgb(vt, VT_COLOR_BACKGROUND) == vt_color_rgb(vt, VT_BLACK))
+        W("\e]11;rgb:1111/2222/3333;#445566\a") A(vt_color_rgb(vt, VT_COLOR_BACKGROUND) == 0x112233 && vt_color_rgb(vt, VT_COLOR_CURSOR) == 0x445566)
+        W("\e]111\a") A(vt_color_rgb(vt, VT_COLOR_BACKGROUND) == 0)
+        while (vt_next_event(vt, NULL)) {}
+        // payloads over the limit are dropped, and the parser recovers
+        W("\e]0;")
+        for (int i = 0; i < 1000; ++i)
+            W("0123456789")
+        W("\a")
+        while (vt_next_event(vt, &e)) A(e.type == VT_EVENT_CURSOR_MOVED)
+        W("\eP+q544e\e\\") W("\e_Gi=1;AAAA\e\\") W("\e]0;aborted\x18") A(!vt_next_event(vt, &e))
+        W("\e]0;cut\e[2Cx") ACH(0, 2, 'x')                                      // ESC inside the string starts a new sequence
+        vt_free(vt);
+#undef TEXT
+    }
+
+    // hyperlinks
+    {
+        VTConfig link_config = VT_DEFAULT_CONFIG;
+        link_config.scrollback_lines = 2;
+        VT* vt = vt_new(2, 10, &link_config, NULL);
+        VTHyperlinkRange ranges[4];
+        A(vt_hyperlink(vt, 0, 0) == NULL && vt_row_hyperlinks(vt, 0, ranges, 4) == 0)
+        W("a\e]8;;http://x.org\e\\link\e]8;;\e\\ b\e]8;id=1;http://y.org\alk\e]8;;\a")
+        A(vt_hyperlink(vt, 0, 0) == NULL && strcmp(vt_hyperlink(vt, 0, 1), "http://x.org") == 0 && strcmp(vt_hyperlink(vt, 0, 8), "http://y.org") == 0)
+        A(vt_row_hyperlinks(vt, 0, ranges, 4) == 2)
+        A(ranges[0].column_start == 1 && ranges[0].column_end == 4 && ranges[1].column_start == 7 && ranges[1].column_end == 8)
+        A(vt_cell(vt, 0, 1).link == vt_cell(vt, 0, 4).link && vt_cell(vt, 0, 5).link == 0)
+        W("\r\n\e]8;;http://x.org\aX\e]8;;\a") A(vt_cell(vt, 1, 0).link == vt_cell(vt, 0, 1).link)   // same URI, same entry
+        W("\r\n") A(strcmp(vt_hyperlink(vt, -1, 2), "http://x.org") == 0 && strcmp(vt_hyperlink(vt, 0, 0), "http://x.org") == 0)
+        uint16_t old = vt_cell(vt, 0, 0).link;
+        W("\e[2J\e[3J") A(vt_hyperlink_uri(vt, old) == NULL)                    // released when no cell uses it anymore
+        W("\e[H\e]8;;http://z.org\aZ\e[H") A(strcmp(vt_hyperlink(vt, 0, 0), "http://z.org") == 0)
+        old = vt_cell(vt, 0, 0).link;
+        W(".") A(vt_hyperlink(vt, 0, 0) != NULL)                                   // still open, so still referenced
+        W("\e]8;;\a\e[H.") A(vt_hyperlink(vt, 0, 0) == NULL && vt_hyperlink_uri(vt, old) == NULL)
+        vt_free(vt);
+
+        vt = vt_new(4, 10, &link_config, NULL);                      // rows moving over each other keep their links
+        W("\r\n\e]8;;http://x.org\aab\e]8;;\a\r\n\e]8;;http://y.org\acd\e]8;;\a\e[4H\n")
+        A(strcmp(vt_hyperlink(vt, 0, 0), "http://x.org") == 0 && strcmp(vt_hyperlink(vt, 1, 1), "http://y.org") == 0)
+        W("\e[H\e[L") A(strcmp(vt_hyperlink(vt, 1, 0), "http://x.org") == 0 && strcmp(vt_hyperlink(vt, 2, 1), "http://y.org") == 0)
+        W("\e[2;1H\e[2@") A(strcmp(vt_hyperlink(vt, 1, 3), "http://x.org") == 0 && vt_hyperlink(vt, 1, 1) == NULL)
+        W("\e[3P") A(strcmp(vt_hyperlink(vt, 1, 0), "http://x.org") == 0 && vt_hyperlink(vt, 1, 1) == NULL)
+        vt_free(vt);
+    }
+
+    // replies
+    {
+        char buf[128];
+#define REPLY(input, expected) { W(input) size_t n = vt_read_reply(vt, buf, sizeof buf); A(n == strlen(expected) && memcmp(buf, expected, n) == 0) }
+        R REPLY("\e[5n", "\e[0n") REPLY("\e[3;7H\e[6n", "\e[3;7R") REPLY("\e[?6n", "\e[?3;7;1R")
+        REPLY("\e[c", "\e[?1;2c") REPLY("\e[0c", "\e[?1;2c") REPLY("\e[>c", "\e[>0;200;0c") REPLY("\e[=c", "\eP!|00000000\e\\")
+        REPLY("\e[?2004$p", "\e[?2004;2$y") REPLY("\e[?2004h\e[?2004$p", "\e[?2004;1$y") REPLY("\e[?9999$p", "\e[?9999;0$y")
+        REPLY("\e[4$p", "\e[4;2$y") REPLY("\e[>q", "\eP>|libvirtterm(" LIBVIRTTERM_VERSION ")\e\\") REPLY("\e[18t", "\e[8;10;20t")
+        REPLY("\eP+q544e;436f;78\e\\", "\eP1+r544e=787465726D\e\\\eP1+r436f=3136\e\\\eP0+r78\e\\")
+        REPLY("\e]4;1;?\a", "\e]4;1;rgb:8080/0000/0000\a") REPLY("\e]11;?\e\\", "\e]11;rgb:0000/0000/0000\e\\")
+        REPLY("\e[>1u\e[?u", "\e[?1u")
+        W("\e[6n\e[6n") A(vt_read_reply(vt, buf, 4) == 4 && vt_read_reply(vt, buf, sizeof buf) == 8)   // partial reads
+        A(vt_read_reply(vt, buf, sizeof buf) == 0)
+#undef REPLY
+    }
+
+    // tab stops
+    R W("\t") ACU(0, 8) W("\t") ACU(0, 16) W("\t") ACU(0, 19)
+    R W("\e[3I") ACU(0, 19) W("\e[Z") ACU(0, 16) W("\e[2Z") ACU(0, 0)              // CHT, CBT
+    R W("\e[5G\eH\e[G\t") ACU(0, 4) W("\t") ACU(0, 8)                             // HTS
+    R W("\e[9G\e[g\e[G\t") ACU(0, 16)                                             // TBC 0
+    R W("\e[3g\t") ACU(0, 19) W("\e[?5W\e[G\t") ACU(0, 8)                          // TBC 3, DECST8C
+    R W("\e[3g") vt_resize(vt, 10, 100); W("\t") ACU(0, 24)                          // new columns get the default stops
+      W("\e[60G\t") ACU(0, 64) W("\e[70G\e[Z") ACU(0, 64) W("\e[Z") ACU(0, 56)
+      vt_resize(vt, 10, 20);
+
+    // left/right margins and rectangular areas
+    R W("aaaaaaaaaaaaaaaaaaaabbbbbbbbbbbbbbbbbbbbcccccccccccccccccccc\e[?69h\e[5;10s\e[1;3r") { while (vt_next_event(vt, &e)); }
+      W("\e[S") CMP(0, 3, "abbbbbba") CMP(1, 3, "bccccccb") CMP(2, 3, "c      c")                  // SU between the margins
+      while (vt_next_event(vt, &e)) { A(e.type != VT_EVENT_SCROLLED) }
+      W("\e[2;5H\e[L") CMP(1, 3, "b      b") CMP(2, 3, "cccccccc")                                 // IL
+      A(vt_mode_value(vt, true, 69) == 1)
+    R W("\e[?69h\e[3;6s\e[1;3Habcdefg") CMP(0, 2, "abcd") ACH(0, 6, ' ') CMP(1, 2, "efg")          // wraps on the margin
+      W("\r") ACU(1, 2) W("\e[?69l") ACH(0, 2, 'a') W("\e[5;10s") ACU(1, 2)                         // no DECSLRM when reset
+    R W("0123456789\e[?69h\e[3;6s\e[1;3H\e[2@") CMP(0, 0, "01  236789")                            // ICH
+      W("\e[P") CMP(0, 0, "01 23 6789")                                                              // DCH
+    R W("0123456789\e[?69h\e[3;6s\e[1;4H\e['}") CMP(0, 0, "012 346789") W("\e['~") CMP(0, 0, "01234 6789")   // DECIC, DECDC
+    R W("ab\r\ncd\e[1;1;2;2;1;5;10;1$v") CMP(4, 9, "ab") CMP(5, 9, "cd") CMP(0, 0, "ab")               // DECCRA
+      W("\e[88;2;2;3;4$x") CMP(1, 0, "cXXX") CMP(2, 1, "XXX") ACH(3, 1, ' ')                          // DECFRA
+      W("\e[2;2;2;3$z") CMP(1, 0, "c  X")                                                           // DECERA
+      W("\e[1;1;2;2;1;10;20;1$v") ACH(9, 19, 'a') ACH(9, 18, ' ')                                     // clipped to the screen
+
+    // batched cursor moves and SGR
+    R { while (vt_next_event(vt, &e)); }
+      W("\e[2;2H\e[3;3H\e[0m\e[4;4H") A(vt_next_event(vt, &e) && e.type == VT_EVENT_CURSOR_MOVED) A(!vt_next_event(vt, &e)) ACU(3, 3)
+      W("\e[1;31;0;32m") A(!vt->current_attrib.bold && vt->current_attrib.fg_color == VT_GREEN)
+      W("\e[38;5;200;1m\e[48;2;1;2;3;4m") A(vt->current_attrib.bold && vt->current_attrib.underline && vt->current_attrib.fg_color == VT_GREEN)
+      W("\e[m") A(!vt->current_attrib.bold && vt->current_attrib.fg_color == vt->config.default_fg_color)
+
+    // row hashes
+    {
+        R W("hello\r\nhello\r\n\e[1mhello\e[m") A(vt_row_hash(vt, 0) == vt_row_hash(vt, 1)) A(vt_row_hash(vt, 0) != vt_row_hash(vt, 2))
+        A(vt_row_hash(vt, 3) == vt_row_hash(vt, 4) && vt_row_hash(vt, 0) != vt_row_hash(vt, 3))
+        uint64_t h = vt_row_hash(vt, 0);
+        W("\e[1;1Hj") A(vt_row_hash(vt, 0) != h) W("\e[1;1Hh") A(vt_row_hash(vt, 0) == h)          // same content, same hash
+        W("\e[10;1H\n") A(vt_row_hash(vt, 0) == h && vt_row_hash(vt, 1) != h)                     // moved with the scroll
+        W("\e[?1049h") A(vt_row_hash(vt, 0) == vt_row_hash(vt, 5)) W("\e[?1049l") A(vt_row_hash(vt, 0) == h)
+        vt_resize(vt, 10, 30); A(vt_row_hash(vt, 0) == vt_row_hash(vt, 9)) vt_resize(vt, 10, 20);
+    }
+
+    // scroll events
+    {
+#define NEXT_EVENT(t) { do A(vt_next_event(vt, &e)) while (e.type == VT_EVENT_CURSOR_MOVED); A(e.type == t) }
+#define DRAIN { while (vt_next_event(vt, &e)); }
+        R W("\e[10;1H") DRAIN
+        W("X\n")                                                          // the update of row 9 moves up with the scroll
+        NEXT_EVENT(VT_EVENT_SCROLLED) A(e.scroll.row_start == 0 && e.scroll.row_end == 9 && e.scroll.rows == 1)
+        NEXT_EVENT(VT_EVENT_CELLS_UPDATED) A(e.cells.row_start == 8 && e.cells.row_end == 9)
+        NEXT_EVENT(VT_EVENT_CELLS_UPDATED) A(e.cells.row_start == 9 && e.cells.row_end == 9 && e.cells.column_end == 19)
+        while (vt_next_event(vt, &e)) A(e.type == VT_EVENT_CURSOR_MOVED)
+
+        W("\n\n\n") DRAIN W("\n\n\n")                                     // consecutive scrolls are merged
+        NEXT_EVENT(VT_EVENT_SCROLLED) A(e.scroll.rows == 3)
+        NEXT_EVENT(VT_EVENT_CELLS_UPDATED) A(e.cells.row_start == 7 && e.cells.row_end == 9)
+        DRAIN
+
+        R W("\e[3;6r\e[3;1H") DRAIN W("\eM\eM")                                  // reverse scroll inside a region
+        NEXT_EVENT(VT_EVENT_SCROLLED) A(e.scroll.row_start == 2 && e.scroll.row_end == 5 && e.scroll.rows == -2)
+        NEXT_EVENT(VT_EVENT_CELLS_UPDATED) A(e.cells.row_start == 2 && e.cells.row_end == 3)
+        DRAIN
+#undef DRAIN
+#undef NEXT_EVENT
+    }
+
+    // software rendering
+    {
+        uint8_t font_pixels[32 * 32] = { 0 };                  // 2x2 glyphs, 16 per row: only 'A' has ink
+        for (int y = 8; y < 10; ++y) font_pixels[y * 32 + 2] = font_pixels[y * 32 + 3] = 0xFF;
+        VTFont font = { .pixels = font_pixels, .width = 32, .height = 32, .glyph_width = 2, .glyph_height = 2 };
+        uint32_t pixels[20 * 2 * 10 * 2], fg, bg;
+        uint16_t pixels565[20 * 2 * 10 * 2];
+        size_t pitch = 20 * 2 * sizeof(uint32_t);
+        memcpy(&fg, (uint8_t[]) { vt_color_rgb(vt, VT_WHITE) >> 16, (vt_color_rgb(vt, VT_WHITE) >> 8) & 0xFF, vt_color_rgb(vt, VT_WHITE) & 0xFF, 0xFF }, 4);
+        memcpy(&bg, (uint8_t[]) { 0, 0, 0, 0xFF }, 4);
+#define FEED(rd) { while (vt_next_event(vt, &e)) vtrender_damage(rd, &e); }
+        R W("\e[?25l\e[3;1HA") VTRender* rd = vtrender_new(vt, &font, VTR_RGBA8888);
+        A(vtrender_width(rd) == 40 && vtrender_height(rd) == 20)
+        FEED(rd) A(vtrender_draw(rd, pixels, pitch) == 200)                       // first frame draws everything
+        A(pixels[4 * 40 + 0] == fg && pixels[5 * 40 + 1] == fg && pixels[4 * 40 + 2] == bg)
+        A(vtrender_draw(rd, pixels, pitch) == 0)                                   // nothing changed
+        W("\e[3;2HA") FEED(rd) A(vtrender_draw(rd, pixels, pitch) == 1) A(pixels[4 * 40 + 2] == fg)
+        W("\e[10;1H\n") FEED(rd) A(vtrender_draw(rd, pixels, pitch) == 0)       // scrolled pixels are moved, not drawn
+        A(pixels[2 * 40 + 0] == fg && pixels[2 * 40 + 2] == fg && pixels[4 * 40 + 0] == bg)
+        vtrender_free(rd);
+
+        rd = vtrender_new(vt, &font, VTR_RGB565);
+        FEED(rd) vtrender_draw(rd, pixels565, 20 * 2 * sizeof(uint16_t));
+        A(pixels565[2 * 40 + 0] == 0xC618 && pixels565[4 * 40 + 0] == 0)                  // 0xC0C0C0
+        vtrender_free(rd);
+#undef FEED
+    }
+
+    // key translation
+    {
+        char buf[16];
+#define KEY(key, mod, expected) { int n = vt_translate_key_mod(vt, key, mod, buf, sizeof buf); A(n == (int) strlen(expected) && memcmp(buf, expected, n) == 0) }
+        R KEY('a', 0, "a") KEY('a', VTK_ALT, "\ea") KEY('c', VTK_CTRL, "\x03") KEY('c', VTK_CTRL | VTK_ALT, "\e\x03")
+        KEY(VT_ARROW_UP, 0, "\e[A") KEY(VT_ARROW_UP, VTK_CTRL, "\e[1;5A") KEY(VT_ARROW_UP, VTK_SHIFT | VTK_ALT, "\e[1;4A")
+        KEY(VT_F1, 0, "\eOP") KEY(VT_F1, VTK_SHIFT, "\e[1;2P") KEY(VT_F5, VTK_CTRL, "\e[15;5~") KEY(VT_INSERT, VTK_SHIFT, "\e[2;2~")
+        KEY(VT_BACKSPACE, 0, "\b") KEY(VT_BACKSPACE, VTK_SHIFT, "\x7f") KEY(VT_TAB, VTK_SHIFT, "\e[Z") KEY(VT_TAB, VTK_ALT, "\e\t")
+        KEY(VT_KP_5, 0, "5") KEY(VT_KP_ENTER, 0, "\r")
+        W("\e[?1h") KEY(VT_ARROW_UP, 0, "\eOA") KEY(VT_HOME, 0, "\eOH") KEY(VT_HOME, VTK_CTRL, "\e[1;5H")
+        W("\e=") KEY(VT_KP_5, 0, "\eOu") KEY(VT_KP_ENTER, 0, "\eOM") KEY(VT_KP_PLUS, VTK_CTRL, "\eO5k") W("\e>") KEY(VT_KP_5, 0, "5")
+        KEY('a', 0, "a") A(vt_translate_key(vt, VT_INSERT, true, false, buf, sizeof buf) == 6)
+        // kitty keyboard protocol
+        R W("\e[>1u") KEY('a', 0, "a") KEY('A', VTK_SHIFT, "A") KEY(VT_ESC, 0, "\e[27u") KEY('c', VTK_CTRL, "\e[99;5u")
+        KEY('\r', 0, "\r") KEY('\r', VTK_ALT, "\e[13;3u") KEY(VT_ARROW_UP, 0, "\e[A")
+        W("\e[=9;1u") KEY('a', 0, "\e[97u") W("\e[<u") KEY(VT_ESC, 0, "\e") KEY('c', VTK_CTRL, "\x03")
+#undef KEY
+    }
+
     // page scroll up
     R W("0123456789abcdefghij\EH")
 
+    // scrollback (in memory, then file-backed)
+    {
+        VTConfig sb_config = config;
+        sb_config.scrollback_lines = 2;
+        VT* vt = vt_new(2, 4, &sb_config, NULL);
+        VTScrollback* sb = vtsb_new(vt, "/tmp", 4096);
+        VTCell row[4];
+
+        W("aaaa\r\nbbbb\r\ncccc\r\ndddd\r\neeee")
+        A(vt_scrollback_lines(vt) == 3 && vtsb_lines(sb) == 1)
+        A(vt_scrollback_row(vt, 0, row, 4, NULL) == 4 && row[0].ch == 'c')
+        A(vt_scrollback_row(vt, 1, row, 4, NULL) == 4 && row[0].ch == 'b')
+        A(vt_scrollback_row(vt, 2, row, 4, NULL) == 4 && row[3].ch == 'a')
+        A(vt_scrollback_row(vt, 3, row, 4, NULL) == 0)
+
+        W("\e[3J") A(vt_scrollback_lines(vt) == 0)
+
+        for (int i = 0; i < 1000; ++i) {   // crosses several segments
+            char buf[8]; sprintf(buf, "\r\n%04d", i);
+            W(buf)
+        }
+        A(vt_scrollback_lines(vt) == 1000)
+        A(vt_scrollback_row(vt, 999, row, 4, NULL) == 4 && row[0].ch == 'd')
+        A(vt_scrollback_row(vt, 997, row, 4, NULL) == 4 && memcmp((char[]) { row[0].ch, row[1].ch, row[2].ch, row[3].ch }, "0000", 4) == 0)
+        A(vt_scrollback_row(vt, 500, row, 4, NULL) == 4 && memcmp((char[]) { row[0].ch, row[1].ch, row[2].ch, row[3].ch }, "0497", 4) == 0)
+
+        vtsb_close(sb);
+        vt_free(vt);
+    }
+
+    // search
+    {
+        VTConfig sb_config = config;
+        sb_config.scrollback_lines = 100;
+        VT* vt = vt_new(2, 10, &sb_config, NULL);
+        VTSearch* s = vtsearch_new(vt);
+        VTSearchMatch const* m;
+
+        W("hello foo\r\nbar\r\nfoo bar\r\nHello")
+        A(vtsearch_start(s, "foo", VTS_LITERAL, 0)) vtsearch_wait(s);
+        A(vtsearch_matches(s, &m) == 2)
+        A(m[0].row == -2 && m[0].column_start == 6 && m[0].column_end == 8)
+        A(m[1].row == 0 && m[1].column_start == 0 && m[1].column_end == 2)
+        A(vtsearch_indexed_lines(s) == 2)
+
+        A(vtsearch_start(s, "HELLO", VTS_IGNORE_CASE, 0)) vtsearch_wait(s);
+        A(vtsearch_matches(s, &m) == 2 && m[0].row == -2 && m[1].row == 1)
+
+        A(vtsearch_start(s, "^[Hh]el+o", VTS_REGEX, 0)) vtsearch_wait(s);
+        A(vtsearch_matches(s, &m) == 2 && m[0].row == -2 && m[1].row == 1 && m[1].column_end == 4)
+
+        A(vtsearch_start(s, "bar", VTS_LITERAL, 1)) vtsearch_wait(s);
+        A(vtsearch_matches(s, &m) == 1 && m[0].row == -1)
+
+        A(!vtsearch_start(s, "(", VTS_REGEX, 0))
+
+        W("\e[3J")
+        A(vtsearch_start(s, "foo", VTS_LITERAL, 0)) vtsearch_wait(s);
+        A(vtsearch_matches(s, &m) == 1 && m[0].row == 0 && vtsearch_indexed_lines(s) == 0)
+
+        for (int i = 0; i < 500; ++i) {                             // lines dropped by the VT are dropped from the index
+            char line[16];
+            snprintf(line, sizeof line, "\r\nl%d", i);
+            W(line)
+            if (i % 64 == 0) {                                      // index updated along the way
+                A(vtsearch_start(s, "l1", VTS_LITERAL, 0)) vtsearch_wait(s);
+            }
+        }
+        A(vtsearch_start(s, "l42", VTS_LITERAL, 0)) vtsearch_wait(s);
+        A(vtsearch_matches(s, &m) == 10 && m[0].row == -78 && vtsearch_indexed_lines(s) == 100)    // l420..l429
+        A(vtsearch_start(s, "l4[0-9]9", VTS_REGEX, 0)) vtsearch_wait(s);
+        A(vtsearch_matches(s, &m) == 10 && m[8].row == -9 && m[9].row == 1)                     // l409..l499
+
+        vtsearch_free(s);
+        vt_free(vt);
+
+        vt = vt_new(2, 40, &sb_config, NULL);                       // a regex only sees the row, not what was there before
+        s = vtsearch_new(vt);
+        W("0123456789012345678901234567890123_foo\r\n\r\n")
+        vt_resize(vt, 2, 10);
+        A(vtsearch_start(s, "foo", VTS_REGEX, 0)) vtsearch_wait(s);
+        A(vtsearch_matches(s, &m) == 1 && m[0].row < 0 && m[0].column_start == 35)
+        vtsearch_free(s);
+        vt_free(vt);
+
+        sb_config.scrollback_lines = 4;                             // the VT can be read while a search runs
+        vt = vt_new(2, 10, &sb_config, NULL);
+        VTScrollback* sb = vtsb_new(vt, "/tmp", 4096);
+        for (int i = 0; i < 3000; ++i) {
+            char line[16];
+            snprintf(line, sizeof line, "l%d\r\n", i);
+            W(line)
+        }
+        s = vtsearch_new(vt);
+        A(vtsearch_start(s, "l2[0-9]*7$", VTS_REGEX, 0))
+        VTCell cells[10];
+        for (size_t i = 0; !vtsearch_done(s); i += 97)              // segments are mapped and unmapped on both threads
+            A(vt_scrollback_row(vt, i % vt_scrollback_lines(vt), cells, 10, NULL) > 0 && vt_cell(vt, 0, 0).ch == 'l')
+        A(vtsearch_matches(s, &m) == 111 && m[0].row == -2972)     // l27, l207...l297, l2007...l2997
+        vtsearch_free(s);
+        vtsb_close(sb);
+        vt_free(vt);
+    }
+
+    // selection
+    {
+        VTConfig sb_config = config;
+        sb_config.scrollback_lines = 10;
+        VT* vt = vt_new(3, 10, &sb_config, NULL);
+
+        W("one two\r\nthis wraps around\r\nlast")
+        vt_selection_start(vt, VT_SELECT_CHARACTER, -1, 4); vt_selection_extend(vt, 1, 7);
+        A(strcmp(selection_text(vt, VT_TEXT_PLAIN), "two\nthis wraps around") == 0)
+        A(vt_selected(vt, 0, 0) && vt_selected(vt, -1, 4) && !vt_selected(vt, -1, 3) && !vt_selected(vt, 1, 8))
+
+        vt_selection_start(vt, VT_SELECT_WORD, 0, 6);
+        A(strcmp(selection_text(vt, VT_TEXT_PLAIN), "wraps") == 0)
+
+        vt_selection_start(vt, VT_SELECT_LINE, 1, 3);
+        A(strcmp(selection_text(vt, VT_TEXT_PLAIN), " around") == 0)
+
+        vt_selection_start(vt, VT_SELECT_RECTANGLE, 0, 2); vt_selection_extend(vt, -1, 0);
+        A(strcmp(selection_text(vt, VT_TEXT_PLAIN), "one\nthi") == 0)
+
+        vt_selection_start(vt, VT_SELECT_CHARACTER, 2, 0); vt_selection_extend(vt, 2, 9);
+        A(strcmp(selection_text(vt, VT_TEXT_SGR), "\e[0;37;40mlast\e[0m") == 0)
+
+        W("\r\n\xe9")   // selection follows the text into the scrollback
+        A(strcmp(selection_text(vt, VT_TEXT_PLAIN), "last") == 0)
+        vt_selection_start(vt, VT_SELECT_LINE, 2, 0);
+        A(strcmp(selection_text(vt, VT_TEXT_PLAIN), "\xc3\xa9") == 0)
+
+        vt_selection_clear(vt);
+        A(selection_text(vt, VT_TEXT_PLAIN)[0] == '\0')
+        vt_free(vt);
+
+        vt = vt_new(3, 10, &sb_config, NULL);                       // columns past the edges stop at them
+        W("hello you\r\n\r\nlast")
+        vt_selection_start(vt, VT_SELECT_WORD, 0, -1);
+        A(strcmp(selection_text(vt, VT_TEXT_PLAIN), "hello") == 0)
+        vt_selection_start(vt, VT_SELECT_CHARACTER, 1, -5); vt_selection_extend(vt, 1, -2);
+        A(selection_text(vt, VT_TEXT_PLAIN)[0] == '\0' && vt_selected(vt, 1, 0))
+        vt_selection_start(vt, VT_SELECT_CHARACTER, 0, 200); vt_selection_extend(vt, 2, -3);
+        A(strcmp(selection_text(vt, VT_TEXT_PLAIN), "\n\nl") == 0 && !vt_selected(vt, 0, 8) && vt_selected(vt, 0, 9))
+        vt_free(vt);
+
+        // scrollback rows are read into a row as wide as the terminal, which fits in a small arena
+        static max_align_t memory[32 * 1024 / sizeof(max_align_t)];
+        VTAllocator allocator = vt_arena_allocator(vt_arena_new(memory, sizeof memory));
+        vt = vt_new(3, 10, &sb_config, &allocator);
+        W("\e]8;;http://x.org\a0123\e]8;;\a456789\r\n\n\n")
+        vt_selection_start(vt, VT_SELECT_WORD, -1, 3);
+        A(strcmp(selection_text(vt, VT_TEXT_PLAIN), "0123456789") == 0)
+        VTHyperlinkRange range;
+        A(strcmp(vt_hyperlink(vt, -1, 3), "http://x.org") == 0 && vt_hyperlink(vt, -1, 4) == NULL)
+        A(vt_row_hyperlinks(vt, -1, &range, 1) == 1 && range.column_end == 3)
+        vt_free(vt);
+    }
+
 
     vt_free(vt);
 }
\ No newline at end of file
@@ -0,0 +1,349 @@
+// vttest runner: runs vttest (https://invisible-island.net/vttest/) in a terminal through vtpty, answers its
+// menus, and compares each screen with a golden one saved as text. Everything vttest sends is recorded, so the same run
+// can be replayed later without vttest - which also makes it a realistic and repeatable parsing workload.
+//
+//   libvirtterm-vttest [-u] [-p PROGRAM] [-m MENUS] DIR    run vttest, record it in DIR/recording
+//   libvirtterm-vttest [-u] -r DIR                         replay DIR/recording
+//
+//   -u         save the screens as the golden ones (DIR/NAME.txt) instead of comparing them
+//   -p         the vttest executable (default: vttest, from the PATH)
+//   -m         the menu entries to run, separated by spaces; "11.1.2" is entry 2 of the menu of entry 1 of the menu of
+//              entry 11 (DEFAULT_MENUS are the ones made only of screens to look at, without submenus)
+//
+// For each screen, the time taken to parse what vttest sent is printed (when running vttest, that includes reading it
+// from the PTY). A screen is captured every time vttest asks for <RETURN>; screens are named after the menu entry
+// and their number in it (3.8-2 is the second screen of entry 8 of the menu of entry 3).
+
+#define _POSIX_C_SOURCE 200809L
+#include "libvirtterm.h"
+#include "libvirtterm_pty.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROWS          24                // what vttest expects
+#define COLUMNS       80
+#define IDLE_MS       300               // vttest is waiting for input when it hasn't sent anything for this long
+#define TIMEOUT_MS    10000
+#define DEFAULT_MENUS "1 2 4 7 8"
+
+#define MAIN_MENU     "VT100 test program"
+#define MENU_PROMPT   "Enter choice number"
+#define RETURN_PROMPT "Push <RETURN>"
+
+typedef struct Runner {
+    const char* dir;
+    bool        update;
+    VT*         vt;
+    VTPTY*      pty;
+
+    // what vttest sent since the last screen
+    char*       received;
+    size_t      received_sz, received_capacity;
+    double      parse_ms;
+
+    FILE*       recording;
+    int         passed, failed, added;
+    double      total_ms;
+    size_t      total_bytes;
+} Runner;
+
+static double now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static void receive(const char* data, size_t sz, void* r_)
+{
+    Runner* r = r_;
+    if (r->received_sz + sz > r->received_capacity) {
+        r->received_capacity = (r->received_sz + sz) * 2;
+        r->received = realloc(r->received, r->received_capacity);
+    }
+    memcpy(&r->received[r->received_sz], data, sz);
+    r->received_sz += sz;
+}
+
+//
+// screens
+//
+
+static void screen_text(VT* vt, char text[ROWS][COLUMNS + 1])   // one line per row, trailing spaces removed
+{
+    for (INT row = 0; row < ROWS; ++row) {
+        for (INT column = 0; column < COLUMNS; ++column)
+            text[row][column] = (char) vt_cell(vt, row, column).ch;
+        INT end = COLUMNS;
+        while (end > 0 && text[row][end - 1] == ' ')
+            --end;
+        text[row][end] = '\0';
+    }
+}
+
+static bool screen_contains(VT* vt, const char* str)
+{
+    char text[ROWS][COLUMNS + 1];
+    screen_text(vt, text);
+    for (INT row = 0; row < ROWS; ++row)
+        if (strstr(text[row], str))
+            return true;
+    return false;
+}
+
+static bool read_golden(Runner* r, const char* name, char golden[ROWS][COLUMNS + 1])
+{
+    char path[1024];
+    snprintf(path, sizeof path, "%s/%s.txt", r->dir, name);
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return false;
+    for (INT row = 0; row < ROWS; ++row) {
+        char line[COLUMNS * 2];
+        golden[row][0] = '\0';
+        if (fgets(line, sizeof line, f)) {
+            size_t end = strcspn(line, "\n");
+            line[end < COLUMNS ? end : COLUMNS] = '\0';
+            memcpy(golden[row], line, strlen(line) + 1);
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static void write_golden(Runner* r, const char* name, char text[ROWS][COLUMNS + 1])
+{
+    char path[1024];
+    snprintf(path, sizeof path, "%s/%s.txt", r->dir, name);
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    for (INT row = 0; row < ROWS; ++row)
+        fprintf(f, "%s\n", text[row]);
+    fclose(f);
+}
+
+// compares the screen with the golden one (or saves it), and records what vttest sent to get there
+static void capture(Runner* r, const char* name)
+{
+    char text[ROWS][COLUMNS + 1], golden[ROWS][COLUMNS + 1];
+    screen_text(r->vt, text);
+
+    const char* result = "ok";
+    int different = 0;
+    if (r->update) {
+        write_golden(r, name, text);
+        result = "saved";
+    } else if (!read_golden(r, name, golden)) {
+        result = "new";
+        ++r->added;
+    } else {
+        for (INT row = 0; row < ROWS; ++row)
+            different += strcmp(text[row], golden[row]) != 0;
+        different ? ++r->failed : ++r->passed;
+        if (different)
+            result = "FAILED";
+    }
+    printf("%-12s %8zu bytes %9.3f ms  %s\n", name, r->received_sz, r->parse_ms, result);
+    for (INT row = 0; row < ROWS && different; ++row)
+        if (strcmp(text[row], golden[row]) != 0)
+            printf("    row %2d expected |%s|\n           got      |%s|\n", row + 1, golden[row], text[row]);
+
+    if (r->recording) {
+        fprintf(r->recording, "screen %s %zu\n", name, r->received_sz);
+        fwrite(r->received, 1, r->received_sz, r->recording);
+        fputc('\n', r->recording);
+    }
+    r->total_ms += r->parse_ms;
+    r->total_bytes += r->received_sz;
+    r->received_sz = 0;
+    r->parse_ms = 0;
+}
+
+//
+// running vttest
+//
+
+// reads what vttest sends until it stops (and is waiting for input); false if it exited
+static bool wait_idle(Runner* r)
+{
+    double start = now_ms(), last = start;
+    while (now_ms() - last < IDLE_MS && now_ms() - start < TIMEOUT_MS) {
+        struct pollfd fd = { .fd = vtpty_fd(r->pty), .events = POLLIN };
+        if (poll(&fd, 1, 20) <= 0)
+            continue;
+        double t = now_ms();
+        VTPTYStatus status = vtpty_step(r->pty);
+        r->parse_ms += now_ms() - t;
+        while (vt_next_event(r->vt, NULL));
+        if (status != VTP_CONTINUE)
+            return false;
+        last = now_ms();
+    }
+    return true;
+}
+
+static bool send(Runner* r, const char* keys)
+{
+    return vtpty_paste(r->pty, keys, strlen(keys)) == VTP_CONTINUE && wait_idle(r);
+}
+
+// runs a menu entry like "11.1.2": the entries in each submenu, then every screen until the main menu is back
+static bool run_entry(Runner* r, const char* entry)
+{
+    char path[64];
+    snprintf(path, sizeof path, "%s", entry);
+    char* save;
+    for (char* choice = strtok_r(path, ".", &save); choice; choice = strtok_r(NULL, ".", &save)) {
+        if (!screen_contains(r->vt, MENU_PROMPT)) {
+            fprintf(stderr, "%s: no menu to choose %s from\n", entry, choice);
+            return false;
+        }
+        char keys[16];
+        snprintf(keys, sizeof keys, "%s\r", choice);
+        if (!send(r, keys))
+            return false;
+    }
+
+    for (int n = 1; ; ) {
+        if (screen_contains(r->vt, RETURN_PROMPT)) {
+            char name[80];
+            snprintf(name, sizeof name, "%s-%d", entry, n++);
+            capture(r, name);
+            if (!send(r, "\r"))
+                return false;
+        } else if (screen_contains(r->vt, MENU_PROMPT)) {
+            if (screen_contains(r->vt, MAIN_MENU))
+                return true;
+            if (!send(r, "0\r"))            // back to the menu above
+                return false;
+        } else {
+            fprintf(stderr, "%s: vttest is waiting for something else than <RETURN>\n", entry);
+            return false;
+        }
+    }
+}
+
+static int run_vttest(Runner* r, const char* program, const char* menus)
+{
+    char path[1024];
+    snprintf(path, sizeof path, "%s/recording", r->dir);
+    if (!(r->recording = fopen(path, "wb"))) {
+        perror(path);
+        return 1;
+    }
+
+    char* argv[] = { (char *) program, NULL };
+    r->pty = vtpty_new_command(r->vt, 4096, argv);
+    vtpty_record(r->pty, receive, r);
+    if (!wait_idle(r) || !screen_contains(r->vt, MAIN_MENU)) {
+        fprintf(stderr, "%s didn't start\n", program);
+        return 1;
+    }
+    r->received_sz = 0;
+    r->parse_ms = 0;
+
+    char list[1024];
+    snprintf(list, sizeof list, "%s", menus);
+    char* save;
+    for (char* entry = strtok_r(list, " ", &save); entry; entry = strtok_r(NULL, " ", &save)) {
+        if (!run_entry(r, entry)) {
+            fprintf(stderr, "%s: stopped\n", entry);
+            ++r->failed;
+            break;
+        }
+    }
+
+    vtpty_paste(r->pty, "0\r", 2);
+    wait_idle(r);
+    vtpty_close(r->pty);
+    fclose(r->recording);
+    return 0;
+}
+
+//
+// replaying a recording
+//
+
+static int replay(Runner* r)
+{
+    char path[1024];
+    snprintf(path, sizeof path, "%s/recording", r->dir);
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        fprintf(stderr, "(running vttest records it)\n");
+        return 1;
+    }
+
+    char name[80];
+    size_t sz;
+    while (fscanf(f, "screen %79s %zu", name, &sz) == 2 && fgetc(f) == '\n') {
+        if (sz > r->received_capacity) {
+            r->received_capacity = sz;
+            r->received = realloc(r->received, sz);
+        }
+        if (fread(r->received, 1, sz, f) != sz || fgetc(f) != '\n') {
+            fprintf(stderr, "%s: truncated\n", path);
+            return 1;
+        }
+        r->received_sz = sz;
+
+        double t = now_ms();
+        vt_write(r->vt, r->received, sz);
+        while (vt_next_event(r->vt, NULL));
+        r->parse_ms = now_ms() - t;
+
+        char reply[512];
+        while (vt_read_reply(r->vt, reply, sizeof reply) > 0);    // vttest's answers to them are in the recording
+        capture(r, name);
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    Runner r = { 0 };
+    const char* program = "vttest";
+    const char* menus = DEFAULT_MENUS;
+    bool replaying = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "urp:m:")) != -1) {
+        switch (opt) {
+            case 'u': r.update = true; break;
+            case 'r': replaying = true; break;
+            case 'p': program = optarg; break;
+            case 'm': menus = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-u] [-r] [-p PROGRAM] [-m MENUS] DIR\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-u] [-r] [-p PROGRAM] [-m MENUS] DIR\n", argv[0]);
+        return 2;
+    }
+    r.dir = argv[optind];
+
+    VTConfig config = VT_DEFAULT_CONFIG;
+    r.vt = vt_new(ROWS, COLUMNS, &config, NULL);
+
+    int status = replaying ? replay(&r) : run_vttest(&r, program, menus);
+    vt_free(r.vt);
+    free(r.received);
+    if (status != 0)
+        return status;
+
+    printf("%d ok, %d failed, %d new - %zu bytes parsed in %.3f ms (%.1f MB/s)\n", r.passed, r.failed, r.added,
+           r.total_bytes, r.total_ms, r.total_ms > 0 ? r.total_bytes / r.total_ms / 1e3 : 0.0);
+    return r.failed ? 1 : 0;
+}